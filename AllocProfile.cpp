@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+//
+// Allocation profiler: replaces the malloc family with wrappers around
+// glibc's implementation that report every allocation to Stats, so
+// allocations show up per phase and per package in the --stats report.
+//
+// Only linked into the tools if built with -DREPODATA_ALLOC_PROFILE=ON.
+#include "Stats.h"
+#include <cerrno>
+
+extern "C" {
+#include <malloc.h>
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+// Declarations in glibc headers are noexcept in C++, so the
+// definitions have to be as well
+
+void *malloc(size_t size) noexcept {
+	void *ret = __libc_malloc(size);
+	if(ret)
+		Stats::allocated(malloc_usable_size(ret));
+	return ret;
+}
+
+void *calloc(size_t nmemb, size_t size) noexcept {
+	void *ret = __libc_calloc(nmemb, size);
+	if(ret)
+		Stats::allocated(malloc_usable_size(ret));
+	return ret;
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+	size_t const oldSize = ptr ? malloc_usable_size(ptr) : 0;
+	void *ret = __libc_realloc(ptr, size);
+	if(ret || !size) {
+		if(ptr)
+			Stats::freed(oldSize);
+		if(ret)
+			Stats::allocated(malloc_usable_size(ret));
+	}
+	return ret;
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+	void *ret = __libc_memalign(alignment, size);
+	if(ret)
+		Stats::allocated(malloc_usable_size(ret));
+	return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept {
+	if(alignment % sizeof(void*) || (alignment & (alignment - 1)))
+		return EINVAL;
+	void *ret = memalign(alignment, size);
+	if(!ret)
+		return ENOMEM;
+	*memptr = ret;
+	return 0;
+}
+
+void free(void *ptr) noexcept {
+	if(!ptr)
+		return;
+	Stats::freed(malloc_usable_size(ptr));
+	__libc_free(ptr);
+}
+}
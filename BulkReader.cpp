@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "BulkReader.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+}
+
+/** Alignment required for O_DIRECT buffers and offsets */
+static constexpr size_t Alignment = 4096;
+
+BulkReader::Mode BulkReader::_mode = BulkReader::Mode::DropBehind;
+quint64 BulkReader::_rateLimit = 0;
+
+static std::mutex throttleLock;
+static std::chrono::steady_clock::time_point throttleNext;
+
+BulkReader::BulkReader(int fd):_fd(fd),_offset(std::max<off_t>(lseek(fd, 0, SEEK_CUR), 0)),_dropped(0),_drop(false),_oldFlags(-1),_buffer(static_cast<char*>(aligned_alloc(Alignment, ChunkSize))) {
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if(_mode == Mode::Cached)
+		return;
+	struct stat st;
+	if(fstat(fd, &st) || isCached(fd, st.st_size))
+		return;
+	_drop = true;
+	_dropped = _offset;
+	if(_mode == Mode::Direct && !(_offset % Alignment)) {
+		int const flags = fcntl(fd, F_GETFL);
+		if(flags >= 0 && !fcntl(fd, F_SETFL, flags|O_DIRECT))
+			_oldFlags = flags;
+	}
+}
+
+BulkReader::~BulkReader() {
+	if(_drop)
+		dropBehind(_fd, _dropped, _offset);
+	if(_oldFlags >= 0)
+		fcntl(_fd, F_SETFL, _oldFlags);
+	free(_buffer);
+}
+
+ssize_t BulkReader::read(char const **data) {
+	*data = _buffer;
+	size_t done = 0;
+	while(done < ChunkSize) {
+		ssize_t const r = ::read(_fd, _buffer + done, ChunkSize - done);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EINVAL && _oldFlags >= 0) {
+				// Some filesystems accept O_DIRECT, but not
+				// the reads -- or a short read left us at an
+				// unaligned offset
+				fcntl(_fd, F_SETFL, _oldFlags);
+				_oldFlags = -1;
+				continue;
+			}
+			if(!done)
+				return -1;
+			break;
+		}
+		if(r == 0)
+			break;
+		done += r;
+	}
+	_offset += done;
+	if(_drop && _oldFlags < 0) {
+		dropBehind(_fd, _dropped, _offset);
+		_dropped = _offset;
+	}
+	throttle(done);
+	return done;
+}
+
+bool BulkReader::setMode(String const &name) {
+	if(name == "cached")
+		_mode = Mode::Cached;
+	else if(name == "dropbehind")
+		_mode = Mode::DropBehind;
+	else if(name == "direct")
+		_mode = Mode::Direct;
+	else
+		return false;
+	return true;
+}
+
+bool BulkReader::setRateLimit(String const &limit) {
+	bool ok;
+	quint64 const value = limit.toSize(&ok);
+	if(!ok)
+		return false;
+	_rateLimit = value;
+	return true;
+}
+
+void BulkReader::throttle(size_t bytes) {
+	if(!_rateLimit || !bytes)
+		return;
+	std::chrono::steady_clock::time_point wakeup;
+	{
+		// Readers on all threads share the budget. There's no
+		// credit for idle time, so there are no bursts either.
+		std::lock_guard<std::mutex> lock(throttleLock);
+		auto const now = std::chrono::steady_clock::now();
+		if(throttleNext < now)
+			throttleNext = now;
+		throttleNext += std::chrono::nanoseconds(bytes * 1000000000ULL / _rateLimit);
+		wakeup = throttleNext;
+	}
+	std::this_thread::sleep_until(wakeup);
+}
+
+bool BulkReader::isCached(int fd, off_t size) {
+	if(size <= HeaderSize)
+		return false;
+	char c;
+	iovec iov{&c, 1};
+	off_t const probe = (HeaderSize + (size - HeaderSize) / 2) & ~static_cast<off_t>(Alignment - 1);
+	// RWF_NOWAIT fails with EAGAIN if the data isn't cached
+	return preadv2(fd, &iov, 1, probe, RWF_NOWAIT) == 1;
+}
+
+void BulkReader::dropBehind(int fd, off_t start, off_t end) {
+	if(_mode == Mode::Cached)
+		return;
+	start = std::max(start, HeaderSize);
+	if(end > start)
+		posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/**
+ * Sequential reader for package bodies.
+ *
+ * Reading all packages of a repository streams a lot of data through
+ * the page cache, evicting things that are actually in use (such as
+ * files a mirror's web server is serving). Depending on the mode,
+ * BulkReader either drops pages behind the read position or bypasses
+ * the page cache with O_DIRECT. Files that were cached before we
+ * started reading them are left alone.
+ *
+ * All reads through BulkReader are subject to a global bandwidth limit.
+ */
+class BulkReader {
+public:
+	enum class Mode {
+		/// Plain reads, leaving everything in the page cache
+		Cached = 0,
+		/// Drop pages from the page cache after reading them
+		DropBehind,
+		/// Bypass the page cache (O_DIRECT) where possible,
+		/// falls back to DropBehind otherwise
+		Direct
+	};
+	/** Size of the chunks returned by read() */
+	static constexpr size_t ChunkSize = 1024 * 1024;
+	/**
+	 * Amount of data at the start of a package that is kept in the
+	 * page cache -- enough for the headers of almost all packages,
+	 * which are read separately by Rpm
+	 */
+	static constexpr off_t HeaderSize = 256 * 1024;
+
+	/**
+	 * @param fd File to read, starting at the current position.
+	 *        Not closed by BulkReader.
+	 */
+	BulkReader(int fd);
+	~BulkReader();
+	/**
+	 * Read the next chunk (ChunkSize bytes unless the end of the
+	 * file is reached)
+	 * @param data Set to the chunk's data, valid until the next call
+	 * @return Number of bytes read, 0 at the end of the file, -1 on error
+	 */
+	ssize_t read(char const **data);
+
+	static void setMode(Mode m) { _mode = m; }
+	static Mode mode() { return _mode; }
+	/**
+	 * Set the mode by name (cached, dropbehind, direct)
+	 * @return \c false if the name isn't known
+	 */
+	static bool setMode(String const &name);
+	/**
+	 * Limit the bandwidth used by all readers
+	 * @param limit Bytes per second, with an optional K, M or G
+	 *        suffix, 0 for unlimited
+	 * @return \c false if \p limit can't be parsed
+	 */
+	static bool setRateLimit(String const &limit);
+	/**
+	 * Wait until reading another \p bytes bytes fits into the
+	 * bandwidth limit. For reads not done through BulkReader.
+	 */
+	static void throttle(size_t bytes);
+	/**
+	 * Check if a file's contents were in the page cache already
+	 * (by checking if a page in its middle is)
+	 */
+	static bool isCached(int fd, off_t size);
+	/**
+	 * Drop the part of [start, end) after the headers from the page
+	 * cache (if the mode asks for it)
+	 */
+	static void dropBehind(int fd, off_t start, off_t end);
+private:
+	int	_fd;
+	off_t	_offset;
+	off_t	_dropped;
+	bool	_drop;
+	int	_oldFlags;
+	char	*_buffer;
+	static Mode	_mode;
+	static quint64	_rateLimit;
+};
@@ -1,10 +1,16 @@
 #include "Compression.h"
+#include "Concatenator.h"
 #include "Fd.h"
+#include "Stats.h"
+#include <iostream>
+#include <vector>
 
 extern "C" {
 #include <archive_entry.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <lzma.h>
 }
 
 // This must be in sync (same order, same number of entries)
@@ -27,6 +33,7 @@ static constexpr struct {
 };
 
 bool Compression::CompressFile(String const &source, Format c, String target) {
+	Stats::Scope stats(Stats::Compress);
 	Fd fd(open(source, O_RDONLY));
 	if(fd == -1)
 		return false;
@@ -67,6 +74,177 @@ bool Compression::CompressFile(String const &source, Format c, String target) {
 	archive_entry_free(e);
 	archive_write_close(a);
 	archive_write_free(a);
+	if(Stats::isEnabled()) {
+		struct stat out;
+		stats.addBytes(s.st_size, stat(target, &out) ? 0 : out.st_size);
+	}
+	return true;
+}
+
+static la_ssize_t appendToByteArray(archive *, void *client, void const *buffer, size_t length) {
+	static_cast<QByteArray*>(client)->append(static_cast<char const*>(buffer), length);
+	return length;
+}
+
+QByteArray Compression::compressedData(QByteArray const &data, Format c) {
+	Stats::Scope stats(Stats::Compress);
+	QByteArray ret;
+	archive *a = archive_write_new();
+	if(!a)
+		return ret;
+	archive_write_add_filter(a, formats[static_cast<int>(c)].libarchive_format);
+	archive_write_set_format(a, ARCHIVE_FORMAT_RAW);
+	// Padding to a block size would break concatenating streams
+	archive_write_set_bytes_per_block(a, 0);
+	// The data is small (typically the metadata of a single package),
+	// so higher levels gain next to nothing -- but setting up their
+	// encoders (xz in particular) costs more than compressing
+	archive_write_set_filter_option(a, nullptr, "compression-level", "1");
+	if(archive_write_open(a, &ret, nullptr, appendToByteArray, nullptr) != ARCHIVE_OK) {
+		archive_write_free(a);
+		return QByteArray();
+	}
+
+	archive_entry *e = archive_entry_new();
+	if(!e) {
+		archive_write_free(a);
+		return QByteArray();
+	}
+	archive_entry_set_pathname(e, "data");
+	archive_entry_set_size(e, data.size());
+	archive_entry_set_filetype(e, AE_IFREG);
+	archive_entry_set_perm(e, 0644);
+	bool const ok = archive_write_header(a, e) == ARCHIVE_OK &&
+		archive_write_data(a, data.constData(), data.size()) == data.size() &&
+		archive_write_close(a) == ARCHIVE_OK;
+	archive_entry_free(e);
+	archive_write_free(a);
+	if(!ok) {
+		// A truncated stream would be indistinguishable from a
+		// valid one once it's concatenated with others
+		std::cerr << "Compressing data failed" << std::endl;
+		return QByteArray();
+	}
+	stats.addBytes(data.size(), ret.size());
+	return ret;
+}
+
+static bool readAt(int fd, void *buffer, size_t length, off_t offset) {
+	char *p = static_cast<char*>(buffer);
+	while(length) {
+		ssize_t const r = pread(fd, p, length, offset);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return false;
+		p += r;
+		offset += r;
+		length -= r;
+	}
+	return true;
+}
+
+bool Compression::joinXzStreams(String const &source, String const &target) {
+	Stats::Scope stats(Stats::Compress);
+	Fd fd(open(source, O_RDONLY|O_CLOEXEC));
+	struct stat s;
+	if(fd < 0 || fstat(fd, &s))
+		return false;
+
+	// Streams can only be found from the end of the file: the footer
+	// gives the size of the index, and the index gives the size of
+	// the blocks in front of it
+	struct Stream {
+		off_t blocks;
+		lzma_vli blocksSize;
+		std::vector<std::pair<lzma_vli,lzma_vli>> records; // unpadded, uncompressed size
+	};
+	std::vector<Stream> streams;
+	lzma_check check = LZMA_CHECK_NONE;
+	off_t pos = s.st_size;
+	while(pos > 0) {
+		uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+		// Stream padding
+		if(pos < LZMA_STREAM_HEADER_SIZE * 2 || !readAt(fd, buf, 4, pos - 4))
+			return false;
+		if(!buf[0] && !buf[1] && !buf[2] && !buf[3]) {
+			pos -= 4;
+			continue;
+		}
+
+		lzma_stream_flags footer;
+		if(!readAt(fd, buf, LZMA_STREAM_HEADER_SIZE, pos - LZMA_STREAM_HEADER_SIZE) || lzma_stream_footer_decode(&footer, buf) != LZMA_OK)
+			return false;
+		off_t const indexStart = pos - LZMA_STREAM_HEADER_SIZE - static_cast<off_t>(footer.backward_size);
+		if(indexStart < LZMA_STREAM_HEADER_SIZE)
+			return false;
+		std::vector<uint8_t> index(footer.backward_size);
+		lzma_index *i = nullptr;
+		uint64_t memlimit = UINT64_MAX;
+		size_t inPos = 0;
+		if(!readAt(fd, index.data(), index.size(), indexStart) || lzma_index_buffer_decode(&i, &memlimit, nullptr, index.data(), &inPos, index.size()) != LZMA_OK)
+			return false;
+
+		Stream &st = streams.emplace_back();
+		st.blocksSize = lzma_index_total_size(i);
+		st.blocks = indexStart - static_cast<off_t>(st.blocksSize);
+		lzma_index_iter it;
+		lzma_index_iter_init(&it, i);
+		while(!lzma_index_iter_next(&it, LZMA_INDEX_ITER_BLOCK))
+			st.records.emplace_back(it.block.unpadded_size, it.block.uncompressed_size);
+		lzma_index_end(i, nullptr);
+
+		lzma_stream_flags header;
+		pos = st.blocks - LZMA_STREAM_HEADER_SIZE;
+		if(pos < 0 || !readAt(fd, buf, LZMA_STREAM_HEADER_SIZE, pos) || lzma_stream_header_decode(&header, buf) != LZMA_OK || lzma_stream_flags_compare(&header, &footer) != LZMA_OK)
+			return false;
+		// The joined stream can have only one check type
+		if(streams.size() > 1 && header.check != check)
+			return false;
+		check = header.check;
+	}
+	if(streams.empty())
+		return false;
+
+	lzma_index *i = lzma_index_init(nullptr);
+	if(!i)
+		return false;
+	for(auto st = streams.crbegin(); st != streams.crend(); ++st) {
+		for(auto const &r : st->records) {
+			if(lzma_index_append(i, nullptr, r.first, r.second) != LZMA_OK) {
+				lzma_index_end(i, nullptr);
+				return false;
+			}
+		}
+	}
+	QByteArray index(lzma_index_size(i), Qt::Uninitialized);
+	size_t outPos = 0;
+	lzma_ret const encoded = lzma_index_buffer_encode(i, reinterpret_cast<uint8_t*>(index.data()), &outPos, index.size());
+	lzma_index_end(i, nullptr);
+	if(encoded != LZMA_OK)
+		return false;
+
+	lzma_stream_flags flags{};
+	flags.version = 0;
+	flags.check = check;
+	QByteArray header(LZMA_STREAM_HEADER_SIZE, Qt::Uninitialized);
+	if(lzma_stream_header_encode(&flags, reinterpret_cast<uint8_t*>(header.data())) != LZMA_OK)
+		return false;
+	flags.backward_size = index.size();
+	QByteArray footer(LZMA_STREAM_HEADER_SIZE, Qt::Uninitialized);
+	if(lzma_stream_footer_encode(&flags, reinterpret_cast<uint8_t*>(footer.data())) != LZMA_OK)
+		return false;
+
+	Concatenator out(target);
+	if(!out.isOpen() || !out.write(header))
+		return false;
+	for(auto st = streams.crbegin(); st != streams.crend(); ++st) {
+		if(!out.append(fd, st->blocks, st->blocksSize))
+			return false;
+	}
+	if(!out.write(index) || !out.write(footer) || !out.close())
+		return false;
+	stats.addBytes(s.st_size, s.st_size);
 	return true;
 }
 
@@ -25,5 +25,30 @@ public:
 
 public:
 	static bool CompressFile(String const &source, Format c=Format::Xz, String target=String());
+	/**
+	 * Compress data in memory.
+	 *
+	 * The result is a complete stream (xz stream, gzip member, zstd
+	 * frame, ...), so the results of multiple calls can be
+	 * concatenated to form a valid file.
+	 *
+	 * Meant for small amounts of data, so it compresses at a low level.
+	 * @return The compressed data, or an empty QByteArray on errors
+	 */
+	static QByteArray compressedData(QByteArray const &data, Format c=Format::Xz);
+	/**
+	 * Turn a file made of concatenated xz streams (such as results of
+	 * compressedData()) into a single stream with the same blocks,
+	 * without recompressing anything.
+	 *
+	 * Not every client handles multi-stream xz files: libsolv
+	 * (and therefore dnf and zypper) stops reading at the end of
+	 * the first stream.
+	 *
+	 * @param source File containing concatenated xz streams
+	 * @param target File to write the single stream to
+	 * @return \c true on success
+	 */
+	static bool joinXzStreams(String const &source, String const &target);
 	static QByteArray uncompressedFile(String const &source);
 };
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Concatenator.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+}
+
+// Number of files opened and read ahead before they're needed
+static constexpr qsizetype readAheadFiles = 64;
+
+Concatenator::Concatenator(String const &filename):_copyFileRange(true),_ok(true) {
+	_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(_fd < 0)
+		std::cerr << "Can't open " << filename << ": " << strerror(errno) << std::endl;
+}
+
+Concatenator::~Concatenator() {
+	close();
+}
+
+bool Concatenator::close() {
+	if(_fd < 0)
+		return false;
+	if(::close(_fd))
+		_ok = false;
+	_fd = -1;
+	return _ok;
+}
+
+bool Concatenator::sync() {
+	return _fd >= 0 && fdatasync(_fd) == 0;
+}
+
+bool Concatenator::write(QByteArray const &data) {
+	char const *p = data.constData();
+	size_t remaining = data.size();
+	while(remaining) {
+		ssize_t const w = ::write(_fd, p, remaining);
+		if(w < 0) {
+			if(errno == EINTR)
+				continue;
+			_ok = false;
+			return false;
+		}
+		p += w;
+		remaining -= w;
+	}
+	return true;
+}
+
+bool Concatenator::append(int fd, off_t offset, size_t length) {
+	while(length) {
+		ssize_t n;
+		if(_copyFileRange) {
+			loff_t off = offset;
+			n = copy_file_range(fd, &off, _fd, nullptr, length, 0);
+			if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				// Filesystem (or kernel) can't do it, sendfile is
+				// the next best thing
+				_copyFileRange = false;
+				continue;
+			}
+		} else {
+			off_t off = offset;
+			n = sendfile(_fd, fd, &off, length);
+		}
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			_ok = false;
+			return false;
+		}
+		if(n == 0) {
+			// File is shorter than expected -- copying the rest
+			// would leave a truncated fragment in the output
+			errno = EIO;
+			_ok = false;
+			return false;
+		}
+		offset += n;
+		length -= n;
+	}
+	return true;
+}
+
+QList<qsizetype> Concatenator::appendFiles(int dirfd, QList<QByteArray> const &names) {
+	QList<qsizetype> ret;
+	// Ring of files that have been opened and told to read ahead
+	struct Pending {
+		int fd = -1;
+		off_t size = 0;
+	} pending[readAheadFiles];
+
+	auto openAhead = [&](qsizetype i) {
+		Pending &p = pending[i % readAheadFiles];
+		p.fd = openat(dirfd, names.at(i).constData(), O_RDONLY|O_CLOEXEC);
+		if(p.fd < 0) {
+			if(errno != ENOENT)
+				std::cerr << "Can't open " << names.at(i).constData() << ": " << strerror(errno) << std::endl;
+			return;
+		}
+		struct stat s;
+		if(fstat(p.fd, &s)) {
+			::close(p.fd);
+			p.fd = -1;
+			return;
+		}
+		p.size = s.st_size;
+		posix_fadvise(p.fd, 0, p.size, POSIX_FADV_WILLNEED);
+	};
+
+	qsizetype opened = 0;
+	for(qsizetype i=0; i<names.count(); i++) {
+		// Keep the read-ahead window full
+		for(; opened < names.count() && opened < i + readAheadFiles; opened++)
+			openAhead(opened);
+		Pending &p = pending[i % readAheadFiles];
+		if(p.fd < 0)
+			continue;
+		if(append(p.fd, 0, p.size))
+			ret.append(i);
+		else
+			std::cerr << "Can't copy " << names.at(i).constData() << ": " << strerror(errno) << std::endl;
+		::close(p.fd);
+		p.fd = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <QList>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/**
+ * Output file assembled from many other files.
+ *
+ * Contents of the input files are copied inside the kernel
+ * (copy_file_range, or sendfile if the filesystems don't support
+ * that), so they never pass through userspace.
+ */
+class Concatenator {
+public:
+	Concatenator(String const &filename);
+	~Concatenator();
+	bool isOpen() const { return _fd >= 0; }
+	/**
+	 * Append data from memory (typically headers and footers)
+	 */
+	bool write(QByteArray const &data);
+	/**
+	 * Append a range of an open file
+	 * @param fd File to copy from
+	 * @param offset Offset in \p fd to start copying
+	 * @param length Number of bytes to copy
+	 * @return \c false on errors, including \p fd ending before
+	 *         \p length bytes were copied (errno is EIO then). The
+	 *         output is incomplete, so close() fails as well.
+	 */
+	bool append(int fd, off_t offset, size_t length);
+	/**
+	 * Append the full contents of a number of files.
+	 *
+	 * Files are opened and read ahead a few files in advance, so
+	 * the disk is kept busy while the previous files are copied.
+	 * Files that don't exist are skipped.
+	 *
+	 * @param dirfd Directory containing the files
+	 * @param names File names relative to \p dirfd
+	 * @return Indexes (in \p names) of the files that were appended
+	 */
+	QList<qsizetype> appendFiles(int dirfd, QList<QByteArray> const &names);
+	/**
+	 * Make sure everything written so far is on disk
+	 */
+	bool sync();
+	bool close();
+private:
+	int	_fd;
+	bool	_copyFileRange;
+	bool	_ok;
+};
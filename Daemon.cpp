@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Daemon.h"
+#include <QDir>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+}
+
+/**
+ * While changes keep coming in, republishing is postponed by up to
+ * this many debounce intervals, so a steady trickle of uploads
+ * doesn't keep the metadata from being updated at all
+ */
+static constexpr int MaxDelay = 5;
+
+/** Longest command line accepted on the socket */
+static constexpr qsizetype MaxCommandLength = 4096;
+
+Daemon::Daemon(String const &origin, int jobs, int prefetchWindow, int debounce):_origin(origin),_jobs(jobs),_prefetchWindow(prefetchWindow),_debounce(debounce),_inotifyNotifier(nullptr),_socket(-1),_socketNotifier(nullptr) {
+	_inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if(_inotify < 0) {
+		std::cerr << "Can't watch for changes: " << strerror(errno) << ", ignoring" << std::endl;
+		return;
+	}
+	_inotifyNotifier = new QSocketNotifier(_inotify, QSocketNotifier::Read);
+	QObject::connect(_inotifyNotifier, &QSocketNotifier::activated, _inotifyNotifier, [this]() { inotifyEvents(); });
+}
+
+Daemon::~Daemon() {
+	for(Client &c : _clients) {
+		delete c.notifier;
+		close(c.fd);
+	}
+	delete _socketNotifier;
+	if(_socket >= 0) {
+		close(_socket);
+		unlink(_socketPath);
+	}
+	delete _inotifyNotifier;
+	if(_inotify >= 0)
+		close(_inotify);
+}
+
+bool Daemon::addRepository(String const &path) {
+	QDir d(path);
+	if(!d.exists()) {
+		std::cerr << path << " not found, ignoring" << std::endl;
+		return false;
+	}
+	Repository &r = _repositories.emplace_back(d.canonicalPath(), _origin);
+	r.builder.setJobs(_jobs);
+	r.builder.setPrefetchWindow(_prefetchWindow);
+	if(_inotify >= 0) {
+		// Hardlinking a package into the repository (as is done to
+		// share noarch packages between repositories) only causes
+		// IN_CREATE, touch and rsync -t only IN_ATTRIB
+		r.watch = inotify_add_watch(_inotify, r.path, IN_CREATE|IN_CLOSE_WRITE|IN_ATTRIB|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_ONLYDIR);
+		if(r.watch < 0)
+			std::cerr << "Can't watch " << r.path << " for changes: " << strerror(errno) << ", ignoring" << std::endl;
+		else
+			_watches.insert(r.watch, &r);
+	}
+	r.timer.setSingleShot(true);
+	r.timer.setInterval(_debounce);
+	QObject::connect(&r.timer, &QTimer::timeout, &r.timer, [this, &r]() {
+		r.pending.invalidate();
+		rescan(r);
+		publish(r);
+	});
+	rescan(r);
+	// If this fails, the next change retries it
+	publish(r);
+	return true;
+}
+
+bool Daemon::listen(String const &path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(static_cast<size_t>(path.size()) >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path " << path << " is too long" << std::endl;
+		return false;
+	}
+	memcpy(addr.sun_path, path.constData(), path.size());
+	_socket = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if(_socket < 0) {
+		std::cerr << "Can't create socket: " << strerror(errno) << std::endl;
+		return false;
+	}
+	// Remove a stale socket left behind by an earlier instance
+	struct stat st;
+	if(!stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if(bind(_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || ::listen(_socket, 8)) {
+		std::cerr << "Can't listen on " << path << ": " << strerror(errno) << std::endl;
+		close(_socket);
+		_socket = -1;
+		return false;
+	}
+	_socketPath = path;
+	_socketNotifier = new QSocketNotifier(_socket, QSocketNotifier::Read);
+	QObject::connect(_socketNotifier, &QSocketNotifier::activated, _socketNotifier, [this]() { accept(); });
+	return true;
+}
+
+bool Daemon::rescan(Repository &r) {
+	return r.builder.rescan() && r.builder.isStale();
+}
+
+bool Daemon::publish(Repository &r, bool force) {
+	if(!force && !r.builder.isStale())
+		return true;
+	if(!r.builder.publish(force))
+		return false;
+	std::cout << "Published metadata for " << r.path << " (" << r.builder.packages().count() << " packages)" << std::endl;
+	return true;
+}
+
+void Daemon::changed(Repository &r) {
+	if(!r.pending.isValid())
+		r.pending.start();
+	// Restarting the timer postpones the republish until the
+	// changes stop coming in -- within limits
+	if(!r.timer.isActive() || r.pending.elapsed() < MaxDelay * _debounce)
+		r.timer.start();
+}
+
+void Daemon::inotifyEvents() {
+	alignas(inotify_event) char buffer[16384];
+	for(;;) {
+		ssize_t const length = ::read(_inotify, buffer, sizeof(buffer));
+		if(length <= 0)
+			break;
+		for(char const *p = buffer; p < buffer + length; ) {
+			inotify_event const *e = reinterpret_cast<inotify_event const*>(p);
+			p += sizeof(inotify_event) + e->len;
+			if(e->mask & IN_Q_OVERFLOW) {
+				// Events were lost, we don't know what changed
+				for(Repository &r : _repositories)
+					changed(r);
+				continue;
+			}
+			Repository *r = _watches.value(e->wd);
+			if(!r)
+				continue;
+			if(e->mask & IN_IGNORED) {
+				std::cerr << "No longer watching " << r->path << " for changes (removed or unmounted?)" << std::endl;
+				_watches.remove(e->wd);
+				r->watch = -1;
+				continue;
+			}
+			// Our own repodata updates and temporary files
+			// of uploads in progress don't count
+			if(e->len && String(e->name).endsWith(".rpm"))
+				changed(*r);
+		}
+	}
+}
+
+void Daemon::accept() {
+	int fd;
+	while((fd = accept4(_socket, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		Client &c = _clients.emplace_back();
+		c.fd = fd;
+		c.notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+		Client *client = &c;
+		QObject::connect(c.notifier, &QSocketNotifier::activated, c.notifier, [this, client]() { read(client); });
+	}
+}
+
+void Daemon::read(Client *c) {
+	char buffer[1024];
+	ssize_t length;
+	while((length = ::read(c->fd, buffer, sizeof(buffer))) > 0)
+		c->buffer.append(buffer, length);
+	bool const eof = length == 0 || (length < 0 && errno != EAGAIN && errno != EINTR);
+
+	qsizetype newline;
+	while((newline = c->buffer.indexOf('\n')) >= 0) {
+		QByteArray const reply = command(c->buffer.left(newline).trimmed()) + '\n';
+		c->buffer.remove(0, newline + 1);
+		// Replies are short, if the client doesn't read them,
+		// that's its problem
+		send(c->fd, reply.constData(), reply.size(), MSG_NOSIGNAL|MSG_DONTWAIT);
+	}
+	if(eof || c->buffer.size() > MaxCommandLength)
+		disconnect(c);
+}
+
+QByteArray Daemon::command(QByteArray const &line) {
+	QList<QByteArray> const args = line.simplified().split(' ');
+	QByteArray const &cmd = args.first();
+	if(cmd == "status") {
+		QByteArray ret;
+		for(Repository const &r : _repositories)
+			ret += r.path + ' ' + QByteArray::number(r.builder.packages().count()) + (r.pending.isValid() ? " pending\n" : "\n");
+		return ret + "ok";
+	}
+	if(cmd != "rescan" && cmd != "publish")
+		return "error unknown command " + cmd;
+	if(args.count() > 2)
+		return "error too many arguments";
+
+	QList<Repository*> repositories;
+	if(args.count() == 2) {
+		Repository *r = repository(args.at(1));
+		if(!r)
+			return "error unknown repository " + args.at(1);
+		repositories.append(r);
+	} else {
+		for(Repository &r : _repositories)
+			repositories.append(&r);
+	}
+	bool ok = true;
+	int published = 0;
+	for(Repository *r : repositories) {
+		// Anything pending is taken care of now
+		r->timer.stop();
+		r->pending.invalidate();
+		if(rescan(*r) || cmd == "publish") {
+			if(publish(*r, cmd == "publish"))
+				published++;
+			else
+				ok = false;
+		}
+	}
+	if(!ok)
+		return "error publishing failed";
+	return "ok " + QByteArray::number(published) + " published";
+}
+
+void Daemon::disconnect(Client *c) {
+	c->notifier->setEnabled(false);
+	// We may be called from the notifier's signal
+	c->notifier->deleteLater();
+	close(c->fd);
+	_clients.remove_if([c](Client const &client) { return &client == c; });
+}
+
+Daemon::Repository *Daemon::repository(QByteArray const &path) {
+	String const canonical = QDir(QString::fromUtf8(path)).canonicalPath();
+	for(Repository &r : _repositories) {
+		if(r.path == canonical)
+			return &r;
+	}
+	return nullptr;
+}
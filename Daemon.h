@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include "RepoBuilder.h"
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <list>
+
+/**
+ * Keeps the metadata of one or more repositories in memory and
+ * republishes it whenever packages are added, replaced or removed.
+ *
+ * Changes are picked up through inotify. Bursts of changes (such as
+ * a large upload) are collected until nothing has changed for a
+ * while, so they result in a single republish.
+ *
+ * Rescans and republishes can also be requested explicitly through
+ * a Unix socket that accepts one command per line:
+ *   rescan [path]   Pick up changes, republish if there are any
+ *   publish [path]  Pick up changes and republish unconditionally
+ *   status          List repositories and their package counts
+ * Commands without a path apply to all repositories. Every command
+ * is answered with a line starting with "ok" or "error".
+ */
+class Daemon {
+public:
+	/**
+	 * @param origin Origin identifier for the appstream metadata
+	 * @param jobs Number of packages to analyze in parallel
+	 * @param prefetchWindow Number of packages to read ahead
+	 * @param debounce Time without changes to wait for before
+	 *        republishing, in milliseconds
+	 */
+	Daemon(String const &origin, int jobs, int prefetchWindow, int debounce);
+	~Daemon();
+	/**
+	 * Start watching a repository, scanning and publishing
+	 * it right away
+	 * @return \c false if the repository doesn't exist
+	 */
+	bool addRepository(String const &path);
+	/** Accept commands on a Unix socket at \p path */
+	bool listen(String const &path);
+private:
+	struct Repository {
+		Repository(String const &path, String const &origin):builder(path, origin),path(builder.path()) {}
+		RepoBuilder builder;
+		String path;
+		int watch = -1;
+		QTimer timer;
+		// Time of the first change that hasn't been published yet
+		QElapsedTimer pending;
+	};
+	struct Client {
+		int fd;
+		QSocketNotifier *notifier;
+		QByteArray buffer;
+	};
+	/**
+	 * Look for changes to a repository
+	 * @return \c true if the published metadata is out of date
+	 */
+	bool rescan(Repository &r);
+	/** Publish the metadata of a repository if it is stale (or \p force is set) */
+	bool publish(Repository &r, bool force=false);
+	void changed(Repository &r);
+	void inotifyEvents();
+	void accept();
+	void read(Client *c);
+	QByteArray command(QByteArray const &line);
+	void disconnect(Client *c);
+	Repository *repository(QByteArray const &path);
+private:
+	String const			_origin;
+	int const			_jobs;
+	int const			_prefetchWindow;
+	int const			_debounce;
+	int				_inotify;
+	QSocketNotifier			*_inotifyNotifier;
+	// std::list because Repository (through QTimer and RepoBuilder)
+	// can't be moved
+	std::list<Repository>		_repositories;
+	QHash<int,Repository*>		_watches;
+	int				_socket;
+	String				_socketPath;
+	QSocketNotifier			*_socketNotifier;
+	std::list<Client>		_clients;
+};
@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "FragmentDictionary.h"
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <algorithm>
+#include <iostream>
+
+#ifdef HAVE_ZSTD
+extern "C" {
+#include <zstd.h>
+#include <zdict.h>
+}
+#endif
+
+// Size of trained dictionaries
+static constexpr size_t dictionarySize = 112*1024;
+// A dictionary is trained once this many samples have been seen,
+// or once the sample data is (almost) full, whichever comes first --
+// large fragments such as file lists fill it with far fewer samples
+static constexpr size_t minSamples = 1000;
+// Maximum amount of sample data kept around for training
+static constexpr qsizetype maxSampleData = 8*1024*1024;
+// Maximum size of an individual sample
+static constexpr qsizetype maxSampleSize = 128*1024;
+// Number of fragments over which the compression ratio is checked
+static constexpr quint32 ratioWindow = 1024;
+// Retrain if the ratio gets worse than this, relative to the
+// ratio seen right after training
+static constexpr double maxRatioDrift = 1.25;
+static constexpr int compressionLevel = 9;
+
+FragmentDictionary::FragmentDictionary(QString const &dir):_dir(dir),_current(0),_cdict(nullptr),_cctx(nullptr),_dctx(nullptr),_baselineRatio(0),_windowRaw(0),_windowCompressed(0),_windowCount(0) {
+#ifdef HAVE_ZSTD
+	_cctx = ZSTD_createCCtx();
+	_dctx = ZSTD_createDCtx();
+	QDir d(_dir);
+	for(QString const &f : d.entryList(QStringList() << "dict.*.zstd", QDir::Files)) {
+		bool ok;
+		quint32 const id = f.section('.', 1, 1).toUInt(&ok);
+		if(!ok || !id)
+			continue;
+		QFile df(d.filePath(f));
+		if(!df.open(QFile::ReadOnly))
+			continue;
+		if(load(id, df.readAll()) && id > _current)
+			_current = id;
+	}
+	if(_current) {
+		QFile df(fileName(_current));
+		if(df.open(QFile::ReadOnly)) {
+			QByteArray const dict = df.readAll();
+			_cdict = ZSTD_createCDict(dict.constData(), dict.size(), compressionLevel);
+		}
+	}
+#endif
+}
+
+FragmentDictionary::~FragmentDictionary() {
+#ifdef HAVE_ZSTD
+	if(!_cdict && !_sampleSizes.empty())
+		std::cerr << "Not enough metadata to train a dictionary (" << _sampleSizes.size() << " fragments, " << _samples.size() << " bytes), fragments were stored uncompressed" << std::endl;
+	ZSTD_freeCDict(static_cast<ZSTD_CDict*>(_cdict));
+	for(void *d : _ddicts)
+		ZSTD_freeDDict(static_cast<ZSTD_DDict*>(d));
+	ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(_cctx));
+	ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(_dctx));
+#endif
+}
+
+bool FragmentDictionary::isAvailable() {
+#ifdef HAVE_ZSTD
+	return true;
+#else
+	return false;
+#endif
+}
+
+QString FragmentDictionary::fileName(quint32 id) const {
+	return _dir + "/dict." + QString::number(id) + ".zstd";
+}
+
+bool FragmentDictionary::load(quint32 id, QByteArray const &dict) {
+#ifdef HAVE_ZSTD
+	ZSTD_DDict *d = ZSTD_createDDict(dict.constData(), dict.size());
+	if(!d)
+		return false;
+	_ddicts.insert(id, d);
+	return true;
+#else
+	Q_UNUSED(id)
+	Q_UNUSED(dict)
+	return false;
+#endif
+}
+
+void FragmentDictionary::sample(QByteArray const &data) {
+	QByteArrayView const s = QByteArrayView(data).first(std::min(data.size(), maxSampleSize));
+	if(s.isEmpty() || _samples.size() + s.size() > maxSampleData)
+		return;
+	_samples.append(s);
+	_sampleSizes.push_back(s.size());
+}
+
+bool FragmentDictionary::enoughSamples() const {
+	return _sampleSizes.size() >= minSamples || _samples.size() + maxSampleSize > maxSampleData;
+}
+
+bool FragmentDictionary::train() {
+#ifdef HAVE_ZSTD
+	QByteArray dict(dictionarySize, Qt::Uninitialized);
+	size_t const size = ZDICT_trainFromBuffer(dict.data(), dict.size(), _samples.constData(), _sampleSizes.data(), _sampleSizes.size());
+	_samples.clear();
+	_sampleSizes.clear();
+	if(ZDICT_isError(size)) {
+		std::cerr << "Training metadata dictionary failed: " << ZDICT_getErrorName(size) << std::endl;
+		return false;
+	}
+	dict.truncate(size);
+
+	quint32 const id = _current + 1;
+	QSaveFile f(fileName(id));
+	if(!f.open(QFile::WriteOnly|QFile::Truncate)) {
+		std::cerr << "Can't write " << qPrintable(f.fileName()) << std::endl;
+		return false;
+	}
+	f.write(dict);
+	if(!f.commit() || !load(id, dict))
+		return false;
+
+	ZSTD_CDict *cdict = ZSTD_createCDict(dict.constData(), dict.size(), compressionLevel);
+	if(!cdict)
+		return false;
+	ZSTD_freeCDict(static_cast<ZSTD_CDict*>(_cdict));
+	_cdict = cdict;
+	_current = id;
+	_baselineRatio = 0;
+	return true;
+#else
+	return false;
+#endif
+}
+
+QByteArray FragmentDictionary::compress(QByteArray const &data, quint32 *dictId) {
+	*dictId = 0;
+#ifdef HAVE_ZSTD
+	if(!_cdict) {
+		sample(data);
+		if(!enoughSamples() || !train())
+			return data;
+	}
+
+	QByteArray ret(ZSTD_compressBound(data.size()), Qt::Uninitialized);
+	size_t const size = ZSTD_compress_usingCDict(static_cast<ZSTD_CCtx*>(_cctx), ret.data(), ret.size(), data.constData(), data.size(), static_cast<ZSTD_CDict*>(_cdict));
+	if(ZSTD_isError(size) || size >= static_cast<size_t>(data.size()))
+		return data;
+	ret.truncate(size);
+	*dictId = _current;
+
+	// Keep an eye on how well the dictionary is doing, and
+	// get a new one if the repository has changed too much
+	_windowRaw += data.size();
+	_windowCompressed += size;
+	if(_baselineRatio > 0)
+		sample(data);
+	if(++_windowCount == ratioWindow) {
+		double const ratio = static_cast<double>(_windowCompressed) / _windowRaw;
+		if(_baselineRatio == 0) {
+			_baselineRatio = ratio;
+			_samples.clear();
+			_sampleSizes.clear();
+		} else if(ratio > _baselineRatio * maxRatioDrift) {
+			std::cerr << "Metadata compression ratio drifted from " << _baselineRatio << " to " << ratio << ", retraining dictionary" << std::endl;
+			train();
+		} else {
+			// Keep samples recent
+			_samples.clear();
+			_sampleSizes.clear();
+		}
+		_windowRaw = _windowCompressed = 0;
+		_windowCount = 0;
+	}
+	return ret;
+#else
+	return data;
+#endif
+}
+
+QByteArray FragmentDictionary::decompress(QByteArray const &data, quint32 dictId) const {
+	if(!dictId)
+		return data;
+#ifdef HAVE_ZSTD
+	void * const ddict = _ddicts.value(dictId);
+	if(!ddict) {
+		std::cerr << "Metadata dictionary " << dictId << " is missing" << std::endl;
+		return QByteArray();
+	}
+	unsigned long long const size = ZSTD_getFrameContentSize(data.constData(), data.size());
+	if(size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+		return QByteArray();
+	QByteArray ret(size, Qt::Uninitialized);
+	size_t const r = ZSTD_decompress_usingDDict(static_cast<ZSTD_DCtx*>(_dctx), ret.data(), ret.size(), data.constData(), data.size(), static_cast<ZSTD_DDict*>(ddict));
+	if(ZSTD_isError(r) || r != size)
+		return QByteArray();
+	return ret;
+#else
+	std::cerr << "Metadata compressed with dictionary " << dictId << ", but zstd support isn't available" << std::endl;
+	return QByteArray();
+#endif
+}
+
+void FragmentDictionary::removeUnused(QSet<quint32> const &used) {
+	for(auto it=_ddicts.begin(); it != _ddicts.end(); ) {
+		if(it.key() == _current || used.contains(it.key())) {
+			++it;
+			continue;
+		}
+#ifdef HAVE_ZSTD
+		ZSTD_freeDDict(static_cast<ZSTD_DDict*>(it.value()));
+#endif
+		QFile::remove(fileName(it.key()));
+		it = _ddicts.erase(it);
+	}
+}
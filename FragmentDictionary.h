@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <vector>
+
+/**
+ * zstd dictionaries trained on the metadata fragments of a repository.
+ *
+ * Metadata fragments are small and highly repetitive (same tags,
+ * same dependencies, same path prefixes), so compressing them
+ * individually works a lot better with a shared dictionary.
+ *
+ * Dictionaries are versioned: every (re-)training creates a new
+ * dictionary, and older ones are kept as long as fragments
+ * compressed with them exist.
+ *
+ * A new dictionary is trained automatically once enough samples
+ * have been seen, and again if the compression ratio drifts too far
+ * from what it was when the current dictionary was new.
+ */
+class FragmentDictionary {
+public:
+	FragmentDictionary(QString const &dir);
+	~FragmentDictionary();
+	/**
+	 * @return \c true if zstd support was compiled in
+	 */
+	static bool isAvailable();
+	/**
+	 * Compress data with the current dictionary
+	 * @param data Data to be compressed
+	 * @param dictId Receives the ID of the dictionary used, or 0 if
+	 *        the data was returned uncompressed (no dictionary yet,
+	 *        or compression didn't help)
+	 */
+	QByteArray compress(QByteArray const &data, quint32 *dictId);
+	/**
+	 * Decompress data compressed with compress()
+	 */
+	QByteArray decompress(QByteArray const &data, quint32 dictId) const;
+	quint32 current() const { return _current; }
+	/**
+	 * Remove dictionaries that are no longer used by any fragment
+	 */
+	void removeUnused(QSet<quint32> const &used);
+private:
+	QString fileName(quint32 id) const;
+	bool load(quint32 id, QByteArray const &dict);
+	void sample(QByteArray const &data);
+	bool enoughSamples() const;
+	bool train();
+private:
+	QString			_dir;
+	quint32			_current;
+	void			*_cdict;
+	QHash<quint32,void*>	_ddicts;
+	void			*_cctx;
+	mutable void		*_dctx;
+	QByteArray		_samples;
+	std::vector<size_t>	_sampleSizes;
+	// Compression ratio tracking for retraining
+	double			_baselineRatio;
+	quint64			_windowRaw;
+	quint64			_windowCompressed;
+	quint32			_windowCount;
+};
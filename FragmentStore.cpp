@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "FragmentStore.h"
+#include "Concatenator.h"
+#include "FragmentDictionary.h"
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+}
+
+static constexpr quint32 indexMagic = 0x52504653; // "RPFS"
+static constexpr quint32 indexVersion = 3;
+// Don't bother compacting if there's less dead data than this
+static constexpr quint64 compactThreshold = 16*1024*1024;
+
+static constexpr char const *typeNames[] = {
+	"primary",
+	"filelists",
+	"other",
+	"appstream",
+	"icons",
+	"primary-xz",
+	"filelists-xz",
+	"other-xz",
+	"appstream-gz"
+};
+
+char const *FragmentStore::typeName(Type t) {
+	return typeNames[t];
+}
+
+// Types that may be compressed with a dictionary -- the others
+// are compressed already
+static constexpr bool isXml(int t) {
+	return t < FragmentStore::Icons;
+}
+
+FragmentStore::FragmentStore(QString const &dir):_dir(dir),_generation(0),_dirty(false),_ok(false),_compress(false) {
+	for(int t=0; t<TypeCount; t++) {
+		_fd[t] = -1;
+		_size[t] = 0;
+	}
+	QDir().mkpath(_dir);
+	if(!loadIndex())
+		_index.clear();
+	removeOrphans();
+	_dictionary = std::make_unique<FragmentDictionary>(_dir);
+	_ok = openSegments();
+}
+
+FragmentStore::~FragmentStore() {
+	closeSegments();
+}
+
+QString FragmentStore::segmentName(Type t, quint32 generation) const {
+	return _dir + "/" + typeNames[t] + "." + QString::number(generation) + ".pack";
+}
+
+bool FragmentStore::loadIndex() {
+	QFile f(_dir + "/.index");
+	if(!f.open(QFile::ReadOnly))
+		return false;
+	QDataStream ds(&f);
+	quint32 magic, version, count;
+	ds >> magic >> version;
+	if(magic != indexMagic || version != indexVersion) {
+		std::cerr << "Ignoring fragment store index in unknown format: " << qPrintable(f.fileName()) << std::endl;
+		return false;
+	}
+	ds >> _generation >> count;
+	_index.reserve(count);
+	for(quint32 i=0; i<count && ds.status() == QDataStream::Ok; i++) {
+		QString package;
+		QByteArray pkgid;
+		Entry e;
+		ds >> package >> pkgid;
+		e.pkgid = pkgid;
+		for(int t=0; t<TypeCount; t++)
+			ds >> e.location[t].offset >> e.location[t].length >> e.location[t].dict;
+		_index.insert(package, e);
+	}
+	if(ds.status() != QDataStream::Ok) {
+		std::cerr << "Fragment store index " << qPrintable(f.fileName()) << " is corrupt" << std::endl;
+		_generation = 0;
+		return false;
+	}
+	return true;
+}
+
+bool FragmentStore::saveIndex(QHash<QString,Entry> const &index, quint32 generation) const {
+	QSaveFile f(_dir + "/.index");
+	if(!f.open(QFile::WriteOnly|QFile::Truncate))
+		return false;
+	QDataStream ds(&f);
+	ds << indexMagic << indexVersion << generation << static_cast<quint32>(index.count());
+	for(auto it=index.cbegin(), end=index.cend(); it != end; ++it) {
+		ds << it.key() << static_cast<QByteArray const &>(it->pkgid);
+		for(int t=0; t<TypeCount; t++)
+			ds << it->location[t].offset << it->location[t].length << it->location[t].dict;
+	}
+	return ds.status() == QDataStream::Ok && f.commit();
+}
+
+bool FragmentStore::openSegments() {
+	for(int t=0; t<TypeCount; t++) {
+		QByteArray const fn = QFile::encodeName(segmentName(static_cast<Type>(t), _generation));
+		_fd[t] = open(fn, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+		if(_fd[t] < 0) {
+			std::cerr << "Can't open " << fn.constData() << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+		struct stat s;
+		if(fstat(_fd[t], &s))
+			return false;
+		_size[t] = s.st_size;
+	}
+	return true;
+}
+
+void FragmentStore::closeSegments() {
+	for(int t=0; t<TypeCount; t++) {
+		if(_fd[t] >= 0)
+			close(_fd[t]);
+		_fd[t] = -1;
+	}
+}
+
+void FragmentStore::removeOrphans() const {
+	// Segments of other generations are left behind by an
+	// interrupted compaction
+	QDir d(_dir);
+	QString const current = "." + QString::number(_generation) + ".pack";
+	for(QString const &f : d.entryList(QStringList() << "*.pack", QDir::Files)) {
+		if(!f.endsWith(current))
+			QFile::remove(d.filePath(f));
+	}
+}
+
+static bool writeAll(int fd, QByteArray const &data) {
+	char const *p = data.constData();
+	size_t remaining = data.size();
+	while(remaining) {
+		ssize_t const w = write(fd, p, remaining);
+		if(w < 0) {
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		p += w;
+		remaining -= w;
+	}
+	return true;
+}
+
+bool FragmentStore::add(QString const &package, Fragments const &f) {
+	QByteArray icons;
+	if(!f.icons.isEmpty()) {
+		QDataStream ds(&icons, QIODevice::WriteOnly);
+		ds << static_cast<quint32>(f.icons.count());
+		for(auto it=f.icons.cbegin(), end=f.icons.cend(); it != end; ++it)
+			ds << static_cast<QByteArray const &>(it.key()) << it.value();
+	}
+	QByteArray const *data[TypeCount] = { &f.primary, &f.filelists, &f.other, &f.appstream, &icons, &f.primaryXz, &f.filelistsXz, &f.otherXz, &f.appstreamGz };
+
+	Entry e;
+	e.pkgid = f.pkgid;
+	for(int t=0; t<TypeCount; t++) {
+		if(data[t]->isEmpty())
+			continue;
+		QByteArray compressed;
+		if(_compress && isXml(t)) {
+			compressed = _dictionary->compress(*data[t], &e.location[t].dict);
+			data[t] = &compressed;
+		}
+		if(!writeAll(_fd[t], *data[t])) {
+			std::cerr << "Can't write to " << qPrintable(segmentName(static_cast<Type>(t), _generation)) << ": " << strerror(errno) << std::endl;
+			// Whatever got written is dead data now
+			_size[t] = lseek(_fd[t], 0, SEEK_END);
+			return false;
+		}
+		e.location[t].offset = _size[t];
+		e.location[t].length = data[t]->size();
+		_size[t] += data[t]->size();
+	}
+	_index.insert(package, e);
+	_dirty = true;
+	return true;
+}
+
+void FragmentStore::remove(QString const &package) {
+	if(_index.remove(package))
+		_dirty = true;
+}
+
+QByteArray FragmentStore::read(Location const &l, Type t) const {
+	QByteArray ret(l.length, Qt::Uninitialized);
+	size_t done = 0;
+	while(done < l.length) {
+		ssize_t const r = pread(_fd[t], ret.data() + done, l.length - done, l.offset + done);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return QByteArray();
+		done += r;
+	}
+	return ret;
+}
+
+QByteArray FragmentStore::contents(Location const &l, Type t) const {
+	QByteArray const data = read(l, t);
+	if(!l.dict || data.isEmpty())
+		return data;
+	return _dictionary->decompress(data, l.dict);
+}
+
+QByteArray FragmentStore::fragment(QString const &package, Type t) const {
+	auto const e = _index.constFind(package);
+	if(e == _index.cend() || !e->location[t].length)
+		return QByteArray();
+	return contents(e->location[t], t);
+}
+
+QHash<String,QByteArray> FragmentStore::icons(QString const &package) const {
+	QHash<String,QByteArray> ret;
+	QByteArray const data = fragment(package, Icons);
+	if(data.isEmpty())
+		return ret;
+	QDataStream ds(data);
+	quint32 count;
+	ds >> count;
+	for(quint32 i=0; i<count && ds.status() == QDataStream::Ok; i++) {
+		QByteArray name, contents;
+		ds >> name >> contents;
+		ret.insert(name, contents);
+	}
+	return ret;
+}
+
+QList<qsizetype> FragmentStore::appendAll(Concatenator &out, QList<QString> const &packages, Type t) const {
+	QList<qsizetype> ret;
+	posix_fadvise(_fd[t], 0, 0, POSIX_FADV_SEQUENTIAL);
+	for(qsizetype i=0; i<packages.count(); i++) {
+		auto const e = _index.constFind(packages.at(i));
+		if(e == _index.cend() || !e->location[t].length)
+			continue;
+		Location const &l = e->location[t];
+		bool ok;
+		if(l.dict) {
+			// Empty if the dictionary is missing or the data is corrupt
+			QByteArray const data = contents(l, t);
+			if(data.isEmpty()) {
+				std::cerr << "Can't decompress " << typeNames[t] << " fragment of " << qPrintable(packages.at(i)) << std::endl;
+				continue;
+			}
+			ok = out.write(data);
+		} else
+			ok = out.append(_fd[t], l.offset, l.length);
+		if(!ok) {
+			std::cerr << "Can't copy " << typeNames[t] << " fragment of " << qPrintable(packages.at(i)) << ": " << strerror(errno) << std::endl;
+			continue;
+		}
+		ret.append(i);
+	}
+	return ret;
+}
+
+quint64 FragmentStore::liveBytes() const {
+	quint64 ret = 0;
+	for(Entry const &e : _index) {
+		for(int t=0; t<TypeCount; t++)
+			ret += e.location[t].length;
+	}
+	return ret;
+}
+
+quint64 FragmentStore::deadBytes() const {
+	quint64 total = 0;
+	for(int t=0; t<TypeCount; t++)
+		total += _size[t];
+	return total - liveBytes();
+}
+
+bool FragmentStore::save() {
+	if(!_ok)
+		return false;
+	quint64 const dead = deadBytes();
+	if(dead > compactThreshold && dead > liveBytes())
+		return compact();
+	if(!_dirty)
+		return true;
+	for(int t=0; t<TypeCount; t++)
+		fdatasync(_fd[t]);
+	if(!saveIndex(_index, _generation)) {
+		std::cerr << "Can't save fragment store index in " << qPrintable(_dir) << std::endl;
+		return false;
+	}
+	_dirty = false;
+	return true;
+}
+
+bool FragmentStore::compact() {
+	QList<QString> packages = _index.keys();
+	packages.sort();
+	quint32 const generation = _generation + 1;
+	QHash<QString,Entry> compacted = _index;
+
+	auto removeNew = [this, generation]() {
+		for(int t=0; t<TypeCount; t++)
+			QFile::remove(segmentName(static_cast<Type>(t), generation));
+	};
+
+	for(int t=0; t<TypeCount; t++) {
+		Concatenator out(QFile::encodeName(segmentName(static_cast<Type>(t), generation)));
+		if(!out.isOpen()) {
+			removeNew();
+			return false;
+		}
+		posix_fadvise(_fd[t], 0, 0, POSIX_FADV_SEQUENTIAL);
+		quint64 offset = 0;
+		for(QString const &p : packages) {
+			Location &l = compacted[p].location[t];
+			if(!l.length)
+				continue;
+			bool ok;
+			if(isXml(t) && (l.dict ? l.dict != _dictionary->current() : _compress)) {
+				// Compressed with an outdated dictionary, or not
+				// compressed at all -- recompress
+				QByteArray const data = contents(l, t);
+				QByteArray const recompressed = _compress ? _dictionary->compress(data, &l.dict) : data;
+				if(!_compress)
+					l.dict = 0;
+				ok = !data.isEmpty() && out.write(recompressed);
+				l.length = recompressed.size();
+			} else
+				ok = out.append(_fd[t], l.offset, l.length);
+			if(!ok) {
+				removeNew();
+				return false;
+			}
+			l.offset = offset;
+			offset += l.length;
+		}
+		if(!out.sync() || !out.close()) {
+			removeNew();
+			return false;
+		}
+	}
+
+	// Switching to the new generation is atomic -- if we get
+	// interrupted before this, the old index and segments are
+	// still valid and the new segments are removed as orphans.
+	if(!saveIndex(compacted, generation)) {
+		std::cerr << "Can't save fragment store index in " << qPrintable(_dir) << std::endl;
+		removeNew();
+		return false;
+	}
+	closeSegments();
+	for(int t=0; t<TypeCount; t++)
+		QFile::remove(segmentName(static_cast<Type>(t), _generation));
+	_generation = generation;
+	_index = compacted;
+	_dirty = false;
+
+	QSet<quint32> usedDictionaries;
+	for(Entry const &e : _index) {
+		for(int t=0; t<TypeCount; t++)
+			usedDictionaries.insert(e.location[t].dict);
+	}
+	_dictionary->removeUnused(usedDictionaries);
+
+	_ok = openSegments();
+	return _ok;
+}
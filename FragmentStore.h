@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <QHash>
+#include <QList>
+#include <memory>
+
+class Concatenator;
+class FragmentDictionary;
+
+/**
+ * Metadata generated for a single package
+ */
+struct Fragments {
+	String pkgid;
+	QByteArray primary;
+	QByteArray filelists;
+	QByteArray other;
+	QByteArray appstream;
+	QHash<String,QByteArray> icons;
+	// Compressed copies of the above (if requested), each one
+	// a complete xz stream
+	QByteArray primaryXz;
+	QByteArray filelistsXz;
+	QByteArray otherXz;
+	// No longer generated (appstream readers don't handle multi-member
+	// gzip files), kept so existing stores remain readable
+	QByteArray appstreamGz;
+};
+
+/**
+ * Storage for per-package metadata fragments in a few large
+ * append-only segment files (one per fragment type) rather than
+ * several small files per package.
+ *
+ * An index maps each package to the location of its fragments.
+ * Replaced and removed fragments stay in the segments until the
+ * store is compacted, which happens automatically on save() once
+ * more than half of the data is dead.
+ *
+ * XML fragments can optionally be compressed with a zstd dictionary
+ * trained on the repository's own fragments (see FragmentDictionary).
+ */
+class FragmentStore {
+public:
+	enum Type {
+		Primary = 0,
+		Filelists,
+		Other,
+		Appstream,
+		Icons,
+		PrimaryXz,
+		FilelistsXz,
+		OtherXz,
+		AppstreamGz,
+		TypeCount
+	};
+	FragmentStore(QString const &dir);
+	~FragmentStore();
+	bool isOpen() const { return _ok; }
+	static char const *typeName(Type t);
+	/**
+	 * Compress XML fragments added from now on (and existing ones,
+	 * when the store is compacted) with a shared dictionary
+	 */
+	void setDictionaryCompression(bool compress) { _compress = compress; }
+	bool add(QString const &package, Fragments const &f);
+	void remove(QString const &package);
+	bool contains(QString const &package) const { return _index.contains(package); }
+	/** @return \c true if the package has a fragment of type \p t */
+	bool contains(QString const &package, Type t) const {
+		auto const e = _index.constFind(package);
+		return e != _index.cend() && e->location[t].length;
+	}
+	QList<QString> packages() const { return _index.keys(); }
+	String pkgid(QString const &package) const { return _index.value(package).pkgid; }
+	QByteArray fragment(QString const &package, Type t) const;
+	QHash<String,QByteArray> icons(QString const &package) const;
+	/**
+	 * Append fragments of a number of packages to a file
+	 * @param out File to append to
+	 * @param packages Packages whose fragments should be appended
+	 * @param t Type of fragments to append
+	 * @return Indexes (in \p packages) of the packages whose fragment
+	 *         was appended. Fragments that can't be read or
+	 *         decompressed are left out.
+	 */
+	QList<qsizetype> appendAll(Concatenator &out, QList<QString> const &packages, Type t) const;
+	/**
+	 * Make all changes durable, compacting the store if worthwhile
+	 */
+	bool save();
+	/**
+	 * Rewrite the segments without dead data, in package order
+	 */
+	bool compact();
+	quint64 liveBytes() const;
+	quint64 deadBytes() const;
+private:
+	struct Location {
+		quint64 offset = 0;
+		quint64 length = 0;
+		// Dictionary the fragment is compressed with, 0 if uncompressed
+		quint32 dict = 0;
+	};
+	struct Entry {
+		String pkgid;
+		Location location[TypeCount];
+	};
+	QString segmentName(Type t, quint32 generation) const;
+	bool loadIndex();
+	bool saveIndex(QHash<QString,Entry> const &index, quint32 generation) const;
+	bool openSegments();
+	void closeSegments();
+	void removeOrphans() const;
+	QByteArray read(Location const &l, Type t) const;
+	QByteArray contents(Location const &l, Type t) const;
+private:
+	QString			_dir;
+	QHash<QString,Entry>	_index;
+	quint32			_generation;
+	int			_fd[TypeCount];
+	quint64			_size[TypeCount];
+	bool			_dirty;
+	bool			_ok;
+	bool			_compress;
+	std::unique_ptr<FragmentDictionary>	_dictionary;
+};
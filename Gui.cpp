@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Gui.h"
+#include <QGuiApplication>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+static std::mutex lock;
+static std::condition_variable changed;
+static std::atomic<bool> ready = false;
+static bool available = false;
+// Set by a worker thread waiting for the host to initialize QtGui
+static bool requested = false;
+// Thread waiting for workers in Gui::run(), if any
+static std::thread::id host;
+
+/** Called with the lock held */
+static void create() {
+	if(!QCoreApplication::instance() && Gui::isMainThread()) {
+		static int argc = 1;
+		static char name[] = "rpmpp";
+		static char *argv[] = { name, nullptr };
+		// Kept until the process exits
+		new QGuiApplication(argc, argv);
+	}
+	available = qobject_cast<QGuiApplication*>(QCoreApplication::instance());
+	if(!QCoreApplication::instance())
+		std::cerr << "QtGui can only be initialized on the main thread, ignoring icons" << std::endl;
+	else if(!available)
+		std::cerr << "Can't convert icons without a QGuiApplication, ignoring icons" << std::endl;
+	ready = true;
+	changed.notify_all();
+}
+
+bool Gui::init() {
+	if(ready)
+		return available;
+	std::unique_lock<std::mutex> l(lock);
+	if(ready)
+		return available;
+	if(host != std::thread::id() && host != std::this_thread::get_id()) {
+		requested = true;
+		changed.notify_all();
+		changed.wait(l, []() { return ready.load(); });
+	} else
+		create();
+	return available;
+}
+
+void Gui::run(int threads, std::function<void()> const &work) {
+	std::unique_lock<std::mutex> l(lock);
+	// With several runs going on at the same time, the first one
+	// takes care of initialization for all of them
+	bool const hosting = !ready && host == std::thread::id();
+	if(hosting)
+		host = std::this_thread::get_id();
+	int running = threads;
+	l.unlock();
+
+	std::vector<std::thread> workers;
+	for(int i=0; i<threads; i++) {
+		workers.emplace_back([&]() {
+			work();
+			std::lock_guard<std::mutex> g(lock);
+			running--;
+			changed.notify_all();
+		});
+	}
+
+	if(hosting) {
+		l.lock();
+		for(;;) {
+			changed.wait(l, [&]() { return !running || (requested && !ready); });
+			if(requested && !ready)
+				create();
+			else
+				break;
+		}
+		host = std::thread::id();
+		l.unlock();
+	}
+	for(std::thread &t : workers)
+		t.join();
+}
+
+bool Gui::isMainThread() {
+	return gettid() == getpid();
+}
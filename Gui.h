@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include <functional>
+
+/**
+ * Deferred initialization of QtGui.
+ *
+ * Converting icons needs a QGuiApplication, which takes a noticeable
+ * part of the runtime of small runs to set up (platform plugin, fonts).
+ * Most runs don't convert any icons, so the application object is only
+ * created once an icon needs converting -- unless the program created
+ * an application object of its own.
+ *
+ * Qt insists on the application object being created on the main
+ * thread, so worker threads started through run() have it created on
+ * the thread waiting for them. If that isn't the main thread either
+ * (a library used from a service's worker thread), QtGui can't be
+ * initialized on demand: the program has to create the application
+ * object, or call init(), on the main thread beforehand.
+ */
+class Gui {
+public:
+	/**
+	 * Make sure QtGui can be used. May be called on any thread.
+	 * @return \c false if it can't be used (because the program
+	 *         created a non-GUI application object)
+	 */
+	static bool init();
+	/**
+	 * Run \p work on \p threads threads and wait for all of them to
+	 * finish, initializing QtGui on the calling thread if any of
+	 * them needs it
+	 */
+	static void run(int threads, std::function<void()> const &work);
+	/** @return \c true if called on the main thread of the process */
+	static bool isMainThread();
+};
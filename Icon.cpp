@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Icon.h"
+#include "Gui.h"
+#include <QBuffer>
+#include <QImage>
+#include <QPainter>
+#include <QSvgRenderer>
+
+QByteArray Icon::svgToPng(QByteArray const &data, int pixelSize)
+{
+	if (!Gui::init())
+		return {};
+	QSvgRenderer renderer(data);
+	if (!renderer.isValid())
+		return {};
+	QImage img(pixelSize, pixelSize, QImage::Format_ARGB32_Premultiplied);
+	img.fill(Qt::transparent);
+	QPainter painter(&img);
+	renderer.render(&painter);
+	painter.end();
+	if (img.isNull())
+		return {};
+	QBuffer buf;
+	if (!buf.open(QIODevice::WriteOnly))
+		return {};
+	if (!img.save(&buf, "PNG") || buf.data().isEmpty())
+		return {};
+	return buf.data();
+}
+
+QByteArray Icon::toPng(QByteArray const &data)
+{
+	if (!Gui::init())
+		return {};
+	QImage img;
+	if (!img.loadFromData(data) || img.isNull())
+		return {};
+	QBuffer buf;
+	if (!buf.open(QIODevice::WriteOnly))
+		return {};
+	if (!img.save(&buf, "PNG") || buf.data().isEmpty())
+		return {};
+	return buf.data();
+}
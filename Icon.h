@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include <QByteArray>
+
+class Icon {
+public:
+	/**
+	 * Rasterize an SVG/SVGZ icon to a PNG
+	 * @param data SVG or SVGZ data
+	 * @param pixelSize Width and height of the PNG
+	 * @return PNG data, empty on failure
+	 */
+	static QByteArray svgToPng(QByteArray const &data, int pixelSize);
+	/**
+	 * Convert an icon in any other format Qt can read to a PNG
+	 * @param data Image data
+	 * @return PNG data, empty on failure
+	 */
+	static QByteArray toPng(QByteArray const &data);
+};
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Manifest.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSaveFile>
+#include <iostream>
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+}
+
+static constexpr char manifestHeader[] = "# repodata-tools perfile manifest 1\n";
+
+Manifest::Manifest(QString const &filename):_filename(filename),_exists(false) {
+	QFile f(filename);
+	if(!f.open(QFile::ReadOnly))
+		return;
+	QByteArray const data = f.readAll();
+	f.close();
+	if(!data.startsWith(manifestHeader)) {
+		std::cerr << "Ignoring manifest in unknown format: " << qPrintable(filename) << std::endl;
+		return;
+	}
+	_exists = true;
+	for(QByteArray const &line : data.split('\n')) {
+		if(line.isEmpty() || line.startsWith('#'))
+			continue;
+		// name size mtime_ns inode pkgid
+		QList<QByteArray> const fields = line.split('\t');
+		if(fields.count() != 5) {
+			std::cerr << "Ignoring invalid manifest line in " << qPrintable(filename) << ": " << line.constData() << std::endl;
+			continue;
+		}
+		ManifestEntry e;
+		e.size = fields.at(1).toLongLong();
+		e.mtimeNs = fields.at(2).toLongLong();
+		e.inode = fields.at(3).toULongLong();
+		e.pkgid = fields.at(4);
+		insert(QFile::decodeName(fields.at(0)), e);
+	}
+}
+
+bool Manifest::save() const {
+	QDir().mkpath(QFileInfo(_filename).absolutePath());
+	QSaveFile f(_filename);
+	if(!f.open(QFile::WriteOnly|QFile::Truncate)) {
+		std::cerr << "Can't write manifest " << qPrintable(_filename) << std::endl;
+		return false;
+	}
+	QByteArray data(manifestHeader);
+	data.reserve(count() * 128);
+	for(auto it=cbegin(), end=cend(); it != end; ++it) {
+		data += QFile::encodeName(it.key()) + '\t' +
+			QByteArray::number(it->size) + '\t' +
+			QByteArray::number(it->mtimeNs) + '\t' +
+			QByteArray::number(it->inode) + '\t' +
+			it->pkgid + '\n';
+	}
+	f.write(data);
+	return f.commit();
+}
+
+QHash<QString,PackageStat> Manifest::scanPackages(QString const &dir) {
+	QHash<QString,PackageStat> ret;
+	DIR *d = opendir(QFile::encodeName(dir));
+	if(!d)
+		return ret;
+	int const dfd = dirfd(d);
+	while(dirent *e = readdir(d)) {
+		size_t const len = strlen(e->d_name);
+		if(len < 5 || strcasecmp(e->d_name + len - 4, ".rpm"))
+			continue;
+		struct stat s;
+		if(fstatat(dfd, e->d_name, &s, 0) || !S_ISREG(s.st_mode))
+			continue;
+		PackageStat ps;
+		ps.size = s.st_size;
+		ps.mtimeNs = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+		ps.inode = s.st_ino;
+		ret.insert(QFile::decodeName(e->d_name), ps);
+	}
+	closedir(d);
+	return ret;
+}
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <QHash>
+
+/**
+ * Identity of a package file as seen by stat().
+ * If any of these change, the package has to be analyzed again.
+ */
+struct PackageStat {
+	qint64 size = 0;
+	qint64 mtimeNs = 0;
+	quint64 inode = 0;
+	bool operator==(PackageStat const &other) const = default;
+};
+
+struct ManifestEntry:public PackageStat {
+	ManifestEntry() {}
+	ManifestEntry(PackageStat const &s, String const &id):PackageStat(s),pkgid(id) {}
+	String pkgid;
+};
+
+/**
+ * List of packages that have per-file metadata, along with
+ * the stat() data of the package at the time the metadata was
+ * generated.
+ *
+ * This allows detecting new, modified and removed packages with
+ * a single directory scan and hash lookups instead of comparing
+ * file lists and stat()ing every metadata fragment.
+ */
+class Manifest:public QHash<QString,ManifestEntry> {
+public:
+	Manifest(QString const &filename);
+	/**
+	 * @return \c true if the manifest was loaded from disk
+	 */
+	bool exists() const { return _exists; }
+	bool save() const;
+	/**
+	 * Scan a directory for packages
+	 * @param dir Directory containing the packages
+	 * @return Hash mapping the package filename to its stat() data
+	 */
+	static QHash<QString,PackageStat> scanPackages(QString const &dir);
+private:
+	QString	_filename;
+	bool	_exists;
+};
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "MetadataWriter.h"
+#include "Rpm.h"
+#include "Sha256.h"
+#include "Compression.h"
+#include "Stats.h"
+#include <QTextStream>
+#include <algorithm>
+#include <iostream>
+
+extern "C" {
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+}
+
+PackageRecord PackageRecord::fromRpm(QDir const &d, QString const &rpm, String const &sha256) {
+	Rpm r(d.filePath(rpm));
+	r.setSha256(sha256);
+	PackageRecord p;
+	struct stat st;
+	if(!stat(String(d.filePath(rpm)), &st)) {
+		p.size = st.st_size;
+		p.mtime = static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+		p.inode = st.st_ino;
+	}
+	p.location = rpm;
+	p.pkgid = r.sha256();
+
+	// Generating the individual parts is accounted to their own
+	// phases, what's left is formatting
+	Stats::Scope stats(Stats::WriteXml);
+	QTextStream primaryTs(&p.primary);
+	primaryTs << "<package type=\"rpm\">" << Qt::endl
+		<< "	<name>" << r.name() << "</name>" << Qt::endl
+		<< "	<arch>" << r.arch() << "</arch>" << Qt::endl
+		<< "	<version epoch=\"" << r.epoch() << "\" ver=\"" << r.version() << "\" rel=\"" << r.release() << "\"/>" << Qt::endl
+		<< "	<checksum type=\"sha256\" pkgid=\"YES\">" << p.pkgid << "</checksum>" << Qt::endl
+		<< "	<summary>" << r.summary().xmlEncode() << "</summary>" << Qt::endl
+		<< "	<description>" << r.description().xmlEncode() << "</description>" << Qt::endl
+		<< "	<packager>" << r.packager().xmlEncode() << "</packager>" << Qt::endl
+		<< "	<url>" << r.url().xmlEncode() << "</url>" << Qt::endl
+		<< "	<time file=\"" << r.time() << "\" build=\"" << r.buildTime() << "\"/>" << Qt::endl
+		<< "	<size package=\"" << r.size() << "\" installed=\"" << r.installedSize() << "\" archive=\"" << r.archiveSize() << "\"/>" << Qt::endl
+		<< "	<location href=\"" << rpm << "\"/>" << Qt::endl
+		<< "	<format>" << Qt::endl
+		<< "		<rpm:license>" << r.license().xmlEncode() << "</rpm:license>" << Qt::endl
+		<< "		<rpm:vendor>" << r.vendor().xmlEncode() << "</rpm:vendor>" << Qt::endl
+		<< "		<rpm:group>" << r.group().xmlEncode() << "</rpm:group>" << Qt::endl
+		<< "		<rpm:buildhost>" << r.buildHost() << "</rpm:buildhost>" << Qt::endl
+		<< "		<rpm:sourcerpm>" << r.sourceRpm() << "</rpm:sourcerpm>" << Qt::endl
+		<< "		<rpm:header-range start=\"" << r.headersStart() << "\" end=\"" << r.headersEnd() << "\"/>" << Qt::endl
+		<< r.dependenciesMd()
+		<< r.fileListMd(true)
+		<< "	</format>" << Qt::endl
+		<< "</package>" << Qt::endl;
+
+	QTextStream filelistsTs(&p.filelists);
+	filelistsTs << "<package pkgid=\"" << p.pkgid << "\" name=\"" << r.name() << "\" arch=\"" << r.arch() << "\">" << Qt::endl
+		<< "	<version " << r.repoMdVersion() << "/>" << Qt::endl
+		<< r.fileListMd()
+		<< "</package>" << Qt::endl;
+
+	QTextStream otherTs(&p.other);
+	otherTs << "<package pkgid=\"" << p.pkgid << "\" name=\"" << r.name() << "\" arch=\"" << r.arch() << "\">" << Qt::endl
+		<< "	<version " << r.repoMdVersion() << "/>" << Qt::endl
+		<< "</package>" << Qt::endl;
+
+	p.appstream = r.appstreamMd(&p.icons);
+	return p;
+}
+
+PackageRecord PackageRecord::relocated(QString const &rpm) const {
+	PackageRecord p(*this);
+	if(String(rpm) == location)
+		return p;
+	p.location = rpm;
+	p.primary.replace("<location href=\"" + location + "\"/>", "<location href=\"" + p.location + "\"/>");
+	return p;
+}
+
+QString MetadataWriter::tempName() {
+	return ".repodata.temp." + QString::number(getpid());
+}
+
+MetadataWriter::MetadataWriter(String const &path, String const &origin, qsizetype packages):_d(path),_open(false),_ok(true) {
+	// Get rid of leftovers from an earlier run that failed
+	QDir(_d.filePath(tempName())).removeRecursively();
+	_d.mkdir(tempName(), QFile::ReadOwner|QFile::WriteOwner|QFile::ExeOwner|QFile::ReadGroup|QFile::ExeGroup|QFile::ReadOther|QFile::ExeOther);
+	_rd = QDir(_d.filePath(tempName()));
+	if(!_rd.exists()) {
+		std::cerr << "Can't create/use repodata directory in " << qPrintable(path) << ", ignoring" << std::endl;
+		return;
+	}
+	struct {
+		QFile &file;
+		char const * const name;
+	} const files[] = {
+		{ _primary, "primary.xml" },
+		{ _filelists, "filelists.xml" },
+		{ _other, "other.xml" },
+		{ _appstream, "appstream.xml" }
+	};
+	for(auto const &f : files) {
+		f.file.setFileName(_rd.filePath(f.name));
+		if(!f.file.open(QFile::WriteOnly|QFile::Truncate)) {
+			std::cerr << "Can't create " << f.name << " in " << qPrintable(_rd.absolutePath()) << ", ignoring" << std::endl;
+			return;
+		}
+	}
+	_icons = std::make_unique<Archive>(_rd.filePath("appstream-icons.tar"));
+
+	QByteArray const count = QByteArray::number(packages);
+	write(_primary, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<metadata xmlns=\"http://linux.duke.edu/metadata/common\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"" + count + "\">\n");
+	write(_filelists, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<filelists xmlns=\"http://linux.duke.edu/metadata/filelists\" packages=\"" + count + "\">\n");
+	write(_other, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<otherdata xmlns=\"http://linux.duke.edu/metadata/other\" packages=\"" + count + "\">\n");
+	write(_appstream, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<components origin=\"" + origin + "\" version=\"0.14\">\n");
+	_open = true;
+}
+
+MetadataWriter::~MetadataWriter() {
+	if(_icons)
+		_icons->close();
+	// Anything left at this point is an unfinished or failed run
+	if(_rd.exists() && _rd.dirName() == tempName())
+		_rd.removeRecursively();
+}
+
+void MetadataWriter::add(PackageRecord const &r) {
+	if(!_open)
+		return;
+	Stats::Scope stats(Stats::WriteXml);
+	write(_primary, r.primary);
+	write(_filelists, r.filelists);
+	write(_other, r.other);
+	write(_appstream, r.appstream);
+	// Sorted, so the archive doesn't depend on hash order
+	QList<String> icons = r.icons.keys();
+	std::sort(icons.begin(), icons.end());
+	for(String const &icon : icons) {
+		if(!_icons->addFile(icon, r.icons.value(icon)))
+			_ok = false;
+	}
+}
+
+void MetadataWriter::write(QFile &f, QByteArray const &data) {
+	if(f.write(data) != data.size()) {
+		if(_ok)
+			std::cerr << "Can't write " << qPrintable(f.fileName()) << ": " << qPrintable(f.errorString()) << std::endl;
+		_ok = false;
+	}
+}
+
+bool MetadataWriter::finish() {
+	if(!_open)
+		return false;
+	_open = false;
+	write(_primary, "</metadata>\n");
+	write(_filelists, "</filelists>\n");
+	write(_other, "</otherdata>\n");
+	write(_appstream, "</components>\n");
+	for(QFile *f : {&_primary, &_filelists, &_other, &_appstream}) {
+		if(!f->flush())
+			_ok = false;
+		f->close();
+	}
+	_icons->close();
+	if(!_ok) {
+		std::cerr << "Error while writing metadata to " << qPrintable(_rd.absolutePath()) << std::endl;
+		return false;
+	}
+
+	if(!finalize(_rd)) {
+		std::cerr << "Error while finalizing metadata" << std::endl;
+		return false;
+	}
+	return publish(_d, tempName());
+}
+
+bool MetadataWriter::publish(QDir &d, QString const &tempName) {
+	QString const oldName = tempName + ".old";
+	QDir(d.filePath(oldName)).removeRecursively();
+	if(d.exists("repodata") && !d.rename("repodata", oldName)) {
+		std::cerr << "Can't move old repodata in " << qPrintable(d.absolutePath()) << " out of the way" << std::endl;
+		return false;
+	}
+	if(!d.rename(tempName, "repodata")) {
+		std::cerr << "Can't move new repodata into place in " << qPrintable(d.absolutePath()) << std::endl;
+		d.rename(oldName, "repodata");
+		return false;
+	}
+	QDir(d.filePath(oldName)).removeRecursively();
+	return true;
+}
+
+bool MetadataWriter::finalize(QDir const &d) {
+	Stats::Scope stats(Stats::Finalize);
+	if(!Compression::CompressFile(d.filePath("primary.xml")) ||
+	   !Compression::CompressFile(d.filePath("filelists.xml")) ||
+	   !Compression::CompressFile(d.filePath("other.xml")) ||
+	   !Compression::CompressFile(d.filePath("appstream.xml"), Compression::Format::GZip) ||
+	   !Compression::CompressFile(d.filePath("appstream-icons.tar"), Compression::Format::GZip)) {
+		std::cerr << "Can't compress metadata in " << qPrintable(d.absolutePath()) << std::endl;
+		return false;
+	}
+
+	QHash<String,String> const checksum = Sha256::checksums(QHash<String,String>{
+		{"primary", d.filePath("primary.xml")},
+		{"filelists", d.filePath("filelists.xml")},
+		{"other", d.filePath("other.xml")},
+		{"appstream", d.filePath("appstream.xml")},
+		{"appstream-icons", d.filePath("appstream-icons.tar")},
+		{"primaryXZ", d.filePath("primary.xml.xz")},
+		{"filelistsXZ", d.filePath("filelists.xml.xz")},
+		{"otherXZ", d.filePath("other.xml.xz")},
+		{"appstreamGZ", d.filePath("appstream.xml.gz")},
+		{"appstream-iconsGZ", d.filePath("appstream-icons.tar.gz")}
+	});
+
+	for(auto it = checksum.cbegin(), end = checksum.cend(); it != end; ++it) {
+		if(it.value().isEmpty()) {
+			std::cerr << "Can't checksum " << it.key() << " metadata in " << qPrintable(d.absolutePath()) << std::endl;
+			return false;
+		}
+	}
+
+	for(String const &file : QList<String>{"primary.xml.xz", "filelists.xml.xz", "other.xml.xz", "appstream.xml.gz", "appstream-icons.tar.gz"}) {
+		String const key = file.left(file.indexOf('.')) + file.right(2).toUpper();
+		if(!QFile::rename(d.filePath(file), d.filePath(checksum[key] + "-" + file))) {
+			std::cerr << "Can't rename " << file << " in " << qPrintable(d.absolutePath()) << std::endl;
+			return false;
+		}
+	}
+
+	QFile repomd(d.filePath("repomd.xml"));
+	if(!repomd.open(QFile::WriteOnly|QFile::Truncate)) {
+		std::cerr << "Can't create " << qPrintable(repomd.fileName()) << ": " << qPrintable(repomd.errorString()) << std::endl;
+		return false;
+	}
+	QTextStream repomdTs(&repomd);
+	time_t timestamp = time(0);
+	repomdTs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << Qt::endl
+		<< "<repomd xmlns=\"http://linux.duke.edu/metadata/repo\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\">" << Qt::endl
+		<< "	<revision>" << timestamp << "</revision>" << Qt::endl;
+	for(String const &file : QList<String>{"primary", "filelists", "other", "appstream", "appstream-icons"}) {
+		String compressedFile = (file.startsWith("appstream")) ? file + "GZ" : file + "XZ";
+		String compressExtension = (file.startsWith("appstream")) ? ".gz" : ".xz";
+		String extension = (file == "appstream-icons") ? ".tar" : ".xml";
+		struct stat s, uncompressed;
+		if(stat(d.filePath(checksum[compressedFile] + "-" + file + extension + compressExtension).toUtf8(), &s) ||
+		   stat(d.filePath(file + extension).toUtf8(), &uncompressed)) {
+			std::cerr << "Can't stat " << file << " metadata in " << qPrintable(d.absolutePath()) << std::endl;
+			return false;
+		}
+		repomdTs << "	<data type=\"" << file << "\">" << Qt::endl
+			<< "		<checksum type=\"sha256\">" << checksum[compressedFile] << "</checksum>" << Qt::endl
+			<< "		<open-checksum type=\"sha256\">" << checksum[file] << "</open-checksum>" << Qt::endl
+			<< "		<location href=\"repodata/" << checksum[compressedFile] << "-" << file << extension + compressExtension + "\"/>" << Qt::endl
+			<< "		<timestamp>" << s.st_mtime << "</timestamp>" << Qt::endl
+			<< "		<size>" << s.st_size << "</size>" << Qt::endl
+			<< "		<open-size>" << uncompressed.st_size << "</open-size>" << Qt::endl
+			<< "	</data>" << Qt::endl;
+		QFile::remove(d.filePath(file + extension));
+	}
+	repomdTs << "</repomd>" << Qt::endl;
+	if(repomdTs.status() != QTextStream::Ok || !repomd.flush()) {
+		std::cerr << "Can't write " << qPrintable(repomd.fileName()) << ": " << qPrintable(repomd.errorString()) << std::endl;
+		return false;
+	}
+	repomd.close();
+	return true;
+}
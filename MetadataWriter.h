@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include "Archive.h"
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <memory>
+
+/**
+ * Metadata of a single package, in the form it takes
+ * in the repository metadata files
+ */
+struct PackageRecord {
+	/** Size of the package file */
+	qint64 size = 0;
+	/** Modification time of the package file, in nanoseconds */
+	qint64 mtime = 0;
+	/** Inode of the package file */
+	quint64 inode = 0;
+	/** Filename used in the location tag */
+	String location;
+	String pkgid;
+	QByteArray primary;
+	QByteArray filelists;
+	QByteArray other;
+	QByteArray appstream;
+	QHash<String,QByteArray> icons;
+
+	/**
+	 * Generate the metadata of a package
+	 * @param d Directory containing the package
+	 * @param rpm rpm filename (relative to \p d)
+	 * @param sha256 The package's checksum, if known already
+	 */
+	static PackageRecord fromRpm(QDir const &d, QString const &rpm, String const &sha256=String());
+	/**
+	 * Copy of the record for the same file appearing under a
+	 * different name (e.g. a hardlink in another repository)
+	 */
+	PackageRecord relocated(QString const &rpm) const;
+};
+
+/**
+ * Writes the metadata of a repository to a temporary directory
+ * and publishes it as repodata/ once complete.
+ */
+class MetadataWriter {
+public:
+	/**
+	 * @param path Directory containing the packages
+	 * @param origin Origin identifier for the appstream metadata
+	 * @param packages Number of packages that will be added
+	 */
+	MetadataWriter(String const &path, String const &origin, qsizetype packages);
+	~MetadataWriter();
+	/** @return \c false if the output files couldn't be created */
+	bool isOpen() const { return _open; }
+	/** Temporary directory the metadata is written to */
+	QDir const &directory() const { return _rd; }
+	void add(PackageRecord const &r);
+	/**
+	 * Finish writing the metadata, finalize it and replace the
+	 * repository's repodata/ directory with it
+	 * @return \c false if anything (including an earlier add())
+	 *         failed -- the old repodata/ is left in place then
+	 */
+	bool finish();
+
+	/**
+	 * Finalize the metadata
+	 *
+	 * This compresses the metadata files, renames them to
+	 * their final names (checksum included in filename),
+	 * and creates the corresponding repomd.xml file.
+	 *
+	 * @param d directory containing the metadata
+	 * @return \c true on success, \c false if any of the files
+	 *         couldn't be compressed, renamed or written
+	 */
+	static bool finalize(QDir const &d);
+	/**
+	 * Replace a repository's repodata/ directory with a finalized
+	 * temporary one. The old metadata is moved out of the way
+	 * before the new metadata is moved in, so clients see either
+	 * the old or the new set for all but an instant.
+	 * @param d Repository directory
+	 * @param tempName Name of the temporary directory inside \p d
+	 */
+	static bool publish(QDir &d, QString const &tempName);
+	/** Name of the temporary directory used by this process */
+	static QString tempName();
+private:
+	/** Write to one of the output files, remembering failures */
+	void write(QFile &f, QByteArray const &data);
+private:
+	QDir			_d;
+	QDir			_rd;
+	bool			_open;
+	// Cleared if writing anything fails (e.g. disk full)
+	bool			_ok;
+	QFile			_primary;
+	QFile			_filelists;
+	QFile			_other;
+	QFile			_appstream;
+	std::unique_ptr<Archive>	_icons;
+};
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "PackageAnalyzer.h"
+#include "Gui.h"
+#include "Prefetcher.h"
+#include "Stats.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+qint64 PackageAnalyzer::_memoryLimit = 0;
+
+/** Approximate memory used by a record */
+static qint64 memoryUsage(PackageRecord const &r) {
+	qint64 ret = r.primary.size() + r.filelists.size() + r.other.size() + r.appstream.size();
+	for(QByteArray const &icon : r.icons)
+		ret += icon.size();
+	return ret;
+}
+
+PackageAnalyzer::PackageAnalyzer(int jobs, int prefetchWindow):_jobs(std::max(jobs, 1)),_prefetchWindow(prefetchWindow),_pendingBytes(0) {
+}
+
+int PackageAnalyzer::defaultJobs() {
+	return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+bool PackageAnalyzer::setMemoryLimit(String const &limit) {
+	bool ok;
+	quint64 const value = limit.toSize(&ok);
+	if(!ok)
+		return false;
+	_memoryLimit = value;
+	return true;
+}
+
+void PackageAnalyzer::addRepository(QDir const &d, QStringList const &rpms, Consumer const &consumer, Finisher const &finished) {
+	Repository &r = _repositories.emplace_back();
+	r.d = d;
+	r.rpms = rpms;
+	r.consumer = consumer;
+	r.finished = finished;
+}
+
+void PackageAnalyzer::run() {
+	// Every file is analyzed once, on behalf of all packages
+	// (in any repository) that are hardlinks to it.
+	// Packages are taken from the repositories in turns, so
+	// corresponding packages (which tend to be the hardlinked
+	// ones) are close together and all repositories make
+	// progress at the same rate.
+	std::vector<std::vector<Package>> files;
+	QStringList paths;
+	{
+		Stats::Scope stats(Stats::Scan);
+		std::map<std::tuple<dev_t,ino_t,qint64>,size_t> seen;
+		qsizetype longest = 0;
+		for(Repository &r : _repositories) {
+			longest = std::max(longest, r.rpms.count());
+			if(r.rpms.isEmpty() && r.finished)
+				r.finished();
+		}
+		for(qsizetype i=0; i<longest; i++) {
+			for(Repository &r : _repositories) {
+				if(i >= r.rpms.count())
+					continue;
+				QString const path = r.d.filePath(r.rpms.at(i));
+				struct stat st;
+				if(!stat(String(path), &st) && st.st_nlink > 1) {
+					auto const key = std::make_tuple(st.st_dev, st.st_ino, static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec);
+					if(auto const it = seen.find(key); it != seen.end()) {
+						files[it->second].push_back(Package{&r, i});
+						continue;
+					}
+					seen.emplace(key, files.size());
+				}
+				files.push_back(std::vector<Package>{Package{&r, i}});
+				paths.append(path);
+			}
+		}
+	}
+	Stats::count(Stats::SharedPackages, std::accumulate(files.cbegin(), files.cend(), size_t(0), [](size_t n, std::vector<Package> const &f) { return n + f.size() - 1; }));
+
+	Prefetcher prefetcher(paths, _prefetchWindow);
+	std::atomic<size_t> next{0};
+	auto const worker = [&]() {
+		for(size_t i = next++; i < files.size(); i = next++) {
+			std::vector<Package> const &f = files[i];
+			Package const &p = f.front();
+			PackageRecord record;
+			{
+				Stats::Package package(p.repository->rpms.at(p.index).toUtf8());
+				record = PackageRecord::fromRpm(p.repository->d, p.repository->rpms.at(p.index), prefetcher.checksum(i));
+			}
+			for(size_t j=1; j<f.size(); j++)
+				deliver(f[j], record.relocated(f[j].repository->rpms.at(f[j].index)));
+			deliver(p, std::move(record));
+		}
+	};
+	Gui::run(std::min<qsizetype>(_jobs, files.size()), worker);
+}
+
+void PackageAnalyzer::deliver(Package const &p, PackageRecord &&record) {
+	Repository &r = *p.repository;
+	std::lock_guard<std::mutex> lock(r.lock);
+	if(p.index != r.next)
+		holdBack(r, p.index, std::move(record));
+	else {
+		r.consumer(r.next, record);
+		r.next++;
+	}
+	while(!r.pending.empty() && r.pending.begin()->first == r.next) {
+		Pending &w = r.pending.begin()->second;
+		if(w.spilled >= 0 && !r.spill->read(w.spilled, w.record)) {
+			std::cerr << "Can't read back spilled record of " << qPrintable(r.rpms.at(r.next)) << ", analyzing it again" << std::endl;
+			w.record = PackageRecord::fromRpm(r.d, r.rpms.at(r.next));
+		}
+		_pendingBytes -= w.size;
+		r.consumer(r.next, w.record);
+		r.pending.erase(r.pending.begin());
+		r.next++;
+	}
+	if(r.next == r.rpms.count() && r.finished)
+		r.finished();
+}
+
+void PackageAnalyzer::holdBack(Repository &r, qsizetype index, PackageRecord &&record) {
+	Pending &w = r.pending[index];
+	qint64 const size = memoryUsage(record);
+	if(_memoryLimit && _pendingBytes + size > _memoryLimit) {
+		if(!r.spill)
+			r.spill = std::make_unique<RecordSpill>(r.d.path());
+		w.spilled = r.spill->add(record);
+		if(w.spilled >= 0) {
+			Stats::count(Stats::SpilledPackages);
+			return;
+		}
+		// Better to use too much memory than to fail
+	}
+	w.record = std::move(record);
+	w.size = size;
+	_pendingBytes += size;
+}
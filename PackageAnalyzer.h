@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "MetadataWriter.h"
+#include "RecordFile.h"
+#include <QDir>
+#include <QStringList>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+/**
+ * Analyzes the packages of any number of repositories on a shared
+ * pool of worker threads.
+ *
+ * Packages are identified by device, inode and modification time,
+ * so a package that is hardlinked into several repositories (such
+ * as a noarch package shared by all architectures) is read, checksummed
+ * and analyzed only once. The other repositories get a copy of its
+ * metadata with their own location.
+ *
+ * Each repository's records are handed to its consumer in the order
+ * the packages were given in, one at a time. Consumers of different
+ * repositories run concurrently. Records that are done before the
+ * ones preceding them are held back -- in memory up to the memory
+ * limit, beyond it in a spill file in the repository.
+ */
+class PackageAnalyzer {
+public:
+	/**
+	 * Receives the metadata of the package at \p index in the list
+	 * passed to addRepository()
+	 */
+	using Consumer = std::function<void(qsizetype index, PackageRecord &record)>;
+	/** Called once all records of a repository have been consumed */
+	using Finisher = std::function<void()>;
+
+	/**
+	 * @param jobs Number of packages to analyze in parallel
+	 * @param prefetchWindow Number of packages to read ahead
+	 */
+	PackageAnalyzer(int jobs, int prefetchWindow);
+	/**
+	 * @param d Directory containing the packages
+	 * @param rpms Package filenames, relative to \p d
+	 */
+	void addRepository(QDir const &d, QStringList const &rpms, Consumer const &consumer, Finisher const &finished=Finisher());
+	/** Analyze all packages, returns when everything is done */
+	void run();
+	/** Number of jobs to use if nothing else is requested */
+	static int defaultJobs();
+	/**
+	 * Limit the memory used by records that are held back
+	 * @param limit Bytes, with an optional K, M or G suffix,
+	 *        0 for unlimited
+	 * @return \c false if \p limit can't be parsed
+	 */
+	static bool setMemoryLimit(String const &limit);
+private:
+	struct Pending {
+		PackageRecord record;
+		// Position in the spill file if the record isn't
+		// in memory
+		qint64 spilled = -1;
+		qint64 size = 0;
+	};
+	struct Repository {
+		QDir d;
+		QStringList rpms;
+		Consumer consumer;
+		Finisher finished;
+		std::mutex lock;
+		// Records that are done, but can't be consumed before
+		// the ones preceding them
+		std::map<qsizetype,Pending> pending;
+		qsizetype next = 0;
+		std::unique_ptr<RecordSpill> spill;
+	};
+	struct Package {
+		Repository *repository;
+		qsizetype index;
+	};
+	void deliver(Package const &p, PackageRecord &&record);
+	/** Hold back a record until the ones preceding it are done */
+	void holdBack(Repository &r, qsizetype index, PackageRecord &&record);
+private:
+	int const		_jobs;
+	int const		_prefetchWindow;
+	// std::list because Repository (through std::mutex) can't be moved
+	std::list<Repository>	_repositories;
+	// Memory used by held back records
+	std::atomic<qint64>	_pendingBytes;
+	static qint64		_memoryLimit;
+};
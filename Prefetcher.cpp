@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Prefetcher.h"
+#include "Sha256.h"
+#include "BulkReader.h"
+#include "Stats.h"
+#include "Fd.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+}
+
+#ifdef HAVE_LIBURING
+// Not in extern "C", it pulls in C++ headers when used from C++
+#include <liburing.h>
+#endif
+
+Prefetcher::Prefetcher(QStringList const &files, int window):_files(files),_window(std::max(window, 0)),_checksums(files.count()),_bytes(files.count()),_done(files.count(), 0) {
+	if(!_window || _files.isEmpty())
+		return;
+#ifdef HAVE_LIBURING
+	_ring = new io_uring;
+	if(io_uring_queue_init(_window, _ring, 0) < 0) {
+		// Not supported by the kernel, or blocked by a seccomp filter
+		delete _ring;
+		_ring = nullptr;
+	}
+#endif
+	if(_ring)
+		_threads.emplace_back(&Prefetcher::runUring, this);
+	else {
+		for(int i=0; i<_window; i++)
+			_threads.emplace_back(&Prefetcher::runThreads, this);
+	}
+}
+
+Prefetcher::~Prefetcher() {
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_stop = true;
+	}
+	_advanced.notify_all();
+	for(std::thread &t : _threads)
+		t.join();
+#ifdef HAVE_LIBURING
+	if(_ring) {
+		io_uring_queue_exit(_ring);
+		delete _ring;
+	}
+#endif
+}
+
+char const *Prefetcher::backend() const {
+	if(_threads.empty())
+		return "none";
+	return _ring ? "io_uring" : "threads";
+}
+
+String Prefetcher::checksum(qsizetype index) {
+	if(_threads.empty() || index < 0 || index >= _files.count())
+		return String();
+	Stats::Scope stats(Stats::Checksum);
+	std::unique_lock<std::mutex> lock(_lock);
+	// Anything before index won't be asked for anymore, so make
+	// sure the window includes index even if files were skipped
+	if(index > _consumed) {
+		_consumed = index;
+		_advanced.notify_all();
+	}
+	_finished.wait(lock, [&]() { return _done[index] || _failed; });
+	// With several consumers, a later file may have been
+	// retrieved already
+	_consumed = std::max(_consumed, index + 1);
+	_advanced.notify_all();
+	if(!_done[index])
+		return String();
+	stats.addBytes(_bytes[index], 0);
+	return _checksums[index];
+}
+
+/**
+ * Get the next file to read
+ * @param wait Wait for the window to move if it's full
+ * @return \c false if there's nothing to do (or nothing to do
+ *         without waiting)
+ */
+bool Prefetcher::take(qsizetype &index, bool wait) {
+	std::unique_lock<std::mutex> lock(_lock);
+	auto const done = [this]() { return _stop || _failed || _next >= _files.count(); };
+	if(wait)
+		_advanced.wait(lock, [&]() { return done() || _next < _consumed + _window; });
+	if(done() || _next >= _consumed + _window)
+		return false;
+	index = _next++;
+	return true;
+}
+
+void Prefetcher::finish(qsizetype index, String const &checksum, quint64 bytes) {
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_checksums[index] = checksum;
+		_bytes[index] = bytes;
+		_done[index] = 1;
+	}
+	_finished.notify_all();
+}
+
+void Prefetcher::runThreads() {
+	qsizetype index;
+	while(take(index, true)) {
+		Fd fd = open(String(_files.at(index)), O_RDONLY|O_CLOEXEC);
+		if(fd < 0) {
+			finish(index, String(), 0);
+			continue;
+		}
+		bool cached;
+		String const sum = Sha256::cachedChecksum(fd, &cached);
+		struct stat st;
+		if(cached)
+			posix_fadvise(fd, 0, BulkReader::HeaderSize, POSIX_FADV_WILLNEED);
+		finish(index, sum, !cached && !fstat(fd, &st) ? st.st_size : 0);
+	}
+}
+
+void Prefetcher::runUring() {
+#ifdef HAVE_LIBURING
+	// One read per file is in flight at any time, so the chunks
+	// complete in order and can be fed to the hash as they arrive.
+	// Reads go through the page cache (BulkReader::Mode::Direct is
+	// treated like DropBehind), but are subject to the same eviction
+	// and bandwidth limits as BulkReader's.
+	struct Read {
+		qsizetype index;
+		int fd;
+		struct stat st;
+		bool drop;
+		off_t offset;
+		Sha256 hash;
+		QByteArray buffer;
+	};
+	auto const submit = [this](Read *r) {
+		io_uring_sqe *sqe = io_uring_get_sqe(_ring);
+		io_uring_prep_read(sqe, r->fd, r->buffer.data(), BulkReader::ChunkSize, r->offset);
+		io_uring_sqe_set_data(sqe, r);
+	};
+	auto const complete = [this](Read *r, String const &checksum) {
+		close(r->fd);
+		finish(r->index, checksum, checksum.isEmpty() ? 0 : r->offset);
+		delete r;
+	};
+
+	int inflight = 0;
+	qsizetype index;
+	for(;;) {
+		while(take(index, !inflight)) {
+			int const fd = open(String(_files.at(index)), O_RDONLY|O_CLOEXEC);
+			struct stat st;
+			if(fd < 0 || fstat(fd, &st)) {
+				if(fd >= 0)
+					close(fd);
+				finish(index, String(), 0);
+				continue;
+			}
+			if(String const cached = Sha256::xattrChecksum(fd, st); !cached.isEmpty()) {
+				posix_fadvise(fd, 0, BulkReader::HeaderSize, POSIX_FADV_WILLNEED);
+				close(fd);
+				finish(index, cached, 0);
+				continue;
+			}
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			bool const drop = BulkReader::mode() != BulkReader::Mode::Cached && !BulkReader::isCached(fd, st.st_size);
+			Read *r = new Read{index, fd, st, drop, 0, Sha256(), QByteArray(BulkReader::ChunkSize, Qt::Uninitialized)};
+			BulkReader::throttle(BulkReader::ChunkSize);
+			submit(r);
+			inflight++;
+		}
+		if(!inflight)
+			return;
+
+		int const ret = io_uring_submit_and_wait(_ring, 1);
+		if(ret < 0 && ret != -EINTR) {
+			// Shouldn't happen... Leave the remaining files to the
+			// caller. Reads in flight are leaked on purpose, the
+			// kernel may still write to their buffers.
+			std::cerr << "io_uring submission failed: " << strerror(-ret) << ", ignoring" << std::endl;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				_failed = true;
+			}
+			_finished.notify_all();
+			return;
+		}
+
+		io_uring_cqe *cqe;
+		unsigned int head;
+		unsigned int seen = 0;
+		io_uring_for_each_cqe(_ring, head, cqe) {
+			seen++;
+			Read *r = static_cast<Read*>(io_uring_cqe_get_data(cqe));
+			int const res = cqe->res;
+			if(res > 0) {
+				r->hash.addData(r->buffer.constData(), res);
+				if(r->drop)
+					BulkReader::dropBehind(r->fd, r->offset, r->offset + res);
+				r->offset += res;
+			}
+			if(!_stop && (res > 0 || res == -EINTR || res == -EAGAIN)) {
+				if(res > 0)
+					BulkReader::throttle(BulkReader::ChunkSize);
+				submit(r);
+				continue;
+			}
+			inflight--;
+			if(res == 0) {
+				String const sum = r->hash.result();
+				Sha256::storeXattrChecksum(r->fd, r->st, sum);
+				complete(r, sum);
+			} else
+				complete(r, String());
+		}
+		io_uring_cq_advance(_ring, seen);
+	}
+#endif
+}
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <QStringList>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct io_uring;
+
+/**
+ * Reads packages ahead of the one being processed, so the disk
+ * is kept busy while the CPU works on the current package.
+ *
+ * Up to a configurable number of upcoming packages are read in the
+ * background and checksummed as their data comes in. Reading them
+ * also pulls their headers into the page cache, so opening them
+ * with Rpm doesn't have to wait for the disk.
+ *
+ * Uses io_uring if available, a pool of threads doing blocking
+ * reads otherwise.
+ */
+class Prefetcher {
+public:
+	/**
+	 * @param files Files that are going to be processed, in order
+	 * @param window Number of files to read ahead of the one being
+	 *        processed, 0 to disable prefetching
+	 */
+	Prefetcher(QStringList const &files, int window);
+	~Prefetcher();
+	/**
+	 * Checksum of a file, waiting for it to be read if necessary.
+	 * Files must be retrieved in order -- retrieving a file allows
+	 * the prefetcher to move on to the next ones. Several threads
+	 * may retrieve files concurrently, as long as each of them
+	 * moves forward.
+	 * @return the checksum, or an empty string if the file couldn't
+	 *         be prefetched
+	 */
+	String checksum(qsizetype index);
+	/** Name of the I/O backend in use */
+	char const *backend() const;
+private:
+	bool take(qsizetype &index, bool wait);
+	void finish(qsizetype index, String const &checksum, quint64 bytes);
+	void runThreads();
+	void runUring();
+private:
+	QStringList const		_files;
+	int const			_window;
+	std::vector<String>		_checksums;
+	std::vector<quint64>		_bytes;
+	std::vector<char>		_done;
+	std::mutex			_lock;
+	// Signalled when a file has been read
+	std::condition_variable		_finished;
+	// Signalled when the window moves
+	std::condition_variable		_advanced;
+	qsizetype			_next = 0;
+	qsizetype			_consumed = 0;
+	std::atomic<bool>		_stop = false;
+	// Set if the backend gave up, the remaining files have
+	// to be read by the caller
+	bool				_failed = false;
+	std::vector<std::thread>	_threads;
+	io_uring			*_ring = nullptr;
+};
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "RecordFile.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+}
+
+static constexpr quint32 recordMagic = 0x52504d52; // "RPMR"
+static constexpr quint32 recordVersion = 1;
+static constexpr quint32 journalMagic = 0x52504d4a; // "RPMJ"
+static constexpr quint32 journalVersion = 1;
+// Make the journal durable at most this often (in milliseconds)
+static constexpr qint64 checkpointInterval = 1000;
+// Fixed, so files can be read by builds using a different Qt version
+static constexpr QDataStream::Version streamVersion = QDataStream::Qt_6_0;
+
+/**
+ * Serialize a record (without compressing it)
+ */
+static QByteArray encode(QString const &rpm, PackageRecord const &r) {
+	QByteArray record;
+	QDataStream ds(&record, QIODevice::WriteOnly);
+	ds.setVersion(streamVersion);
+	ds << rpm << r.size << r.mtime << static_cast<QByteArray const &>(r.location) << static_cast<QByteArray const &>(r.pkgid)
+		<< r.primary << r.filelists << r.other << r.appstream;
+	// Sorted, so the output doesn't depend on hash order
+	QList<String> icons = r.icons.keys();
+	std::sort(icons.begin(), icons.end());
+	ds << static_cast<quint32>(icons.count());
+	for(String const &icon : icons)
+		ds << static_cast<QByteArray const &>(icon) << r.icons.value(icon);
+	return record;
+}
+
+/**
+ * Deserialize a record produced by encode()
+ */
+static bool decode(QByteArray const &record, QString &rpm, PackageRecord &r) {
+	if(record.isEmpty())
+		return false;
+	QDataStream ds(record);
+	ds.setVersion(streamVersion);
+	QByteArray location, pkgid;
+	quint32 icons;
+	r = PackageRecord();
+	ds >> rpm >> r.size >> r.mtime >> location >> pkgid
+		>> r.primary >> r.filelists >> r.other >> r.appstream >> icons;
+	r.location = location;
+	r.pkgid = pkgid;
+	for(quint32 i=0; i<icons && ds.status() == QDataStream::Ok; i++) {
+		QByteArray name, data;
+		ds >> name >> data;
+		r.icons.insert(name, data);
+	}
+	return ds.status() == QDataStream::Ok;
+}
+
+RecordWriter::RecordWriter(QString const &filename, QStringList const &packages, quint32 shard, quint32 shards):_file(filename),_open(false) {
+	if(!_file.open(QFile::WriteOnly|QFile::Truncate)) {
+		std::cerr << "Can't create " << qPrintable(filename) << ", ignoring" << std::endl;
+		return;
+	}
+	_ds.setDevice(&_file);
+	_ds.setVersion(streamVersion);
+	_ds << recordMagic << recordVersion << shard << shards << packages;
+	_open = _ds.status() == QDataStream::Ok;
+}
+
+bool RecordWriter::add(QString const &rpm, PackageRecord const &r) {
+	if(!_open)
+		return false;
+	_ds << static_cast<quint8>(1) << qCompress(encode(rpm, r));
+	return _ds.status() == QDataStream::Ok;
+}
+
+bool RecordWriter::commit() {
+	if(!_open)
+		return false;
+	_open = false;
+	_ds << static_cast<quint8>(0);
+	return _ds.status() == QDataStream::Ok && _file.commit();
+}
+
+RecordReader::RecordReader(QString const &filename):_file(filename),_open(false),_atEnd(false),_shard(0),_shards(0) {
+	if(!_file.open(QFile::ReadOnly))
+		return;
+	_ds.setDevice(&_file);
+	_ds.setVersion(streamVersion);
+	quint32 magic, version;
+	_ds >> magic >> version;
+	if(_ds.status() != QDataStream::Ok || magic != recordMagic || version != recordVersion) {
+		std::cerr << "Ignoring record file in unknown format: " << qPrintable(filename) << std::endl;
+		return;
+	}
+	_ds >> _shard >> _shards >> _packages;
+	_open = _ds.status() == QDataStream::Ok;
+}
+
+bool RecordReader::next(QString &rpm, PackageRecord &r) {
+	if(!_open)
+		return false;
+	quint8 more;
+	_ds >> more;
+	if(_ds.status() != QDataStream::Ok || !more) {
+		_open = false;
+		_atEnd = _ds.status() == QDataStream::Ok;
+		return false;
+	}
+	QByteArray compressed;
+	_ds >> compressed;
+	if(_ds.status() != QDataStream::Ok || !decode(qUncompress(compressed), rpm, r)) {
+		std::cerr << "Record file " << qPrintable(_file.fileName()) << " is corrupt" << std::endl;
+		_open = false;
+		return false;
+	}
+	return true;
+}
+
+RecordJournal::RecordJournal(QString const &filename):_file(filename),_open(false) {
+	if(!_file.open(QFile::ReadWrite)) {
+		std::cerr << "Can't open journal " << qPrintable(filename) << ", ignoring" << std::endl;
+		return;
+	}
+	QDataStream ds(&_file);
+	ds.setVersion(streamVersion);
+	quint32 magic, version;
+	ds >> magic >> version;
+	qint64 valid = 0;
+	if(ds.status() == QDataStream::Ok && magic == journalMagic && version == journalVersion) {
+		// Index everything up to the first incomplete entry -- the
+		// process writing the journal may have died in the middle
+		// of writing one
+		valid = _file.pos();
+		for(;;) {
+			Entry e;
+			QString rpm;
+			quint32 length;
+			e.offset = _file.pos();
+			ds >> rpm >> e.size >> e.mtime >> e.inode >> length;
+			if(ds.status() != QDataStream::Ok || ds.skipRawData(length) != static_cast<int>(length))
+				break;
+			_index.insert(rpm, e);
+			valid = _file.pos();
+		}
+		ds.resetStatus();
+	}
+	if(!valid) {
+		_file.resize(0);
+		_file.seek(0);
+		ds.resetStatus();
+		ds << journalMagic << journalVersion;
+		valid = _file.pos();
+	} else if(valid < _file.size())
+		_file.resize(valid);
+	_file.seek(valid);
+	_open = ds.status() == QDataStream::Ok;
+	_lastCheckpoint.start();
+}
+
+RecordJournal::~RecordJournal() {
+	checkpoint();
+}
+
+bool RecordJournal::isCurrent(QString const &rpm, QString const &path) const {
+	auto const e = _index.constFind(rpm);
+	if(e == _index.cend())
+		return false;
+	struct stat st;
+	if(stat(QFile::encodeName(path), &st))
+		return false;
+	return e->size == st.st_size && e->mtime == static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec && e->inode == st.st_ino;
+}
+
+bool RecordJournal::read(QString const &rpm, PackageRecord &r) {
+	auto const e = _index.constFind(rpm);
+	if(!_open || e == _index.cend())
+		return false;
+	qint64 const end = _file.pos();
+	_file.seek(e->offset);
+	QDataStream ds(&_file);
+	ds.setVersion(streamVersion);
+	QString name;
+	qint64 size, mtime;
+	quint64 inode;
+	quint32 length;
+	ds >> name >> size >> mtime >> inode >> length;
+	QByteArray compressed(length, Qt::Uninitialized);
+	bool const ok = ds.status() == QDataStream::Ok && ds.readRawData(compressed.data(), length) == static_cast<int>(length) && decode(qUncompress(compressed), name, r) && name == rpm;
+	_file.seek(end);
+	return ok;
+}
+
+bool RecordJournal::add(QString const &rpm, PackageRecord const &r) {
+	if(!_open)
+		return false;
+	QByteArray const compressed = qCompress(encode(rpm, r));
+	QDataStream ds(&_file);
+	ds.setVersion(streamVersion);
+	ds << rpm << r.size << r.mtime << r.inode << static_cast<quint32>(compressed.size());
+	ds.writeRawData(compressed.constData(), compressed.size());
+	if(ds.status() != QDataStream::Ok) {
+		std::cerr << "Can't write to journal " << qPrintable(_file.fileName()) << ", ignoring" << std::endl;
+		_open = false;
+		return false;
+	}
+	if(_lastCheckpoint.elapsed() >= checkpointInterval)
+		checkpoint();
+	return true;
+}
+
+void RecordJournal::checkpoint() {
+	if(!_open)
+		return;
+	_file.flush();
+	fdatasync(_file.handle());
+	_lastCheckpoint.restart();
+}
+
+void RecordJournal::remove() {
+	_open = false;
+	_file.remove();
+}
+
+RecordSpill::RecordSpill(QString const &directory):_end(0) {
+	QByteArray const dir = QFile::encodeName(directory);
+	_fd = open(dir, O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+	if(_fd < 0) {
+		// Not every filesystem supports O_TMPFILE
+		QByteArray name = dir + "/.repodata.spill.XXXXXX";
+		_fd = mkostemp(name.data(), O_CLOEXEC);
+		if(_fd >= 0)
+			unlink(name);
+	}
+	if(_fd < 0)
+		std::cerr << "Can't create spill file in " << qPrintable(directory) << ": " << strerror(errno) << std::endl;
+}
+
+RecordSpill::~RecordSpill() {
+	if(_fd >= 0)
+		close(_fd);
+}
+
+qint64 RecordSpill::add(PackageRecord const &r) {
+	if(_fd < 0)
+		return -1;
+	// Each record is preceded by its length and the inode,
+	// which isn't part of the serialized form
+	QByteArray const compressed = qCompress(encode(QString(), r));
+	quint64 const header[2] = { static_cast<quint64>(compressed.size()), r.inode };
+	qint64 const position = _end.fetch_add(sizeof(header) + compressed.size());
+	if(pwrite(_fd, header, sizeof(header), position) != static_cast<ssize_t>(sizeof(header)) ||
+	   pwrite(_fd, compressed.constData(), compressed.size(), position + sizeof(header)) != compressed.size()) {
+		std::cerr << "Can't write to spill file: " << strerror(errno) << std::endl;
+		return -1;
+	}
+	return position;
+}
+
+bool RecordSpill::read(qint64 position, PackageRecord &r) const {
+	quint64 header[2];
+	if(_fd < 0 || position < 0 || pread(_fd, header, sizeof(header), position) != static_cast<ssize_t>(sizeof(header)))
+		return false;
+	QByteArray compressed(header[0], Qt::Uninitialized);
+	if(pread(_fd, compressed.data(), compressed.size(), position + sizeof(header)) != compressed.size())
+		return false;
+	QString rpm;
+	if(!decode(qUncompress(compressed), rpm, r))
+		return false;
+	r.inode = header[1];
+	return true;
+}
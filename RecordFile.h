@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "MetadataWriter.h"
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QSaveFile>
+#include <QStringList>
+#include <atomic>
+
+/**
+ * Writes package records to a file, so metadata generated on
+ * several machines (or in several runs) can be combined later.
+ *
+ * Records are compressed individually, so neither writing nor
+ * reading needs to hold more than one of them in memory.
+ * The file only appears once commit() is called.
+ */
+class RecordWriter {
+public:
+	/**
+	 * @param filename File to write to
+	 * @param packages All packages of the repository (not just the
+	 *        ones whose records are written) at the time of the scan
+	 * @param shard Index of the shard the records belong to
+	 * @param shards Number of shards
+	 */
+	RecordWriter(QString const &filename, QStringList const &packages, quint32 shard=0, quint32 shards=1);
+	bool isOpen() const { return _open; }
+	bool add(QString const &rpm, PackageRecord const &r);
+	bool commit();
+private:
+	QSaveFile	_file;
+	QDataStream	_ds;
+	bool		_open;
+};
+
+/**
+ * Reads package records written by RecordWriter
+ */
+class RecordReader {
+public:
+	RecordReader(QString const &filename);
+	bool isOpen() const { return _open; }
+	QStringList const &packages() const { return _packages; }
+	quint32 shard() const { return _shard; }
+	quint32 shards() const { return _shards; }
+	/**
+	 * Read the next record
+	 * @return \c false at the end of the file or on errors
+	 *         (see atEnd())
+	 */
+	bool next(QString &rpm, PackageRecord &r);
+	/** @return \c true if all records have been read successfully */
+	bool atEnd() const { return _atEnd; }
+private:
+	QFile		_file;
+	QDataStream	_ds;
+	bool		_open;
+	bool		_atEnd;
+	QStringList	_packages;
+	quint32		_shard;
+	quint32		_shards;
+};
+
+/**
+ * Append-only journal of the records generated so far, so a run
+ * that gets interrupted can be resumed.
+ *
+ * Records are made durable (fdatasync) at regular checkpoints.
+ * When the journal is opened, everything up to the first incomplete
+ * record is kept, the rest is discarded.
+ */
+class RecordJournal {
+public:
+	RecordJournal(QString const &filename);
+	~RecordJournal();
+	bool isOpen() const { return _open; }
+	/** Number of records found in the journal when it was opened */
+	qsizetype count() const { return _index.count(); }
+	/**
+	 * Check if the journal has a record for a package that
+	 * still has the size, mtime and inode it had when the
+	 * record was made
+	 * @param rpm Package name used in the journal
+	 * @param path Current location of the package
+	 */
+	bool isCurrent(QString const &rpm, QString const &path) const;
+	/** Retrieve a record found in the journal when it was opened */
+	bool read(QString const &rpm, PackageRecord &r);
+	bool add(QString const &rpm, PackageRecord const &r);
+	/** Make everything added so far durable */
+	void checkpoint();
+	/** Delete the journal (once its contents have been used) */
+	void remove();
+private:
+	struct Entry {
+		qint64 offset = 0;
+		qint64 size = 0;
+		qint64 mtime = 0;
+		quint64 inode = 0;
+	};
+	QFile			_file;
+	QHash<QString,Entry>	_index;
+	QElapsedTimer		_lastCheckpoint;
+	bool			_open;
+};
+
+/**
+ * Temporary storage for records that have to be kept around, but
+ * don't fit into memory for the time being.
+ *
+ * The file has no name and disappears when it is closed. It should
+ * be created on a real filesystem rather than a tmpfs, which would
+ * defeat the purpose.
+ */
+class RecordSpill {
+public:
+	/** @param directory Directory to create the file in */
+	RecordSpill(QString const &directory);
+	~RecordSpill();
+	bool isOpen() const { return _fd >= 0; }
+	/**
+	 * Store a record. May be called from several threads at once.
+	 * @return Position to read the record from, -1 on errors
+	 */
+	qint64 add(PackageRecord const &r);
+	bool read(qint64 position, PackageRecord &r) const;
+private:
+	int			_fd;
+	std::atomic<qint64>	_end;
+};
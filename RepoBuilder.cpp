@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "RepoBuilder.h"
+#include "Gui.h"
+#include "MetadataWriter.h"
+#include "PackageAnalyzer.h"
+#include "RepoLock.h"
+#include "Stats.h"
+#include <QCoreApplication>
+#include <QDir>
+#include <QMap>
+#include <QSet>
+#include <iostream>
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+struct RepoBuilder::Private {
+	QDir d;
+	String path;
+	String origin;
+	int jobs = PackageAnalyzer::defaultJobs();
+	int prefetchWindow = 4;
+	Progress progress;
+	QMap<QString,PackageRecord> packages;
+	// Packages to be analyzed before the next publish
+	QSet<QString> queued;
+	// Set if the published metadata doesn't match packages
+	bool stale = true;
+
+	/** stat() a package, \c false if it isn't a regular file */
+	bool stat(QString const &rpm, struct stat &st) const;
+	/** Check if a package is known and unchanged */
+	bool isCurrent(QString const &rpm, struct stat const &st) const;
+	void analyze();
+};
+
+bool RepoBuilder::Private::stat(QString const &rpm, struct stat &st) const {
+	if(rpm.isEmpty() || rpm.contains('/')) {
+		std::cerr << String(rpm) << " is not a package filename inside " << path << ", ignoring" << std::endl;
+		return false;
+	}
+	return !::stat(String(d.filePath(rpm)), &st) && S_ISREG(st.st_mode);
+}
+
+bool RepoBuilder::Private::isCurrent(QString const &rpm, struct stat const &st) const {
+	auto const it = packages.constFind(rpm);
+	return it != packages.cend() && it->size == st.st_size && it->mtime == static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+void RepoBuilder::Private::analyze() {
+	QStringList rpms(queued.cbegin(), queued.cend());
+	queued.clear();
+	if(rpms.isEmpty())
+		return;
+	rpms.sort();
+	Stats::addPackagesTotal(rpms.count());
+	Stats::count(Stats::CacheMisses, rpms.count());
+
+	PackageAnalyzer analyzer(jobs, prefetchWindow);
+	analyzer.addRepository(d, rpms, [this, &rpms](qsizetype index, PackageRecord &record) {
+		QString const &rpm = rpms.at(index);
+		// A package that was removed after being queued can't
+		// be stat()ed
+		if(record.size)
+			packages.insert(rpm, std::move(record));
+		else
+			packages.remove(rpm);
+		if(progress)
+			progress(index + 1, rpms.count(), rpm);
+	});
+	analyzer.run();
+	stale = true;
+}
+
+RepoBuilder::RepoBuilder(QString const &path, QString const &origin):_d(std::make_unique<Private>()) {
+	_d->d = QDir(path);
+	_d->path = _d->d.exists() ? _d->d.canonicalPath() : _d->d.absolutePath();
+	_d->d = QDir(_d->path);
+	_d->origin = origin;
+}
+
+RepoBuilder::~RepoBuilder() {
+}
+
+QString RepoBuilder::path() const {
+	return _d->path;
+}
+
+void RepoBuilder::setJobs(int jobs) {
+	_d->jobs = jobs;
+}
+
+void RepoBuilder::setPrefetchWindow(int packages) {
+	_d->prefetchWindow = packages;
+}
+
+void RepoBuilder::setProgress(Progress const &progress) {
+	_d->progress = progress;
+}
+
+bool RepoBuilder::addPackage(QString const &rpm) {
+	struct stat st;
+	if(!_d->stat(rpm, st))
+		return false;
+	if(!_d->isCurrent(rpm, st))
+		_d->queued.insert(rpm);
+	return true;
+}
+
+bool RepoBuilder::updatePackage(QString const &rpm) {
+	struct stat st;
+	if(!_d->stat(rpm, st))
+		return false;
+	_d->queued.insert(rpm);
+	return true;
+}
+
+bool RepoBuilder::removePackage(QString const &rpm) {
+	bool const known = _d->packages.remove(rpm) + _d->queued.remove(rpm);
+	if(known)
+		_d->stale = true;
+	return known;
+}
+
+bool RepoBuilder::rescan() {
+	if(!_d->d.exists()) {
+		std::cerr << _d->path << " has disappeared, ignoring" << std::endl;
+		return false;
+	}
+	QStringList rpms;
+	{
+		Stats::Scope stats(Stats::Scan);
+		rpms = _d->d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Name);
+	}
+	QSet<QString> const present(rpms.cbegin(), rpms.cend());
+	for(auto it = _d->packages.begin(); it != _d->packages.end(); ) {
+		if(present.contains(it.key()))
+			++it;
+		else {
+			it = _d->packages.erase(it);
+			_d->stale = true;
+		}
+	}
+	_d->queued.intersect(present);
+
+	qsizetype unchanged = 0;
+	for(QString const &rpm : rpms) {
+		struct stat st;
+		if(::stat(String(_d->d.filePath(rpm)), &st))
+			continue;
+		if(_d->isCurrent(rpm, st))
+			unchanged++;
+		else
+			_d->queued.insert(rpm);
+	}
+	Stats::count(Stats::CacheHits, unchanged);
+	return true;
+}
+
+QStringList RepoBuilder::packages() const {
+	QSet<QString> ret = _d->queued;
+	for(auto it = _d->packages.cbegin(); it != _d->packages.cend(); ++it)
+		ret.insert(it.key());
+	QStringList sorted(ret.cbegin(), ret.cend());
+	sorted.sort();
+	return sorted;
+}
+
+qsizetype RepoBuilder::queued() const {
+	return _d->queued.count();
+}
+
+bool RepoBuilder::isStale() const {
+	return _d->stale || !_d->queued.isEmpty();
+}
+
+bool RepoBuilder::init() {
+	if(!QCoreApplication::instance() && !Gui::isMainThread()) {
+		std::cerr << "RepoBuilder::init() has to be called on the main thread" << std::endl;
+		return false;
+	}
+	return Gui::init();
+}
+
+bool RepoBuilder::publish(bool force) {
+	// Analyzing packages may need QtGui, which can't be set up
+	// from here if this isn't the main thread
+	if(!QCoreApplication::instance()) {
+		std::cerr << "Can't publish " << _d->path << ": no application object, call RepoBuilder::init() on the main thread first" << std::endl;
+		return false;
+	}
+	_d->analyze();
+	if(!_d->stale && !force)
+		return true;
+	// Don't race with createmd runs on the same repository
+	RepoLock lock(_d->path);
+	if(!lock.lock())
+		std::cerr << "Can't lock " << _d->path << ", publishing without lock" << std::endl;
+	MetadataWriter writer(_d->path, _d->origin, _d->packages.count());
+	if(!writer.isOpen())
+		return false;
+	for(PackageRecord const &p : std::as_const(_d->packages))
+		writer.add(p);
+	if(!writer.finish()) {
+		std::cerr << "Couldn't publish metadata for " << _d->path << std::endl;
+		return false;
+	}
+	_d->stale = false;
+	return true;
+}
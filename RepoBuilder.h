@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <functional>
+#include <memory>
+
+/**
+ * Generates and maintains the metadata of a repository from within
+ * another process (such as a build system or repository manager).
+ *
+ * The metadata of all packages is kept in memory. Packages that are
+ * added or updated are analyzed on the next publish(), everything
+ * else is reused, so keeping a RepoBuilder around and telling it about
+ * changes is much cheaper than regenerating the metadata every time.
+ *
+ * Publishing takes the same lock as createmd runs on the repository,
+ * so the two can be used side by side.
+ *
+ * A RepoBuilder must not be used from several threads at once.
+ * Converting icons requires QtGui, which Qt only allows to be set up
+ * on the main thread: unless the program creates a QGuiApplication
+ * itself, it has to call init() on the main thread before publishing.
+ */
+class RepoBuilder {
+public:
+	/**
+	 * Receives progress while packages are analyzed. Called on
+	 * the worker threads, but never concurrently.
+	 * @param done Number of packages analyzed so far
+	 * @param total Number of packages being analyzed
+	 * @param rpm Filename of the package that was just analyzed
+	 */
+	using Progress = std::function<void(qsizetype done, qsizetype total, QString const &rpm)>;
+
+	/**
+	 * @param path Directory containing the packages
+	 * @param origin Origin identifier for the appstream metadata
+	 */
+	RepoBuilder(QString const &path, QString const &origin=QStringLiteral("openmandriva"));
+	RepoBuilder(RepoBuilder const &) = delete;
+	RepoBuilder &operator=(RepoBuilder const &) = delete;
+	~RepoBuilder();
+	/**
+	 * Set up QtGui, if the program doesn't have an application
+	 * object already. Has to be called on the main thread.
+	 * @return \c false if called on another thread, or if the
+	 *         program's application object isn't a QGuiApplication
+	 */
+	static bool init();
+	/** Canonical path of the repository */
+	QString path() const;
+	/** Number of packages to analyze in parallel */
+	void setJobs(int jobs);
+	/** Number of packages to read ahead (0 to disable) */
+	void setPrefetchWindow(int packages);
+	void setProgress(Progress const &progress);
+
+	/**
+	 * Add a package to the repository. Packages that are known
+	 * already are only analyzed again if they have changed.
+	 * @param rpm Package filename, relative to the repository
+	 * @return \c false if the package doesn't exist
+	 */
+	bool addPackage(QString const &rpm);
+	/**
+	 * Analyze a package again, even if it looks unchanged
+	 * @return \c false if the package doesn't exist
+	 */
+	bool updatePackage(QString const &rpm);
+	/**
+	 * Remove a package from the metadata
+	 * @return \c false if the package wasn't known
+	 */
+	bool removePackage(QString const &rpm);
+	/**
+	 * Compare the repository to the metadata, adding, updating
+	 * and removing packages as needed
+	 * @return \c false if the repository doesn't exist
+	 */
+	bool rescan();
+
+	/** Packages in the metadata, including those not analyzed yet */
+	QStringList packages() const;
+	/** Number of packages waiting to be analyzed */
+	qsizetype queued() const;
+	/** @return \c true if the published metadata is out of date */
+	bool isStale() const;
+	/**
+	 * Analyze the queued packages and publish the metadata
+	 * if anything has changed
+	 * @param force Publish even if nothing has changed
+	 * @return \c false if the metadata couldn't be written, or if
+	 *         there is no application object (see init())
+	 */
+	bool publish(bool force=false);
+private:
+	struct Private;
+	std::unique_ptr<Private>	_d;
+};
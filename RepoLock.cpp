@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "RepoLock.h"
+#include <QDir>
+#include <QFile>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+}
+
+static int openLockFile(QString const &filename) {
+	int const fd = open(QFile::encodeName(filename), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if(fd < 0)
+		std::cerr << "Can't open lock file " << qPrintable(filename) << ": " << strerror(errno) << ", ignoring" << std::endl;
+	return fd;
+}
+
+static int flockRetry(int fd, int operation) {
+	int ret;
+	while((ret = flock(fd, operation)) < 0 && errno == EINTR)
+		;
+	return ret;
+}
+
+RepoLock::RepoLock(QString const &path):_path(QDir(path).absolutePath()),_lock(-1),_queue(-1) {
+}
+
+RepoLock::~RepoLock() {
+	// Closing the files releases the locks
+	if(_queue >= 0)
+		close(_queue);
+	if(_lock >= 0)
+		close(_lock);
+}
+
+bool RepoLock::queue() {
+	if(_queue < 0)
+		_queue = openLockFile(_path + "/.repodata.lock.queue");
+	// If we can't lock, we can't coalesce either -- the run just
+	// has to wait for its turn
+	if(_queue < 0)
+		return true;
+	if(!flockRetry(_queue, LOCK_EX|LOCK_NB))
+		return true;
+	if(errno != EWOULDBLOCK) {
+		std::cerr << "Can't lock " << qPrintable(_path) << ": " << strerror(errno) << ", ignoring" << std::endl;
+		return true;
+	}
+	close(_queue);
+	_queue = -1;
+	return false;
+}
+
+bool RepoLock::lock() {
+	if(_lock < 0)
+		_lock = openLockFile(_path + "/.repodata.lock");
+	bool const ok = _lock >= 0 && !flockRetry(_lock, LOCK_EX);
+	if(_queue >= 0) {
+		close(_queue);
+		_queue = -1;
+	}
+	if(ok) {
+		// Everyone writing temporary directories holds the lock,
+		// so anything left at this point is from a run that died
+		QDir d(_path);
+		for(QString const &temp : d.entryList(QStringList() << ".repodata.temp.*", QDir::Dirs|QDir::Hidden|QDir::NoDotAndDotDot))
+			QDir(d.filePath(temp)).removeRecursively();
+	}
+	return ok;
+}
+
+QStringList RepoLock::lock(QStringList const &paths, std::list<RepoLock> &locks) {
+	// Locks are taken in a fixed order, so runs given overlapping
+	// sets of repositories can't deadlock
+	QStringList sorted;
+	for(QString const &path : paths)
+		sorted.append(QDir(path).absolutePath());
+	sorted.sort();
+	sorted.removeDuplicates();
+
+	QStringList queued;
+	for(QString const &path : sorted) {
+		if(!QDir(path).exists()) {
+			// Let the caller complain about it
+			queued.append(path);
+			continue;
+		}
+		RepoLock &l = locks.emplace_back(path);
+		if(l.queue())
+			queued.append(path);
+		else {
+			std::cerr << "Another run on " << qPrintable(path) << " is queued already and will cover it, skipping" << std::endl;
+			locks.pop_back();
+		}
+	}
+	for(RepoLock &l : locks) {
+		if(!l.lock())
+			std::cerr << "Can't lock " << qPrintable(l._path) << ", continuing without lock" << std::endl;
+	}
+
+	QStringList ret;
+	for(QString const &path : paths) {
+		if(queued.contains(QDir(path).absolutePath()))
+			ret.append(path);
+	}
+	ret.removeDuplicates();
+	return ret;
+}
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <QStringList>
+#include <list>
+
+/**
+ * Advisory lock (flock) serializing metadata generation runs
+ * on a repository.
+ *
+ * Runs started while another one is in progress are coalesced:
+ * one of them queues up and starts when the current run is done.
+ * Any others exit right away -- the queued run will scan the
+ * repository after they were started, so it covers whatever
+ * changes they were started for.
+ */
+class RepoLock {
+public:
+	RepoLock(QString const &path);
+	~RepoLock();
+	/**
+	 * Take the queue slot, without waiting
+	 * @return \c false if another run is waiting already
+	 */
+	bool queue();
+	/**
+	 * Wait for the repository to be free and lock it. Gives up
+	 * the queue slot (if taken) once the lock is held, so the
+	 * next run can queue up.
+	 * Temporary directories left behind by runs that died are
+	 * removed once the lock is held.
+	 */
+	bool lock();
+	/**
+	 * Lock a number of repositories with coalescing
+	 * @param paths Repositories to lock
+	 * @param locks Receives the locks, which must be kept until
+	 *        the repositories are done
+	 * @return The repositories that were locked and need to be
+	 *         processed (in the order given)
+	 */
+	static QStringList lock(QStringList const &paths, std::list<RepoLock> &locks);
+private:
+	QString	_path;
+	int	_lock;
+	int	_queue;
+};
@@ -3,43 +3,74 @@
 #include "Rpm.h"
 #include "DesktopFile.h"
 #include "Archive.h"
+#include "Icon.h"
+#include "Stats.h"
+#include "Sha256.h"
+#include "Fd.h"
+#include "BulkReader.h"
 #include <QFile>
-#include <QCryptographicHash>
 #include <QDomDocument>
 #include <QHash>
-#include <QImage>
-#include <QBuffer>
-#include <QPainter>
-#include <QSvgRenderer>
 #include <iostream>
 #include <cstring>
 #include <algorithm>
+#include <mutex>
 
 extern "C" {
 #include <archive.h>
 #include <archive_entry.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmmacro.h>
 }
 
-rpmts Rpm::_ts = nullptr;
+namespace {
+// librpm transaction sets can't be shared between threads,
+// so every thread opening packages gets its own
+struct TransactionSet {
+	rpmts ts = nullptr;
+	~TransactionSet() { if(ts) rpmtsFree(ts); }
+};
+thread_local TransactionSet threadTransactionSet;
+std::once_flag configRead;
+bool minimalConfig = false;
+}
 
-void Rpm::initRpm() {
-	rpmReadConfigFiles(NULL, NULL);
-	_ts = rpmtsCreate();
-	rpmtsSetVSFlags(_ts, _RPMVSF_NODIGESTS | _RPMVSF_NOSIGNATURES | RPMVSF_NOHDRCHK);
+void Rpm::setMinimalConfig() {
+	minimalConfig = true;
 }
 
-Rpm::Rpm(FileName const &filename):_filename(filename) {
-	if(!_ts)
-		initRpm();
+rpmts Rpm::transactionSet() {
+	TransactionSet &t = threadTransactionSet;
+	if(!t.ts) {
+		std::call_once(configRead, []() {
+			if(minimalConfig) {
+				static std::string const macros = std::string(rpmConfigDir()) + "/macros";
+				macrofiles = macros.c_str();
+			}
+			rpmReadConfigFiles(NULL, NULL);
+		});
+		t.ts = rpmtsCreate();
+		rpmtsSetVSFlags(t.ts, _RPMVSF_NODIGESTS | _RPMVSF_NOSIGNATURES | RPMVSF_NOHDRCHK);
+	}
+	return t.ts;
+}
 
+Rpm::Rpm(FileName const &filename):_filename(filename),_hdr(nullptr) {
+	Stats::Scope stats(Stats::Open);
 	FD_t rpmFd = Fopen(filename, "r");
-	int rc = rpmReadPackageFile(_ts, rpmFd, NULL, &_hdr);
+	int rc;
+	{
+		Stats::Scope header(Stats::Header);
+		rc = rpmReadPackageFile(transactionSet(), rpmFd, NULL, &_hdr);
+	}
 	if(rc == RPMRC_NOKEY || rc == RPMRC_NOTTRUSTED) {
 		std::cerr << filename << ": signature problem " << rc << std::endl;
 	} else if(rc != RPMRC_OK) {
 		std::cerr << "Can't open " << filename << ": " << rc << std::endl;
+		if(rpmFd)
+			Fclose(rpmFd);
 		return;
 	}
 
@@ -73,11 +104,14 @@ Rpm::Rpm(FileName const &filename):_filename(filename) {
 	uint32_t hdrindexsize = hdrindex * 16;
 	uint32_t hdrsize = hdrdata + hdrindexsize + 16;
 	_headersEnd = _headersStart + hdrsize;
+	stats.addBytes(_headersEnd, 0);
 
 	Fclose(rpmFd);
 }
 
 Rpm::~Rpm() {
+	if(_hdr)
+		headerFree(_hdr);
 }
 
 static constexpr struct {
@@ -161,7 +195,9 @@ QList<Dependency> Rpm::dependencies(enum DepType type) const {
 		      (rpmtdNext(depFlags) != -1) &&
 		      (rpmtdNext(depVersion) != -1)
 		     ) {
-			ret.append(Dependency(rpmtdGetString(deps), rpmtdGetNumber(depFlags), rpmtdGetString(depVersion)));
+			// Most dependencies (and many versions) are shared by
+			// lots of packages
+			ret.append(Dependency(StringPool::intern(rpmtdGetString(deps)), rpmtdGetNumber(depFlags), StringPool::intern(rpmtdGetString(depVersion))));
 		}
 	}
 	rpmtdFreeData(deps);
@@ -174,7 +210,9 @@ QList<Dependency> Rpm::dependencies(enum DepType type) const {
 }
 
 String Dependency::repoMd() const {
-	String ret = "<rpm:entry name=\"" + name().xmlEncode() + "\"";
+	String ret = "<rpm:entry name=\"";
+	name().appendXmlEncoded(ret);
+	ret += '"';
 	String s = repoMdFlags();
 	if(s)
 		ret += " flags=\"" + s + "\"";
@@ -190,13 +228,14 @@ String Rpm::dependenciesMd(enum DepType type) const {
 	if(!deps.size())
 		return String();
 	String ret = String("		<rpm:") + depType[static_cast<uint8_t>(type)].repoMdTag + ">\n";
-	for(Dependency const &d : dependencies(type))
+	for(Dependency const &d : deps)
 		ret += "			" + d.repoMd() + "\n";
 	ret += String("		</rpm:") + depType[static_cast<uint8_t>(type)].repoMdTag + ">\n";
 	return ret;
 }
 
 String Rpm::dependenciesMd() const {
+	Stats::Scope stats(Stats::Dependencies);
 	return dependenciesMd(DepType::Provides) +
 		dependenciesMd(DepType::Requires) +
 		dependenciesMd(DepType::Conflicts) +
@@ -209,16 +248,12 @@ String Rpm::dependenciesMd() const {
 
 String Rpm::sha256() {
 	if(_sha256.isEmpty()) {
-		QFile rpm;
-		int fd = open(_filename, O_RDONLY);
-		lseek(fd, 0, SEEK_SET);
-		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
-		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
-		rpm.open(fd, QFile::ReadOnly, QFile::AutoCloseHandle);
-		QCryptographicHash hash(QCryptographicHash::Sha256);
-		hash.addData(&rpm);
-		rpm.close();
-		_sha256=hash.result().toHex();
+		Stats::Scope stats(Stats::Checksum);
+		Fd fd = open(_filename, O_RDONLY|O_CLOEXEC);
+		bool cached;
+		_sha256 = Sha256::cachedChecksum(fd, &cached);
+		if(!cached)
+			stats.addBytes(_fileSize, 0);
 	}
 	return _sha256;
 }
@@ -290,27 +325,6 @@ int sizeSortKey(QByteArray const &sizeDir)
 	return 200;
 }
 
-/// Rasterize SVG/SVGZ bytes to a PNG of the given pixel size. Empty on failure.
-QByteArray rasterizeSvgToPng(QByteArray const &data, int pixelSize)
-{
-	QSvgRenderer renderer(data);
-	if (!renderer.isValid())
-		return {};
-	QImage img(pixelSize, pixelSize, QImage::Format_ARGB32_Premultiplied);
-	img.fill(Qt::transparent);
-	QPainter painter(&img);
-	renderer.render(&painter);
-	painter.end();
-	if (img.isNull())
-		return {};
-	QBuffer buf;
-	if (!buf.open(QIODevice::WriteOnly))
-		return {};
-	if (!img.save(&buf, "PNG") || buf.data().isEmpty())
-		return {};
-	return buf.data();
-}
-
 /// True if component already has at least one icon of the given type.
 bool hasIconType(QDomElement const &root, char const *type)
 {
@@ -435,6 +449,7 @@ struct CachedIconEntry {
 /// Build cached icon blobs + metadata fields for AppStream.
 QList<CachedIconEntry> buildCachedIcons(QHash<String, QByteArray> const &iconData, String const &iconName)
 {
+	Stats::Scope stats(Stats::Icons);
 	QList<CachedIconEntry> out;
 	const String base = iconBaseName(iconName);
 
@@ -454,7 +469,7 @@ QList<CachedIconEntry> buildCachedIcons(QHash<String, QByteArray> const &iconDat
 
 		if (isSvg || sizeDir == "scalable") {
 			// Always rasterize vectors into 64x64 PNG for the catalog cache.
-			QByteArray png = rasterizeSvgToPng(i.value(), 64);
+			QByteArray png = Icon::svgToPng(i.value(), 64);
 			if (png.isEmpty())
 				continue;
 			entry.archivePath = "64x64/" + base + ".png";
@@ -468,17 +483,10 @@ QList<CachedIconEntry> buildCachedIcons(QHash<String, QByteArray> const &iconDat
 				w = sizeDir.left(sizeDir.indexOf('x')).toInt();
 			if (w <= 0)
 				w = 64;
-			// If not PNG, try QImage convert
+			// If not PNG, convert it
 			QByteArray payload = i.value();
-			if (!endsWithI(i.key(), ".png")) {
-				QImage img;
-				if (!img.loadFromData(payload) || img.isNull())
-					continue;
-				QBuffer buf;
-				if (!buf.open(QIODevice::WriteOnly) || !img.save(&buf, "PNG") || buf.data().isEmpty())
-					continue;
-				payload = buf.data();
-			}
+			if (!endsWithI(i.key(), ".png"))
+				payload = Icon::toPng(payload);
 			if (payload.isEmpty())
 				continue;
 			entry.archivePath = String(QByteArray::number(w) + "x" + QByteArray::number(w)) + "/" + base + ".png";
@@ -583,6 +591,7 @@ String iconXmlForDesktop(String const &iconName, QList<String> const &iconFiles,
 } // namespace
 
 String Rpm::appstreamMd(QHash<String,QByteArray> *icons) const {
+	Stats::Scope stats(Stats::Appstream);
 	if(icons)
 		icons->clear();
 	String ret;
@@ -858,12 +867,21 @@ String Rpm::appstreamMd(QHash<String,QByteArray> *icons) const {
 }
 
 QHash<String,QByteArray> Rpm::extractFiles(QList<String> const &filenames) const {
+	Stats::Scope stats(Stats::Payload);
 	QHash<String,QByteArray> ret;
+	Fd fd = open(_filename, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return ret;
+	BulkReader reader(fd);
 	archive *a = archive_read_new();
 	archive_read_support_filter_all(a);
 	archive_read_support_format_all(a);
-	int r = archive_read_open_filename(a, _filename, 16384);
+	auto const read = [](archive *, void *reader, void const **buffer) -> la_ssize_t {
+		return static_cast<BulkReader*>(reader)->read(reinterpret_cast<char const**>(buffer));
+	};
+	int r = archive_read_open(a, &reader, nullptr, read, nullptr);
 	if(r != ARCHIVE_OK) {
+		archive_read_free(a);
 		return ret;
 	}
 	ret.reserve(filenames.count());
@@ -877,6 +895,7 @@ QHash<String,QByteArray> Rpm::extractFiles(QList<String> const &filenames) const
 			char buf[size];
 			int r = archive_read_data(a, &buf, size);
 			ret.insert(fn, QByteArray(buf, size));
+			stats.addBytes(size, 0);
 			if(ret.count() == filenames.count()) {
 				// No need to keep reading the archive...
 				break;
@@ -889,11 +908,33 @@ QHash<String,QByteArray> Rpm::extractFiles(QList<String> const &filenames) const
 }
 
 Files Rpm::fileList(bool onlyPrimary) const {
+	if(!_filesRead) {
+		readFileList();
+		_filesRead = true;
+	}
+	if(!onlyPrimary)
+		return _files;
+	Files fn;
+	for(FileInfo const &fi : _files) {
+		// The definition of what is "primary" and what isn't is very vague.
+		// According to https://createrepo.baseurl.org/:
+		// "CERTAIN files - specifically files matching: /etc*,
+		// *bin/*, /usr/lib/sendmail"
+		// So we'll take anything in /etc and anything that's
+		// executable and not a shared library (seems to make more
+		// sense than *bin/*, given there's such things as /opt)
+		if((S_ISREG(fi.mode()) && (fi.mode() & 0111) && !fi.name().contains(".so")) ||
+		   fi.name().startsWith("/etc/"))
+			fn.append(fi);
+	}
+	return fn;
+}
+
+void Rpm::readFileList() const {
 	// Also potentially of interest:
 	// RPMTAG_DIRINDEXES seems to hold a number associated with the directory the file is in
 	// RPMTAG_BASENAMES holds the basename of every file
 	// RPMTAG_FILEDIGESTS holds the SHA256 checksum of every file (in string format; empty for symlinks and directories)
-	Files fn;
 	// Filenames
 	rpmtd filenames = rpmtdNew();
 	// RPMTAG_FILEFLAGS attributes -- see enum rpmfileAttrs_e in <rpm/rpmfiles.h>
@@ -910,40 +951,39 @@ Files Rpm::fileList(bool onlyPrimary) const {
 	   headerGet(_hdr, RPMTAG_FILEFLAGS, fileflags, flags) &&
 	   headerGet(_hdr, RPMTAG_FILEMODES, filemodes, flags)
 	  ) {
+		_files.reserve(rpmtdCount(filenames));
 		while((rpmtdNext(filenames) != -1) &&
 		      (rpmtdNext(fileflags) != -1) &&
 		      (rpmtdNext(filemodes) != -1)
 		     ) {
-			FileInfo fi(rpmtdGetString(filenames), static_cast<rpmfileAttrs_e>(rpmtdGetNumber(fileflags)), rpmtdGetNumber(filemodes));
-			// The definition of what is "primary" and what isn't is very vague.
-			// According to https://createrepo.baseurl.org/:
-			// "CERTAIN files - specifically files matching: /etc*,
-			// *bin/*, /usr/lib/sendmail"
-			// So we'll take anything in /etc and anything that's
-			// executable and not a shared library (seems to make more
-			// sense than *bin/*, given there's such things as /opt)
-			if(!onlyPrimary ||
-			   ((S_ISREG(fi.mode()) && (fi.mode() & 0111) && !fi.name().contains(".so")) ||
-			    fi.name().startsWith("/etc/"))
-			  )
-				fn.append(fi);
+			// Copying the names into an arena takes a handful of
+			// allocations per package rather than one per file
+			_files.append(FileInfo(_fileNames.copy(rpmtdGetString(filenames)), static_cast<rpmfileAttrs_e>(rpmtdGetNumber(fileflags)), rpmtdGetNumber(filemodes)));
 		}
 	}
 	rpmtdFreeData(filenames);
+	rpmtdFreeData(fileflags);
+	rpmtdFreeData(filemodes);
 	rpmtdFree(filenames);
-	return fn;
+	rpmtdFree(fileflags);
+	rpmtdFree(filemodes);
 }
 
 String Rpm::fileListMd(bool onlyPrimary) const {
+	Stats::Scope stats(Stats::FileList);
 	String ret;
-	String indent = onlyPrimary ? "		" : "	";
+	char const * const openTag = onlyPrimary ? "		<file" : "	<file";
 	for(FileInfo const &f : fileList(onlyPrimary)) {
-		ret += indent + "<file";
+		// Appending piece by piece rather than concatenating
+		// avoids a temporary per file
+		ret += openTag;
 		if(S_ISDIR(f.mode()))
 			ret += " type=\"dir\"";
 		else if(f.attributes() & RPMFILE_GHOST)
 			ret += " type=\"ghost\"";
-		ret += ">" + f.name().xmlEncode() + "</file>\n";
+		ret += '>';
+		f.name().appendXmlEncoded(ret);
+		ret += "</file>\n";
 	}
 	return ret;
 }
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "FileName.h"
+#include "StringPool.h"
 #include <string>
 #include <iostream>
 
@@ -43,28 +44,46 @@ private:
 class Rpm {
 public:
 	Rpm(FileName const &filename);
+	/**
+	 * Make librpm load only its own default macros instead of every
+	 * macro file the distribution and installed packages ship --
+	 * reading packages doesn't need them.
+	 *
+	 * This changes librpm's process wide configuration, so it is
+	 * meant for the command line tools only, and must be called
+	 * before the first package is opened. Without it (e.g. in
+	 * librepobuilder), rpm's configuration is left as it is.
+	 */
+	static void setMinimalConfig();
+	// Owns the header
+	Rpm(Rpm const &) = delete;
+	Rpm &operator=(Rpm const &) = delete;
 	~Rpm();
+	/**
+	 * Files in the package. The file names are only valid as long
+	 * as the Rpm object exists.
+	 */
 	Files fileList(bool onlyPrimary=false) const;
 	String fileListMd(bool onlyPrimary=false) const;
 	String name() const { return headerString(RPMTAG_NAME); }
-	String arch() const { return _filename.endsWith(".src.rpm") ? "src" : headerString(RPMTAG_ARCH); } // Workaround for rpm putting the build arch into src.rpm headers
+	String arch() const { return _filename.endsWith(".src.rpm") ? "src" : pooledHeaderString(RPMTAG_ARCH); } // Workaround for rpm putting the build arch into src.rpm headers
 	int epoch() const { return headerNumber(RPMTAG_EPOCH); }
 	String version() const { return headerString(RPMTAG_VERSION); }
 	String repoMdVersion() const;
 	String release() const { return headerString(RPMTAG_RELEASE); }
 	String summary() const { return headerString(RPMTAG_SUMMARY); }
 	String description() const { return headerString(RPMTAG_DESCRIPTION); }
-	String packager() const { return headerString(RPMTAG_PACKAGER); }
+	String packager() const { return pooledHeaderString(RPMTAG_PACKAGER); }
 	String url() const { return headerString(RPMTAG_URL); }
 	time_t time() const { return _fileMtime; }
 	time_t buildTime() const { return headerNumber(RPMTAG_BUILDTIME); }
 	size_t size() const { return _fileSize; }
 	size_t installedSize() const { return headerNumber(RPMTAG_LONGSIZE); }
 	size_t archiveSize() const { return headerNumber(RPMTAG_ARCHIVESIZE); }
-	String license() const { return headerString(RPMTAG_LICENSE); }
-	String vendor() const { return headerString(RPMTAG_VENDOR); }
-	String group() const { return headerString(RPMTAG_GROUP); }
-	String buildHost() const { return headerString(RPMTAG_BUILDHOST); }
+	String license() const { return pooledHeaderString(RPMTAG_LICENSE); }
+	String vendor() const { return pooledHeaderString(RPMTAG_VENDOR); }
+	String group() const { return pooledHeaderString(RPMTAG_GROUP); }
+	String buildHost() const { return pooledHeaderString(RPMTAG_BUILDHOST); }
 	String sourceRpm() const { return headerString(RPMTAG_SOURCERPM); }
 	uint64_t headersStart() const { return _headersStart; }
 	uint64_t headersEnd() const { return _headersEnd; }
@@ -72,6 +91,11 @@ public:
 	String dependenciesMd(enum DepType type) const;
 	String dependenciesMd() const;
 	String sha256();
+	/**
+	 * Set the checksum if it is known already (e.g. from Prefetcher),
+	 * so sha256() doesn't have to read the file. Ignored if empty.
+	 */
+	void setSha256(String const &sha256) { if(!sha256.isEmpty()) _sha256 = sha256; }
 	String appstreamMd(QHash<String,QByteArray> *icons=nullptr) const;
 	/**
 	 * Get the contents of files inside the rpm.
@@ -89,14 +113,20 @@ public:
 	 * Wrapper around rpmlib headerGetString, mostly for internal use
 	 */
 	String headerString(rpmTagVal tag) const { return headerGetString(_hdr, tag); }
+	/**
+	 * headerString() for values shared by many packages (arch,
+	 * license, ...), returning the copy from the StringPool
+	 */
+	String pooledHeaderString(rpmTagVal tag) const { return StringPool::intern(headerGetString(_hdr, tag)); }
 	/**
 	 * Wrapper around rpmlib headerGetString, mostly for internal use
 	 */
 	uint64_t headerNumber(rpmTagVal tag) const { return headerGetNumber(_hdr, tag); }
 private:
-	static void initRpm();
+	/** Transaction set of the calling thread */
+	static rpmts transactionSet();
+	void readFileList() const;
 private:
-	static rpmts _ts;
 	FileName const	_filename;
 	Header	_hdr;
 	String		_sha256;
@@ -104,4 +134,8 @@ private:
 	uint32_t	_headersEnd;
 	time_t		_fileMtime;
 	size_t		_fileSize;
+	// File list, read on first use. The names live in _fileNames.
+	mutable Files	_files;
+	mutable bool	_filesRead = false;
+	mutable Arena	_fileNames;
 };
@@ -1,20 +1,292 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
 #include "Sha256.h"
-#include <QFile>
-#include <QCryptographicHash>
+#include "Sha256Engine.h"
+#include "BulkReader.h"
+#include "Fd.h"
+#include "Stats.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
 
 extern "C" {
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+}
+
+/**
+ * Size of the reads used to feed the multi-buffer hash. Large reads
+ * keep the syscall overhead negligible compared to the hashing itself.
+ * Must be a multiple of the 64 byte block size.
+ */
+static constexpr size_t ReadSize = 1024 * 1024;
+
+static ssize_t readFully(int fd, char *buffer, size_t size) {
+	size_t done = 0;
+	while(done < size) {
+		ssize_t const r = read(fd, buffer + done, size - done);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			return done ? done : -1;
+		}
+		if(r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static char const XattrName[] = "user.repodata.sha256";
+
+bool Sha256::_xattrCache = false;
+
+Sha256::Sha256():_length(0),_buffered(0) {
+	memcpy(_state, Sha256Engine::initialState, sizeof(_state));
+}
+
+void Sha256::addData(char const *data, size_t length) {
+	Sha256Engine::Compress const compress = Sha256Engine::implementation().compress;
+	_length += length;
+	if(_buffered) {
+		size_t const n = std::min(length, sizeof(_buffer) - _buffered);
+		memcpy(_buffer + _buffered, data, n);
+		_buffered += n;
+		data += n;
+		length -= n;
+		if(_buffered < sizeof(_buffer))
+			return;
+		compress(_state, _buffer, 1);
+		_buffered = 0;
+	}
+	if(size_t const blocks = length / 64) {
+		compress(_state, reinterpret_cast<unsigned char const*>(data), blocks);
+		data += blocks * 64;
+		length -= blocks * 64;
+	}
+	if(length) {
+		memcpy(_buffer, data, length);
+		_buffered = length;
+	}
+}
+
+String Sha256::result() {
+	uint64_t const bits = _length * 8;
+	unsigned char padding[72] = { 0x80 };
+	size_t const padLength = (_buffered < 56 ? 56 : 120) - _buffered;
+	for(int i=0; i<8; i++)
+		padding[padLength + i] = bits >> (56 - 8*i);
+	addData(reinterpret_cast<char const*>(padding), padLength + 8);
+
+	QByteArray digest(32, Qt::Uninitialized);
+	for(int i=0; i<8; i++) {
+		digest[4*i] = _state[i] >> 24;
+		digest[4*i+1] = _state[i] >> 16;
+		digest[4*i+2] = _state[i] >> 8;
+		digest[4*i+3] = _state[i];
+	}
+	return digest.toHex();
+}
+
+String Sha256::checksum(int fd) {
+	BulkReader reader(fd);
+	Sha256 hash;
+	char const *data;
+	ssize_t r;
+	while((r = reader.read(&data)) > 0)
+		hash.addData(data, r);
+	return hash.result();
 }
 
 String Sha256::checksum(String const &filename) {
-	QFile f(filename);
-	f.open(QFile::ReadOnly);
-	posix_fadvise(f.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
-	posix_fadvise(f.handle(), 0, 0, POSIX_FADV_WILLNEED);
-	QCryptographicHash hash(QCryptographicHash::Sha256);
-	hash.addData(&f);
-	f.close();
-	return hash.result().toHex();
+	Stats::Scope stats(Stats::FileChecksum);
+	Fd fd = open(filename, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return Sha256().result();
+	struct stat st;
+	if(!fstat(fd, &st))
+		stats.addBytes(st.st_size, 0);
+	return checksum(fd);
+}
+
+/**
+ * The part of the user.repodata.sha256 attribute identifying the
+ * version of the file the checksum belongs to.
+ *
+ * ctime would be a better indicator of changes, but can't be used:
+ * setting the attribute changes it.
+ */
+static QByteArray xattrKey(struct stat const &st) {
+	return QByteArray::number(static_cast<qint64>(st.st_size)) + ' ' +
+		QByteArray::number(static_cast<qint64>(st.st_mtim.tv_sec)) + '.' +
+		QByteArray::number(static_cast<qint64>(st.st_mtim.tv_nsec)).rightJustified(9, '0');
+}
+
+String Sha256::xattrChecksum(int fd, struct stat const &st) {
+	if(!_xattrCache)
+		return String();
+	QByteArray const key = xattrKey(st);
+	char value[128];
+	ssize_t const length = fgetxattr(fd, XattrName, value, sizeof(value));
+	if(length == key.size() + 65 && !memcmp(value, key.constData(), key.size()) && value[key.size()] == ' ') {
+		Stats::count(Stats::ChecksumXattrHits);
+		return QByteArray(value + key.size() + 1, 64);
+	}
+	Stats::count(Stats::ChecksumXattrMisses);
+	return String();
+}
+
+void Sha256::storeXattrChecksum(int fd, struct stat const &st, String const &checksum) {
+	if(!_xattrCache)
+		return;
+	// Don't store anything if the file was modified while reading it
+	struct stat now;
+	QByteArray const key = xattrKey(st);
+	if(fstat(fd, &now) || xattrKey(now) != key)
+		return;
+	QByteArray const value = key + ' ' + checksum;
+	if(fsetxattr(fd, XattrName, value.constData(), value.size(), 0)) {
+		static std::atomic<bool> warned = false;
+		if(!warned.exchange(true))
+			std::cerr << "Can't store checksums in extended attributes: " << strerror(errno) << ", ignoring" << std::endl;
+	}
+}
+
+String Sha256::cachedChecksum(int fd, bool *cached) {
+	if(cached)
+		*cached = false;
+	struct stat st;
+	if(!_xattrCache || fstat(fd, &st))
+		return checksum(fd);
+	if(String const ret = xattrChecksum(fd, st); !ret.isEmpty()) {
+		if(cached)
+			*cached = true;
+		return ret;
+	}
+	String const ret = checksum(fd);
+	storeXattrChecksum(fd, st, ret);
+	return ret;
+}
+
+String Sha256::cachedChecksum(String const &filename) {
+	if(!_xattrCache)
+		return checksum(filename);
+	Stats::Scope stats(Stats::FileChecksum);
+	Fd fd = open(filename, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return Sha256().result();
+	bool cached;
+	String const ret = cachedChecksum(fd, &cached);
+	struct stat st;
+	if(!cached && !fstat(fd, &st))
+		stats.addBytes(st.st_size, 0);
+	return ret;
+}
+
+QList<String> Sha256::checksums(QList<String> const &filenames) {
+	QList<String> ret;
+	Sha256Engine::Implementation const &impl = Sha256Engine::implementation();
+	if(!impl.compressX8 || filenames.count() < 2) {
+		for(String const &f : filenames)
+			ret.append(checksum(f));
+		return ret;
+	}
+
+	// Multi-buffer hashing: up to 8 files are read in lockstep and
+	// their full chunks are hashed together. When a file ends, its
+	// lane is refilled with the next file.
+	Stats::Scope stats(Stats::FileChecksum);
+	struct Lane {
+		qsizetype index = -1;
+		int fd = -1;
+		Sha256 hash;
+		QByteArray buffer;
+		size_t length = 0;
+	};
+	Lane lanes[8];
+	qsizetype next = 0;
+	ret.resize(filenames.count());
+
+	auto refill = [&](Lane &l) {
+		while(next < filenames.count()) {
+			l.index = next++;
+			l.hash = Sha256();
+			l.fd = open(filenames.at(l.index), O_RDONLY|O_CLOEXEC);
+			if(l.fd >= 0) {
+				posix_fadvise(l.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+				return;
+			}
+			ret[l.index] = l.hash.result();
+		}
+		l.index = -1;
+	};
+	for(Lane &l : lanes) {
+		l.buffer = QByteArray(ReadSize, Qt::Uninitialized);
+		refill(l);
+	}
+
+	for(;;) {
+		Lane *full[8];
+		int fullCount = 0;
+		bool active = false;
+		for(Lane &l : lanes) {
+			if(l.index < 0)
+				continue;
+			active = true;
+			ssize_t const r = readFully(l.fd, l.buffer.data(), ReadSize);
+			l.length = r > 0 ? r : 0;
+			stats.addBytes(l.length, 0);
+			if(l.length == ReadSize)
+				full[fullCount++] = &l;
+		}
+		if(!active)
+			break;
+
+		if(fullCount > 1) {
+			uint32_t state[8][8];
+			unsigned char const *data[8];
+			for(int i=0; i<8; i++) {
+				// Unused lanes just hash a copy of the first one
+				Lane const *l = full[i < fullCount ? i : 0];
+				memcpy(state[i], l->hash._state, sizeof(state[i]));
+				data[i] = reinterpret_cast<unsigned char const*>(l->buffer.constData());
+			}
+			impl.compressX8(state, data, ReadSize / 64);
+			for(int i=0; i<fullCount; i++) {
+				memcpy(full[i]->hash._state, state[i], sizeof(state[i]));
+				full[i]->hash._length += ReadSize;
+			}
+		} else if(fullCount == 1)
+			full[0]->hash.addData(full[0]->buffer.constData(), ReadSize);
+
+		for(Lane &l : lanes) {
+			if(l.index < 0 || l.length == ReadSize)
+				continue;
+			l.hash.addData(l.buffer.constData(), l.length);
+			ret[l.index] = l.hash.result();
+			close(l.fd);
+			refill(l);
+		}
+	}
+	return ret;
+}
+
+QHash<String,String> Sha256::checksums(QHash<String,String> const &filenames) {
+	QList<String> const keys = filenames.keys();
+	QList<String> files;
+	for(String const &k : keys)
+		files.append(filenames.value(k));
+	QList<String> const sums = checksums(files);
+	QHash<String,String> ret;
+	for(qsizetype i=0; i<keys.count(); i++)
+		ret.insert(keys.at(i), sums.at(i));
+	return ret;
+}
+
+char const *Sha256::implementation() {
+	return Sha256Engine::implementation().name;
 }
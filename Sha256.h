@@ -3,8 +3,78 @@
 #pragma once
 
 #include "String.h"
+#include <QHash>
+#include <QList>
+#include <cstdint>
 
+struct stat;
+
+/**
+ * SHA-256 hashing on top of Sha256Engine (SHA-NI, ARMv8 crypto
+ * extensions or AVX2 multi-buffer where available).
+ */
 class Sha256 {
 public:
+	Sha256();
+	void addData(char const *data, size_t length);
+	void addData(QByteArray const &data) { addData(data.constData(), data.size()); }
+	/**
+	 * Finish hashing and return the hex encoded checksum.
+	 * The object can't be used for further hashing afterwards.
+	 */
+	String result();
+
 	static String checksum(String const &filename);
+	/**
+	 * Checksum an open file, reading it from the current position
+	 * to the end.
+	 */
+	static String checksum(int fd);
+	/**
+	 * Like checksum(), but if extended attribute caching is enabled,
+	 * reuse the checksum stored in the file's user.repodata.sha256
+	 * attribute as long as the file's size and mtime still match,
+	 * and store the checksum there otherwise.
+	 * @param cached Set to whether the checksum came from the attribute
+	 */
+	static String cachedChecksum(int fd, bool *cached=nullptr);
+	static String cachedChecksum(String const &filename);
+	/**
+	 * Checksum stored in the file's extended attribute, if caching
+	 * is enabled and it is still valid for the file's state \p st
+	 * @return the checksum, or an empty string if it needs to be computed
+	 */
+	static String xattrChecksum(int fd, struct stat const &st);
+	/**
+	 * Store a checksum computed for the file's state \p st in its
+	 * extended attribute, if caching is enabled
+	 */
+	static void storeXattrChecksum(int fd, struct stat const &st, String const &checksum);
+	/**
+	 * Enable caching checksums in extended attributes
+	 * (see cachedChecksum()). Off by default, since it modifies
+	 * the files being checksummed.
+	 */
+	static void setXattrCache(bool enable) { _xattrCache = enable; }
+	/**
+	 * Checksum several files at once. Uses the multi-buffer
+	 * implementation if the CPU doesn't have SHA instructions,
+	 * otherwise it's equivalent to checksumming them one by one.
+	 */
+	static QList<String> checksums(QList<String> const &filenames);
+	/**
+	 * Checksum several files at once
+	 * @param filenames Map of key -> filename
+	 * @return Map of key -> checksum
+	 */
+	static QHash<String,String> checksums(QHash<String,String> const &filenames);
+	/** Name of the implementation being used */
+	static char const *implementation();
+private:
+	static bool	_xattrCache;
+private:
+	uint32_t	_state[8];
+	uint64_t	_length;
+	unsigned char	_buffer[64];
+	size_t		_buffered;
 };
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+//
+// The accelerated variants are compiled with target attributes rather
+// than global compiler flags so a single binary runs everywhere and
+// picks the right one at runtime.
+#include "Sha256Engine.h"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+extern "C" {
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+}
+#define SHA256_ARM 1
+#endif
+
+uint32_t const Sha256Engine::initialState[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+alignas(64) static uint32_t const K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t be32(unsigned char const *p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static void compressScalar(uint32_t state[8], unsigned char const *data, size_t blocks) {
+	while(blocks--) {
+		uint32_t w[64];
+		for(int i=0; i<16; i++)
+			w[i] = be32(data + 4*i);
+		for(int i=16; i<64; i++) {
+			uint32_t const s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t const s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		#pragma GCC unroll 64
+		for(int i=0; i<64; i++) {
+			uint32_t const t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t const t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += 64;
+	}
+}
+
+#ifdef SHA256_X86
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(uint32_t state[8], unsigned char const *data, size_t blocks) {
+	__m128i const byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// The SHA instructions want the state as ABEF/CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(&state[0])), 0xb1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(&state[4])), 0x1b);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	while(blocks--) {
+		__m128i const abefSave = state0;
+		__m128i const cdghSave = state1;
+		__m128i w[4];
+
+		// Each iteration does 4 rounds while the message schedule
+		// for the next few rounds is computed in w[]
+		#pragma GCC unroll 16
+		for(int g=0; g<16; g++) {
+			if(g < 4)
+				w[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(data + 16*g)), byteswap);
+			__m128i msg = _mm_add_epi32(w[g&3], _mm_load_si128(reinterpret_cast<__m128i const*>(&K[4*g])));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if(g >= 3 && g <= 14) {
+				w[(g+1)&3] = _mm_add_epi32(w[(g+1)&3], _mm_alignr_epi8(w[g&3], w[(g+3)&3], 4));
+				w[(g+1)&3] = _mm_sha256msg2_epu32(w[(g+1)&3], w[g&3]);
+			}
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+			if(g >= 1 && g <= 12)
+				w[(g+3)&3] = _mm_sha256msg1_epu32(w[(g+3)&3], w[g&3]);
+		}
+
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotr8(__m256i x, int n) {
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+/**
+ * Multi-buffer SHA-256: the scalar algorithm with every 32 bit word
+ * replaced by a vector holding that word for 8 different messages.
+ */
+__attribute__((target("avx2")))
+static void compressX8Avx2(uint32_t state[8][8], unsigned char const * const data[8], size_t blocks) {
+	__m256i const byteswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i s[8];
+	for(int i=0; i<8; i++)
+		s[i] = _mm256_set_epi32(state[7][i], state[6][i], state[5][i], state[4][i], state[3][i], state[2][i], state[1][i], state[0][i]);
+
+	for(size_t block=0; block<blocks; block++) {
+		size_t const offset = block * 64;
+		__m256i w[16];
+		for(int i=0; i<16; i++) {
+			uint32_t l[8];
+			for(int lane=0; lane<8; lane++)
+				memcpy(&l[lane], data[lane] + offset + 4*i, 4);
+			w[i] = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(l)), byteswap);
+		}
+
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+		#pragma GCC unroll 64
+		for(int i=0; i<64; i++) {
+			if(i >= 16) {
+				__m256i const w15 = w[(i+1)&15];
+				__m256i const w2 = w[(i+14)&15];
+				__m256i const s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w15, 7), rotr8(w15, 18)), _mm256_srli_epi32(w15, 3));
+				__m256i const s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w2, 17), rotr8(w2, 19)), _mm256_srli_epi32(w2, 10));
+				w[i&15] = _mm256_add_epi32(_mm256_add_epi32(w[i&15], s0), _mm256_add_epi32(w[(i+9)&15], s1));
+			}
+			__m256i const S1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(e, 6), rotr8(e, 11)), rotr8(e, 25));
+			__m256i const ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+			__m256i const t1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, w[i&15])), _mm256_set1_epi32(K[i]));
+			__m256i const S0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(a, 2), rotr8(a, 13)), rotr8(a, 22));
+			__m256i const maj = _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+			__m256i const t2 = _mm256_add_epi32(S0, maj);
+			h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+			d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+		}
+		s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+		s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+		s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+		s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+	}
+
+	for(int i=0; i<8; i++) {
+		uint32_t l[8];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(l), s[i]);
+		for(int lane=0; lane<8; lane++)
+			state[lane][i] = l[lane];
+	}
+}
+
+static bool cpuHasShaNi() {
+	unsigned int eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return false;
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return ebx & bit_SHA;
+}
+
+static bool cpuHasAvx2() {
+	unsigned int eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return false;
+	// Make sure the OS saves the YMM registers
+	unsigned int xcr0lo, xcr0hi;
+	__asm__("xgetbv" : "=a"(xcr0lo), "=d"(xcr0hi) : "c"(0));
+	if((xcr0lo & 6) != 6)
+		return false;
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return ebx & bit_AVX2;
+}
+#endif
+
+#ifdef SHA256_ARM
+#ifdef __clang__
+__attribute__((target("sha2")))
+#else
+__attribute__((target("+crypto")))
+#endif
+static void compressArmv8(uint32_t state[8], unsigned char const *data, size_t blocks) {
+	uint32x4_t state0 = vld1q_u32(&state[0]);
+	uint32x4_t state1 = vld1q_u32(&state[4]);
+
+	while(blocks--) {
+		uint32x4_t const abcdSave = state0;
+		uint32x4_t const efghSave = state1;
+		uint32x4_t w[4];
+		for(int i=0; i<4; i++)
+			w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16*i)));
+
+		#pragma GCC unroll 16
+		for(int g=0; g<16; g++) {
+			uint32x4_t const wk = vaddq_u32(w[g&3], vld1q_u32(&K[4*g]));
+			if(g < 12)
+				w[g&3] = vsha256su0q_u32(w[g&3], w[(g+1)&3]);
+			uint32x4_t const abcd = state0;
+			state0 = vsha256hq_u32(state0, state1, wk);
+			state1 = vsha256h2q_u32(state1, abcd, wk);
+			if(g < 12)
+				w[g&3] = vsha256su1q_u32(w[g&3], w[(g+2)&3], w[(g+3)&3]);
+		}
+
+		state0 = vaddq_u32(state0, abcdSave);
+		state1 = vaddq_u32(state1, efghSave);
+		data += 64;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+#endif
+
+std::vector<Sha256Engine::Implementation> Sha256Engine::available() {
+	std::vector<Implementation> ret;
+#ifdef SHA256_X86
+	bool const avx2 = cpuHasAvx2();
+	if(cpuHasShaNi())
+		ret.push_back({"sha-ni", compressShaNi, nullptr});
+	if(avx2)
+		ret.push_back({"avx2", compressScalar, compressX8Avx2});
+#endif
+#ifdef SHA256_ARM
+	if(getauxval(AT_HWCAP) & HWCAP_SHA2)
+		ret.push_back({"armv8", compressArmv8, nullptr});
+#endif
+	ret.push_back({"scalar", compressScalar, nullptr});
+	return ret;
+}
+
+Sha256Engine::Implementation const &Sha256Engine::implementation() {
+	static Implementation const impl = []() {
+		std::vector<Implementation> const impls = available();
+		if(char const *wanted = getenv("REPODATA_SHA256")) {
+			for(Implementation const &i : impls)
+				if(!strcmp(i.name, wanted))
+					return i;
+		}
+		return impls.front();
+	}();
+	return impl;
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * SHA-256 block functions with runtime CPU dispatch.
+ *
+ * This is the low level part used by Sha256: it only knows how to
+ * run the compression function over complete 64 byte blocks. Padding,
+ * buffering and file I/O are handled by Sha256.
+ */
+class Sha256Engine {
+public:
+	/** Process \p blocks 64 byte blocks of a single message */
+	typedef void (*Compress)(uint32_t state[8], unsigned char const *data, size_t blocks);
+	/** Process \p blocks 64 byte blocks of each of 8 independent messages */
+	typedef void (*CompressX8)(uint32_t state[8][8], unsigned char const * const data[8], size_t blocks);
+
+	struct Implementation {
+		char const *name;
+		Compress compress;
+		/// Multi-buffer variant, or nullptr if hashing several
+		/// messages at once isn't faster than one after another
+		CompressX8 compressX8;
+	};
+
+	/**
+	 * The fastest implementation supported by the CPU we're running on.
+	 * Can be overridden by setting REPODATA_SHA256 to the name of an
+	 * implementation (scalar, sha-ni, avx2, armv8) for testing.
+	 */
+	static Implementation const &implementation();
+	/** All implementations supported by the CPU we're running on */
+	static std::vector<Implementation> available();
+
+	static uint32_t const initialState[8];
+};
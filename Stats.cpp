@@ -0,0 +1,492 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "Stats.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QList>
+#include <QSaveFile>
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+extern "C" {
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+}
+
+// This must be in sync (same order, same number of entries)
+// with enum Phase
+static constexpr char const *phaseNames[] = {
+	"scan",
+	"open",
+	"checksum",
+	"dependencies",
+	"filelist",
+	"appstream",
+	"icons",
+	"write-xml",
+	"compress",
+	"file-checksum",
+	"header",
+	"payload",
+	"finalize"
+};
+
+char const *Stats::phaseName(Phase p) {
+	return phaseNames[p];
+}
+
+#ifdef REPODATA_STATS
+bool Stats::_enabled = false;
+std::atomic<quint64> Stats::_packagesTotal{0};
+std::atomic<quint64> Stats::_counters[CounterCount];
+
+namespace {
+struct PhaseTotals {
+	std::atomic<quint64> calls{0};
+	std::atomic<qint64> wall{0};
+	std::atomic<qint64> self{0};
+	std::atomic<qint64> cpu{0};
+	std::atomic<quint64> bytesIn{0};
+	std::atomic<quint64> bytesOut{0};
+#ifdef REPODATA_ALLOC_PROFILE
+	std::atomic<quint64> allocations{0};
+	std::atomic<quint64> allocatedBytes{0};
+	std::atomic<qint64> peakLiveBytes{0};
+#endif
+};
+
+struct PackageTimes {
+	String name;
+	qint64 wall;
+	qint64 phaseWall[Stats::PhaseCount];
+#ifdef REPODATA_ALLOC_PROFILE
+	Stats::Allocations allocations;
+#endif
+};
+
+PhaseTotals totals[Stats::PhaseCount];
+std::atomic<quint64> packageCount{0};
+qint64 runStart;
+int slowestCount;
+// Slowest packages seen so far, slowest first
+QList<PackageTimes> slowest;
+std::mutex slowestLock;
+
+QFile *traceFile = nullptr;
+bool traceEmpty = true;
+std::mutex traceLock;
+
+// Interval for progress and metrics updates
+constexpr std::chrono::seconds reportInterval(10);
+bool progress = false;
+QString metricsFile;
+std::thread reporter;
+std::mutex reporterLock;
+std::condition_variable reporterWake;
+bool reporterStop = false;
+// Phase most recently entered by any thread, for progress output
+std::atomic<int> lastPhase{-1};
+
+#ifdef REPODATA_ALLOC_PROFILE
+std::atomic<quint64> allocationCount{0};
+std::atomic<qint64> liveBytes{0};
+std::atomic<qint64> peakLiveBytes{0};
+
+void updateMax(std::atomic<qint64> &max, qint64 value) {
+	qint64 old = max.load(std::memory_order_relaxed);
+	while(value > old && !max.compare_exchange_weak(old, value, std::memory_order_relaxed))
+		;
+}
+#endif
+
+thread_local Stats::Scope *currentScope = nullptr;
+thread_local Stats::Package *currentPackage = nullptr;
+
+qint64 now(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return static_cast<qint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+double seconds(qint64 ns) {
+	return ns / 1e9;
+}
+
+QByteArray jsonString(QByteArray const &s) {
+	static char const hex[] = "0123456789abcdef";
+	QByteArray ret;
+	ret.reserve(s.size() + 2);
+	ret += '"';
+	for(char c : s) {
+		if(c == '\\' || c == '"') {
+			ret += '\\';
+			ret += c;
+		} else if(static_cast<unsigned char>(c) < 0x20) {
+			// Control characters (e.g. from filenames) aren't allowed
+			// in JSON strings
+			ret += "\\u00";
+			ret += hex[c >> 4];
+			ret += hex[c & 0xf];
+		} else
+			ret += c;
+	}
+	ret += '"';
+	return ret;
+}
+
+/**
+ * Write a complete ("X") trace event
+ * @param name Event name
+ * @param category Event category
+ * @param start Start time in ns (CLOCK_MONOTONIC)
+ * @param duration Duration in ns
+ * @param package Package the event belongs to, if any
+ */
+void traceEvent(QByteArray const &name, char const *category, qint64 start, qint64 duration, String const &package) {
+	static thread_local pid_t const tid = gettid();
+	static pid_t const pid = getpid();
+	QByteArray event = "{\"name\":" + jsonString(name) +
+		",\"cat\":\"" + category +
+		"\",\"ph\":\"X\",\"ts\":" + QByteArray::number((start - runStart) / 1000.0, 'f', 3) +
+		",\"dur\":" + QByteArray::number(duration / 1000.0, 'f', 3) +
+		",\"pid\":" + QByteArray::number(pid) +
+		",\"tid\":" + QByteArray::number(tid);
+	if(!package.isEmpty())
+		event += ",\"args\":{\"package\":" + jsonString(package) + "}";
+	event += "}";
+
+	std::lock_guard<std::mutex> lock(traceLock);
+	if(!traceFile)
+		return;
+	traceFile->write(traceEmpty ? "[\n" : ",\n");
+	traceFile->write(event);
+	traceEmpty = false;
+}
+quint64 bytesRead() {
+	return totals[Stats::Open].bytesIn + totals[Stats::Checksum].bytesIn + totals[Stats::Payload].bytesIn + totals[Stats::FileChecksum].bytesIn;
+}
+
+quint64 peakRss() {
+	rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru))
+		return 0;
+	return static_cast<quint64>(ru.ru_maxrss) * 1024;
+}
+
+void printProgress(quint64 total) {
+	double const elapsed = seconds(now(CLOCK_MONOTONIC) - runStart);
+	quint64 const done = packageCount;
+	double const rate = elapsed > 0 ? done / elapsed : 0;
+	double const mbs = elapsed > 0 ? bytesRead() / elapsed / 1048576.0 : 0;
+	int const phase = lastPhase;
+	QByteArray eta = "--:--:--";
+	if(rate > 0 && total > done) {
+		qint64 const left = (total - done) / rate;
+		eta = QByteArray::number(left / 3600) + ":" + QByteArray::number(left / 60 % 60).rightJustified(2, '0') + ":" + QByteArray::number(left % 60).rightJustified(2, '0');
+	}
+	fprintf(stderr, "[%llu/%llu %5.1f%%] %.1f MB/s, %.1f packages/s, ETA %s, %s\n",
+		static_cast<unsigned long long>(done), static_cast<unsigned long long>(total),
+		total ? 100.0 * done / total : 0.0, mbs, rate, eta.constData(),
+		phase < 0 ? "starting" : phaseNames[phase]);
+}
+
+bool writeMetrics(QString const &filename, bool running, quint64 total, quint64 const *counters) {
+	QByteArray const tool = "tool=\"" + QCoreApplication::applicationName().toUtf8() + "\"";
+	QByteArray m;
+	auto metric = [&m](char const *name, char const *type, char const *help) {
+		m += QByteArray("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+	};
+	auto value = [&m, &tool](char const *name, double v, QByteArray const &labels=QByteArray()) {
+		m += QByteArray(name) + "{" + tool + (labels.isEmpty() ? "" : "," + labels) + "} " + QByteArray::number(v, 'g', 15) + "\n";
+	};
+
+	metric("repodata_running", "gauge", "Whether metadata generation is still running");
+	value("repodata_running", running);
+	metric("repodata_run_duration_seconds", "gauge", "Wall time of the metadata generation run");
+	value("repodata_run_duration_seconds", seconds(now(CLOCK_MONOTONIC) - runStart));
+	metric("repodata_packages_total", "gauge", "Packages to be processed");
+	value("repodata_packages_total", total);
+	metric("repodata_packages_processed", "gauge", "Packages processed so far");
+	value("repodata_packages_processed", packageCount);
+	metric("repodata_phase_seconds", "gauge", "Wall time spent in each phase, excluding nested phases");
+	for(int i=0; i<Stats::PhaseCount; i++)
+		value("repodata_phase_seconds", seconds(totals[i].self), "phase=\"" + QByteArray(phaseNames[i]) + "\"");
+	metric("repodata_phase_calls", "gauge", "Number of times each phase was entered");
+	for(int i=0; i<Stats::PhaseCount; i++)
+		value("repodata_phase_calls", totals[i].calls, "phase=\"" + QByteArray(phaseNames[i]) + "\"");
+	metric("repodata_read_bytes", "gauge", "Bytes read from packages and metadata files");
+	value("repodata_read_bytes", bytesRead());
+	metric("repodata_compressed_input_bytes", "gauge", "Bytes passed to the compressor");
+	value("repodata_compressed_input_bytes", totals[Stats::Compress].bytesIn);
+	metric("repodata_compressed_output_bytes", "gauge", "Bytes produced by the compressor");
+	value("repodata_compressed_output_bytes", totals[Stats::Compress].bytesOut);
+	metric("repodata_cache_hits", "gauge", "Packages whose metadata could be reused");
+	value("repodata_cache_hits", counters[Stats::CacheHits]);
+	metric("repodata_cache_misses", "gauge", "Packages whose metadata had to be generated");
+	value("repodata_cache_misses", counters[Stats::CacheMisses]);
+	quint64 const lookups = counters[Stats::CacheHits] + counters[Stats::CacheMisses];
+	metric("repodata_cache_hit_ratio", "gauge", "Fraction of packages whose metadata could be reused");
+	value("repodata_cache_hit_ratio", lookups ? static_cast<double>(counters[Stats::CacheHits]) / lookups : 0);
+	metric("repodata_checksum_xattr_hits", "gauge", "Package checksums taken from extended attributes");
+	value("repodata_checksum_xattr_hits", counters[Stats::ChecksumXattrHits]);
+	metric("repodata_checksum_xattr_misses", "gauge", "Package checksums computed with extended attribute caching enabled");
+	value("repodata_checksum_xattr_misses", counters[Stats::ChecksumXattrMisses]);
+	metric("repodata_shared_packages", "gauge", "Packages whose metadata was taken from a hardlink analyzed earlier");
+	value("repodata_shared_packages", counters[Stats::SharedPackages]);
+	metric("repodata_spilled_packages", "gauge", "Package records moved out of memory to stay within the memory limit");
+	value("repodata_spilled_packages", counters[Stats::SpilledPackages]);
+	metric("repodata_peak_rss_bytes", "gauge", "Peak resident set size");
+	value("repodata_peak_rss_bytes", peakRss());
+
+	// Written atomically, so the collector never sees a partial file
+	QSaveFile f(filename);
+	if(!f.open(QFile::WriteOnly))
+		return false;
+	f.write(m);
+	return f.commit();
+}
+} // namespace
+
+void Stats::enable(int slowestPackages) {
+	slowestCount = slowestPackages;
+	if(!_enabled)
+		runStart = now(CLOCK_MONOTONIC);
+	_enabled = true;
+}
+
+bool Stats::enableTrace(QString const &filename) {
+	std::lock_guard<std::mutex> lock(traceLock);
+	traceFile = new QFile(filename);
+	if(!traceFile->open(QFile::WriteOnly|QFile::Truncate)) {
+		delete traceFile;
+		traceFile = nullptr;
+		return false;
+	}
+	traceEmpty = true;
+	if(!_enabled)
+		runStart = now(CLOCK_MONOTONIC);
+	_enabled = true;
+	return true;
+}
+
+void Stats::report(bool running) {
+	quint64 counters[CounterCount];
+	for(int i=0; i<CounterCount; i++)
+		counters[i] = _counters[i];
+	if(progress)
+		printProgress(_packagesTotal);
+	if(!metricsFile.isEmpty() && !writeMetrics(metricsFile, running, _packagesTotal, counters))
+		std::cerr << "Can't write metrics to " << qPrintable(metricsFile) << std::endl;
+}
+
+void Stats::startReporter() {
+	if(reporter.joinable())
+		return;
+	reporterStop = false;
+	reporter = std::thread([]() {
+		std::unique_lock<std::mutex> lock(reporterLock);
+		while(!reporterWake.wait_for(lock, reportInterval, []() { return reporterStop; }))
+			report(true);
+	});
+}
+
+void Stats::enableProgress() {
+	enable(slowestCount);
+	progress = true;
+	startReporter();
+}
+
+void Stats::enableMetrics(QString const &filename) {
+	enable(slowestCount);
+	metricsFile = filename;
+	startReporter();
+}
+
+void Stats::finish() {
+	if(reporter.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(reporterLock);
+			reporterStop = true;
+		}
+		reporterWake.notify_all();
+		reporter.join();
+		report(false);
+	}
+
+	std::lock_guard<std::mutex> lock(traceLock);
+	if(!traceFile)
+		return;
+	traceFile->write(traceEmpty ? "[]\n" : "\n]\n");
+	traceFile->close();
+	delete traceFile;
+	traceFile = nullptr;
+}
+
+void Stats::Scope::start(Phase p) {
+	_phase = p;
+	_parent = currentScope;
+	currentScope = this;
+	lastPhase.store(p, std::memory_order_relaxed);
+	_wallStart = now(CLOCK_MONOTONIC);
+	_cpuStart = now(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void Stats::Scope::stop() {
+	qint64 const wall = now(CLOCK_MONOTONIC) - _wallStart;
+	qint64 const cpu = now(CLOCK_THREAD_CPUTIME_ID) - _cpuStart;
+	currentScope = _parent;
+	if(_parent) {
+		lastPhase.store(_parent->_phase, std::memory_order_relaxed);
+		_parent->_childWall += wall;
+		_parent->_childCpu += cpu;
+	}
+	PhaseTotals &t = totals[_phase];
+	t.calls.fetch_add(1, std::memory_order_relaxed);
+	t.wall.fetch_add(wall, std::memory_order_relaxed);
+	t.self.fetch_add(wall - _childWall, std::memory_order_relaxed);
+	t.cpu.fetch_add(cpu - _childCpu, std::memory_order_relaxed);
+	t.bytesIn.fetch_add(_bytesIn, std::memory_order_relaxed);
+	t.bytesOut.fetch_add(_bytesOut, std::memory_order_relaxed);
+#ifdef REPODATA_ALLOC_PROFILE
+	t.allocations.fetch_add(_allocations.count, std::memory_order_relaxed);
+	t.allocatedBytes.fetch_add(_allocations.bytes, std::memory_order_relaxed);
+	updateMax(t.peakLiveBytes, _allocations.peak);
+#endif
+	if(currentPackage)
+		currentPackage->_phaseWall[_phase] += wall - _childWall;
+	if(traceFile)
+		traceEvent(phaseNames[_phase], "phase", _wallStart, wall, currentPackage ? currentPackage->_name : String());
+}
+
+void Stats::Package::start(String const &name) {
+	_name = name;
+	_parent = currentPackage;
+	currentPackage = this;
+	std::fill(std::begin(_phaseWall), std::end(_phaseWall), 0);
+	_wallStart = now(CLOCK_MONOTONIC);
+}
+
+void Stats::Package::stop() {
+	qint64 const wall = now(CLOCK_MONOTONIC) - _wallStart;
+	currentPackage = _parent;
+	packageCount.fetch_add(1, std::memory_order_relaxed);
+	if(traceFile)
+		traceEvent(_name, "package", _wallStart, wall, _name);
+
+	std::lock_guard<std::mutex> lock(slowestLock);
+	if(slowest.count() >= slowestCount && (slowestCount == 0 || slowest.last().wall >= wall))
+		return;
+	PackageTimes p{_name, wall, {}};
+	std::copy(std::begin(_phaseWall), std::end(_phaseWall), p.phaseWall);
+#ifdef REPODATA_ALLOC_PROFILE
+	p.allocations = _allocations;
+#endif
+	auto const pos = std::upper_bound(slowest.begin(), slowest.end(), wall, [](qint64 w, PackageTimes const &t) { return w > t.wall; });
+	slowest.insert(pos, p);
+	if(slowest.count() > slowestCount)
+		slowest.removeLast();
+}
+
+QByteArray Stats::json(String const &tool) {
+	QJsonObject phases;
+	for(int i=0; i<PhaseCount; i++) {
+		PhaseTotals const &t = totals[i];
+		if(!t.calls)
+			continue;
+		QJsonObject phase{
+			{"calls", static_cast<qint64>(t.calls.load())},
+			{"wall_seconds", seconds(t.wall)},
+			{"self_seconds", seconds(t.self)},
+			{"cpu_seconds", seconds(t.cpu)},
+			{"bytes_in", static_cast<qint64>(t.bytesIn.load())},
+			{"bytes_out", static_cast<qint64>(t.bytesOut.load())}
+		};
+#ifdef REPODATA_ALLOC_PROFILE
+		phase.insert("allocations", static_cast<qint64>(t.allocations.load()));
+		phase.insert("allocated_bytes", static_cast<qint64>(t.allocatedBytes.load()));
+		phase.insert("peak_live_bytes", t.peakLiveBytes.load());
+#endif
+		phases.insert(phaseNames[i], phase);
+	}
+
+	QJsonArray packages;
+	{
+		std::lock_guard<std::mutex> lock(slowestLock);
+		for(PackageTimes const &p : slowest) {
+			QJsonObject breakdown;
+			for(int i=0; i<PhaseCount; i++) {
+				if(p.phaseWall[i])
+					breakdown.insert(phaseNames[i], seconds(p.phaseWall[i]));
+			}
+			QJsonObject package{
+				{"package", QString(p.name)},
+				{"wall_seconds", seconds(p.wall)},
+				{"phases", breakdown}
+			};
+#ifdef REPODATA_ALLOC_PROFILE
+			package.insert("allocations", static_cast<qint64>(p.allocations.count));
+			package.insert("allocated_bytes", static_cast<qint64>(p.allocations.bytes));
+			package.insert("peak_live_bytes", p.allocations.peak);
+#endif
+			packages.append(package);
+		}
+	}
+
+	QJsonObject report{
+		{"tool", QString(tool)},
+		{"wall_seconds", seconds(now(CLOCK_MONOTONIC) - runStart)},
+		{"cpu_seconds", seconds(now(CLOCK_PROCESS_CPUTIME_ID))},
+		{"packages", static_cast<qint64>(packageCount.load())},
+		{"phases", phases},
+		{"slowest_packages", packages}
+	};
+#ifdef REPODATA_ALLOC_PROFILE
+	report.insert("peak_live_bytes", peakLiveBytes.load());
+#endif
+	return QJsonDocument(report).toJson();
+}
+
+#ifdef REPODATA_ALLOC_PROFILE
+void Stats::allocated(size_t bytes) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	if(!_enabled)
+		return;
+	updateMax(peakLiveBytes, liveBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	if(currentScope)
+		currentScope->_allocations.add(bytes);
+	if(currentPackage)
+		currentPackage->_allocations.add(bytes);
+}
+
+quint64 Stats::allocations() {
+	return allocationCount;
+}
+
+void Stats::freed(size_t bytes) {
+	if(!_enabled)
+		return;
+	liveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+	if(currentScope)
+		currentScope->_allocations.remove(bytes);
+	if(currentPackage)
+		currentPackage->_allocations.remove(bytes);
+}
+#endif
+
+bool Stats::writeJson(String const &tool, QString const &filename) {
+	QFile f(filename);
+	if(filename.isEmpty() ? !f.open(stdout, QFile::WriteOnly) : !f.open(QFile::WriteOnly|QFile::Truncate))
+		return false;
+	return f.write(json(tool)) >= 0;
+}
+#endif
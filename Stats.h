@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <atomic>
+
+/**
+ * Timing and counters for the stages of metadata generation.
+ *
+ * Stages are measured by putting a Stats::Scope on the stack;
+ * packages are tracked with a Stats::Package on the stack so the
+ * slowest ones can be reported with their per-stage breakdown.
+ *
+ * Collection is off unless enable() or enableTrace() is called --
+ * and compiled out entirely if REPODATA_STATS isn't defined.
+ */
+class Stats {
+public:
+	enum Phase {
+		Scan = 0,
+		Open,
+		Checksum,
+		Dependencies,
+		FileList,
+		Appstream,
+		Icons,
+		WriteXml,
+		Compress,
+		FileChecksum,
+		Header,
+		Payload,
+		Finalize,
+		PhaseCount
+	};
+	enum Counter {
+		// Packages whose metadata could be reused
+		CacheHits = 0,
+		// Packages whose metadata had to be generated
+		CacheMisses,
+		// Package checksums taken from extended attributes
+		ChecksumXattrHits,
+		// Package checksums that had to be computed despite
+		// extended attribute caching being enabled
+		ChecksumXattrMisses,
+		// Packages whose metadata was taken from a hardlink
+		// analyzed earlier in the same run
+		SharedPackages,
+		// Package records moved out of memory to stay within
+		// the memory limit
+		SpilledPackages,
+		CounterCount
+	};
+	static char const *phaseName(Phase p);
+#ifdef REPODATA_STATS
+	static void enable(int slowestPackages=20);
+	static bool isEnabled() { return _enabled; }
+	/**
+	 * Report of everything collected so far, in JSON format
+	 * @param tool Name of the tool generating the report
+	 */
+	static QByteArray json(String const &tool);
+	/**
+	 * Write the JSON report
+	 * @param tool Name of the tool generating the report
+	 * @param filename File to write to, stdout if empty
+	 */
+	static bool writeJson(String const &tool, QString const &filename=QString());
+	/**
+	 * Write every scope (and every package) as an event in Chrome
+	 * trace event format, for viewing in Perfetto or chrome://tracing
+	 * @param filename File to write the trace to
+	 */
+	static bool enableTrace(QString const &filename);
+	/**
+	 * Periodically print progress (packages done, throughput, ETA,
+	 * current phase) to stderr
+	 */
+	static void enableProgress();
+	/**
+	 * Periodically write metrics to a file in Prometheus text
+	 * exposition format (for node-exporter's textfile collector)
+	 */
+	static void enableMetrics(QString const &filename);
+	/**
+	 * Announce packages that are going to be processed, for
+	 * progress and ETA
+	 */
+	static void addPackagesTotal(quint64 count) { if(_enabled) _packagesTotal += count; }
+	static void count(Counter c, quint64 n=1) { if(_enabled) _counters[c] += n; }
+	/**
+	 * Stop tracing and periodic reporting, writing final results
+	 */
+	static void finish();
+#ifdef REPODATA_ALLOC_PROFILE
+	/**
+	 * Hooks for the allocation profiler (AllocProfile.cpp)
+	 */
+	static void allocated(size_t bytes);
+	static void freed(size_t bytes);
+	/**
+	 * Number of allocations since the program was started (counted
+	 * even if collection isn't enabled)
+	 */
+	static quint64 allocations();
+	/**
+	 * Allocations made in a scope or package
+	 */
+	struct Allocations {
+		quint64 count = 0;
+		quint64 bytes = 0;
+		// Bytes allocated and not freed yet
+		qint64 live = 0;
+		qint64 peak = 0;
+		void add(size_t b) { count++; bytes += b; live += b; if(live > peak) peak = live; }
+		void remove(size_t b) { live -= b; }
+	};
+#endif
+#else
+	static void enable(int=20) {}
+	static constexpr bool isEnabled() { return false; }
+	static QByteArray json(String const &) { return QByteArray(); }
+	static bool writeJson(String const &, QString const & =QString()) { return false; }
+	static bool enableTrace(QString const &) { return false; }
+	static void enableProgress() {}
+	static void enableMetrics(QString const &) {}
+	static void addPackagesTotal(quint64) {}
+	static void count(Counter, quint64=1) {}
+	static void finish() {}
+#endif
+
+	/**
+	 * Time spent in the enclosing block, accounted to a phase.
+	 * Time spent in nested scopes is accounted to the nested
+	 * scopes' phases only.
+	 */
+	class Scope {
+	public:
+#ifdef REPODATA_STATS
+		Scope(Phase p):_active(Stats::isEnabled()) { if(_active) start(p); }
+		~Scope() { if(_active) stop(); }
+		void addBytes(quint64 in, quint64 out) { _bytesIn += in; _bytesOut += out; }
+	private:
+		void start(Phase p);
+		void stop();
+	private:
+		bool		_active;
+		Phase		_phase;
+		Scope		*_parent;
+		qint64		_wallStart;
+		qint64		_cpuStart;
+		qint64		_childWall = 0;
+		qint64		_childCpu = 0;
+		quint64		_bytesIn = 0;
+		quint64		_bytesOut = 0;
+#ifdef REPODATA_ALLOC_PROFILE
+		friend class Stats;
+		Allocations	_allocations;
+#endif
+#else
+		Scope(Phase) {}
+		void addBytes(quint64, quint64) {}
+#endif
+	};
+
+	/**
+	 * Processing of a single package in the enclosing block
+	 */
+	class Package {
+	public:
+#ifdef REPODATA_STATS
+		Package(String const &name):_active(Stats::isEnabled()) { if(_active) start(name); }
+		~Package() { if(_active) stop(); }
+	private:
+		friend class Scope;
+		void start(String const &name);
+		void stop();
+	private:
+		bool		_active;
+		String		_name;
+		Package		*_parent;
+		qint64		_wallStart;
+		qint64		_phaseWall[PhaseCount];
+#ifdef REPODATA_ALLOC_PROFILE
+		friend class Stats;
+		Allocations	_allocations;
+#endif
+#else
+		Package(String const &) {}
+#endif
+	};
+#ifdef REPODATA_STATS
+private:
+	static void report(bool running);
+	static void startReporter();
+private:
+	static bool			_enabled;
+	static std::atomic<quint64>	_packagesTotal;
+	static std::atomic<quint64>	_counters[CounterCount];
+#endif
+};
@@ -1,13 +1,156 @@
+// The vectorized scanners for xmlEncode() are compiled with target
+// attributes and picked at runtime, like the Sha256Engine variants.
 #include "String.h"
 #include <QTextStream>
 #include <iostream>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XMLENCODE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define XMLENCODE_NEON 1
+#endif
+
+// The characters to be escaped come in pairs differing in a single
+// bit: '"' (0x22) and '&' (0x26), '<' (0x3c) and '>' (0x3e). Setting
+// that bit finds both with one comparison.
+static inline bool needsEscaping(char c) {
+	return (c | 4) == '&' || (c | 2) == '>';
+}
+
+/** @return Index of the first character needing escaping, or \p size */
+static qsizetype findSpecialScalar(char const *s, qsizetype size) {
+	qsizetype i = 0;
+	while(i < size && !needsEscaping(s[i]))
+		i++;
+	return i;
+}
+
+#ifdef XMLENCODE_X86
+__attribute__((target("sse2")))
+static qsizetype findSpecialSse2(char const *s, qsizetype size) {
+	__m128i const bit2 = _mm_set1_epi8(4);
+	__m128i const bit1 = _mm_set1_epi8(2);
+	__m128i const amp = _mm_set1_epi8('&');
+	__m128i const gt = _mm_set1_epi8('>');
+	qsizetype i = 0;
+	for(; i + 16 <= size; i += 16) {
+		__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(s + i));
+		__m128i const m = _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(v, bit2), amp), _mm_cmpeq_epi8(_mm_or_si128(v, bit1), gt));
+		if(int const bits = _mm_movemask_epi8(m))
+			return i + __builtin_ctz(bits);
+	}
+	return i + findSpecialScalar(s + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static qsizetype findSpecialAvx2(char const *s, qsizetype size) {
+	__m256i const bit2 = _mm256_set1_epi8(4);
+	__m256i const bit1 = _mm256_set1_epi8(2);
+	__m256i const amp = _mm256_set1_epi8('&');
+	__m256i const gt = _mm256_set1_epi8('>');
+	qsizetype i = 0;
+	for(; i + 32 <= size; i += 32) {
+		__m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i));
+		__m256i const m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_or_si256(v, bit2), amp), _mm256_cmpeq_epi8(_mm256_or_si256(v, bit1), gt));
+		if(unsigned const bits = _mm256_movemask_epi8(m))
+			return i + __builtin_ctz(bits);
+	}
+	// Most strings are short, so the tail matters
+	return i + findSpecialSse2(s + i, size - i);
+}
+#endif
+
+#ifdef XMLENCODE_NEON
+static qsizetype findSpecialNeon(char const *s, qsizetype size) {
+	uint8x16_t const bit2 = vdupq_n_u8(4);
+	uint8x16_t const bit1 = vdupq_n_u8(2);
+	uint8x16_t const amp = vdupq_n_u8('&');
+	uint8x16_t const gt = vdupq_n_u8('>');
+	qsizetype i = 0;
+	for(; i + 16 <= size; i += 16) {
+		uint8x16_t const v = vld1q_u8(reinterpret_cast<uint8_t const*>(s + i));
+		uint8x16_t const m = vorrq_u8(vceqq_u8(vorrq_u8(v, bit2), amp), vceqq_u8(vorrq_u8(v, bit1), gt));
+		if(vmaxvq_u8(m))
+			return i + findSpecialScalar(s + i, 16);
+	}
+	return i + findSpecialScalar(s + i, size - i);
+}
+#endif
+
+static qsizetype findSpecial(char const *s, qsizetype size) {
+	using Scanner = qsizetype (*)(char const *, qsizetype);
+	static Scanner const scanner = []() -> Scanner {
+#if defined(XMLENCODE_X86)
+		if(__builtin_cpu_supports("avx2"))
+			return findSpecialAvx2;
+		if(__builtin_cpu_supports("sse2"))
+			return findSpecialSse2;
+#elif defined(XMLENCODE_NEON)
+		return findSpecialNeon;
+#endif
+		return findSpecialScalar;
+	}();
+	return scanner(s, size);
+}
+
+/** Escape s[0..size), which is known to start with a special character */
+static void appendEscaped(QByteArray &out, char const *s, qsizetype size) {
+	qsizetype pos = 0;
+	for(;;) {
+		qsizetype const special = pos + findSpecial(s + pos, size - pos);
+		out.append(s + pos, special - pos);
+		if(special == size)
+			break;
+		switch(s[special]) {
+		case '&':
+			out.append("&amp;", 5);
+			break;
+		case '<':
+			out.append("&lt;", 4);
+			break;
+		case '>':
+			out.append("&gt;", 4);
+			break;
+		default:
+			out.append("&quot;", 6);
+		}
+		pos = special + 1;
+	}
+}
+
 String String::xmlEncode() const {
-	return String(*this)
-		.replace('&', "&amp;")
-		.replace("<", "&lt;")
-		.replace(">", "&gt;")
-		.replace("\"", "&quot;");
+	qsizetype const first = findSpecial(constData(), size());
+	if(first == size())
+		return *this;
+	String ret;
+	// Room for a few escapes without growing
+	ret.reserve(size() + 32);
+	ret.append(constData(), first);
+	appendEscaped(ret, constData() + first, size() - first);
+	return ret;
+}
+
+void String::appendXmlEncoded(QByteArray &out) const {
+	qsizetype const first = findSpecial(constData(), size());
+	out.append(constData(), first);
+	if(first != size())
+		appendEscaped(out, constData() + first, size() - first);
+}
+
+quint64 String::toSize(bool *ok) const {
+	QByteArray l = trimmed().toUpper();
+	quint64 multiplier = 1;
+	if(l.endsWith('K'))
+		multiplier = 1024;
+	else if(l.endsWith('M'))
+		multiplier = 1024 * 1024;
+	else if(l.endsWith('G'))
+		multiplier = 1024 * 1024 * 1024;
+	if(multiplier > 1)
+		l.chop(1);
+	return l.toULongLong(ok) * multiplier;
 }
 
 std::ostream &operator <<(std::ostream &os, String const &s) {
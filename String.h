@@ -24,7 +24,23 @@ public:
 	operator bool() const { return size(); }
 	operator char const *() const { return constData(); }
 	operator QString() const { return QString::fromUtf8(constData()); }
+	/**
+	 * Escape the characters that can't appear literally in XML
+	 * text and attribute values
+	 * @return The string itself (without a copy) if nothing needs
+	 *         escaping, which is the common case
+	 */
 	String xmlEncode() const;
+	/**
+	 * Append the xmlEncode()d string to \p out, without
+	 * an intermediate copy
+	 */
+	void appendXmlEncoded(QByteArray &out) const;
+	/**
+	 * Parse a size in bytes, with an optional K, M or G suffix
+	 * @param ok Set to \c false if the string isn't a valid size
+	 */
+	quint64 toSize(bool *ok=nullptr) const;
 };
 
 std::ostream &operator <<(std::ostream &os, String const &s);
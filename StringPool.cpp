@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "StringPool.h"
+#include <QSet>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+String Arena::copy(char const *s, qsizetype size) {
+	if(!s)
+		return String();
+	if(size < 0)
+		size = strlen(s);
+	if(!size)
+		return String();
+	size_t const needed = size + 1;
+	char *ret;
+	if(needed > _blockSize) {
+		// Doesn't fit into any block -- give it one of its own
+		// rather than throwing away what's left of the current one
+		_blocks.emplace_back(new char[needed]);
+		_capacity += needed;
+		ret = _blocks.back().get();
+	} else {
+		if(needed > _left) {
+			_blocks.emplace_back(new char[_blockSize]);
+			_capacity += _blockSize;
+			_next = _blocks.back().get();
+			_left = _blockSize;
+		}
+		ret = _next;
+		_next += needed;
+		_left -= needed;
+	}
+	memcpy(ret, s, size);
+	ret[size] = 0;
+	return String(QByteArray::fromRawData(ret, size));
+}
+
+void Arena::clear() {
+	_blocks.clear();
+	_next = nullptr;
+	_left = 0;
+	_capacity = 0;
+}
+
+namespace {
+// Sharded so parallel workers rarely wait for each other
+struct Shard {
+	std::mutex lock;
+	QSet<QByteArrayView> strings;
+	Arena arena;
+};
+constexpr size_t shardCount = 16;
+Shard shards[shardCount];
+std::atomic<size_t> used = 0;
+std::atomic<size_t> limit = 64 * 1024 * 1024;
+}
+
+String StringPool::intern(char const *s, qsizetype size) {
+	if(!s)
+		return String();
+	QByteArrayView const v(s, size < 0 ? qstrlen(s) : size);
+	if(v.isEmpty())
+		return String();
+	Shard &shard = shards[qHash(v) % shardCount];
+	std::lock_guard<std::mutex> l(shard.lock);
+	auto const it = shard.strings.constFind(v);
+	if(it != shard.strings.cend())
+		return String(QByteArray::fromRawData(it->data(), it->size()));
+	if(used + static_cast<size_t>(v.size()) > limit)
+		return String(v.data(), v.size());
+	String ret = shard.arena.copy(v.data(), v.size());
+	shard.strings.insert(QByteArrayView(ret));
+	used += v.size();
+	return ret;
+}
+
+void StringPool::setLimit(size_t bytes) {
+	limit = bytes;
+}
+
+size_t StringPool::size() {
+	return used;
+}
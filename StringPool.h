@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#pragma once
+
+#include "String.h"
+#include <memory>
+#include <vector>
+
+/**
+ * Bump allocator for strings that are freed all at once.
+ *
+ * Strings are copied into large blocks that never move, and handed
+ * out as String objects referring to the copy without owning it
+ * (QByteArray::fromRawData), so creating and copying them neither
+ * allocates nor touches a reference count.
+ *
+ * Not thread-safe.
+ */
+class Arena {
+public:
+	Arena(size_t blockSize=64*1024):_blockSize(blockSize) {}
+	Arena(Arena const &) = delete;
+	Arena &operator=(Arena const &) = delete;
+	/**
+	 * Copy a string into the arena
+	 * @return String referring to the copy, valid as long as the
+	 *         arena exists and isn't cleared. The copy is 0 terminated.
+	 */
+	String copy(char const *s, qsizetype size=-1);
+	/** Number of bytes allocated for the arena */
+	size_t capacity() const { return _capacity; }
+	/** Free all strings, invalidating everything handed out */
+	void clear();
+private:
+	std::vector<std::unique_ptr<char[]>>	_blocks;
+	char		*_next = nullptr;
+	size_t		_left = 0;
+	size_t const	_blockSize;
+	size_t		_capacity = 0;
+};
+
+/**
+ * Process wide pool of strings that recur across many packages
+ * (dependency names and versions, arch, license, vendor, ...).
+ *
+ * Every distinct string is stored once, in an Arena. Pooled strings
+ * are never freed, so they remain valid for the rest of the run.
+ *
+ * Long running processes (daemon, RepoBuilder) keep seeing new
+ * versions, so the pool stops growing once it reaches its limit;
+ * strings that aren't in the pool by then are returned as regular
+ * copies.
+ *
+ * Safe to use from several threads at once.
+ */
+class StringPool {
+public:
+	/**
+	 * Get the pooled copy of a string, adding it to the pool if needed
+	 */
+	static String intern(char const *s, qsizetype size=-1);
+	static String intern(String const &s) { return intern(s.constData(), s.size()); }
+	/** Set the maximum number of bytes to keep in the pool */
+	static void setLimit(size_t bytes);
+	/** Number of bytes of string data in the pool */
+	static size_t size();
+};
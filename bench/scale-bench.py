@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: AGPL-3.0-or-later
+# (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#
+# End-to-end scaling benchmark: generates synthetic repositories with
+# rpm-repo-generator, runs createmd and createmd-perfile on them (from
+# scratch and incrementally after some churn), records wall time, peak
+# RSS and I/O, and compares the results to a stored baseline.
+#
+# Exits with status 1 if anything regressed by more than the tolerance,
+# or if generating metadata from scratch needs more memory for the
+# largest repository than for the smallest one (beyond the allowed
+# growth) -- memory use should not depend on the repository size.
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+
+def run(cmd):
+    """Run a command, returning wall time, peak RSS and block I/O"""
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    _, status, ru = os.wait4(proc.pid, 0)
+    elapsed = time.monotonic() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.exit("%s failed with status %d" % (" ".join(cmd), os.waitstatus_to_exitcode(status)))
+    return {
+        "seconds": elapsed,
+        "max_rss_bytes": ru.ru_maxrss * 1024,
+        "read_bytes": ru.ru_inblock * 512,
+        "write_bytes": ru.ru_oublock * 512,
+    }
+
+
+def generate(args, repo, count):
+    # Generating big repositories takes a while, so reuse them as long
+    # as they were generated with the same parameters and not churned
+    stamp = os.path.join(repo, ".generator-stamp")
+    params = "%d %s %s" % (count, args.seed, args.generator_args)
+    if os.path.exists(stamp) and open(stamp).read() == params:
+        return
+    shutil.rmtree(repo, ignore_errors=True)
+    os.makedirs(repo)
+    subprocess.check_call([args.generator, "-n", str(count), "-s", str(args.seed)] + args.generator_args.split() + [repo])
+    with open(stamp, "w") as f:
+        f.write(params)
+
+
+def churn(args, repo, count, round):
+    os.unlink(os.path.join(repo, ".generator-stamp"))
+    subprocess.check_call([args.generator, "-n", str(count), "-s", str(args.seed + round),
+                           "--churn", str(args.churn / 100.0)] + args.generator_args.split() + [repo],
+                          stderr=subprocess.DEVNULL)
+
+
+def benchmark(args, count):
+    repo = os.path.join(args.workdir, "repo-%d" % count)
+    generate(args, repo, count)
+    shutil.rmtree(os.path.join(repo, "repodata"), ignore_errors=True)
+    results = {}
+    results["createmd"] = run([args.createmd, repo])
+    churn(args, repo, count, 1)
+    results["createmd --update"] = run([args.createmd, "--update", repo])
+    shutil.rmtree(os.path.join(repo, "repodata"), ignore_errors=True)
+    results["createmd-perfile"] = run([args.createmd_perfile, repo])
+    churn(args, repo, count, 2)
+    results["createmd-perfile (incremental)"] = run([args.createmd_perfile, repo])
+    return results
+
+
+def compare(results, baseline, tolerance):
+    regressions = []
+    for key, r in sorted(results.items()):
+        b = baseline.get(key)
+        if not b:
+            continue
+        for metric in ("seconds", "max_rss_bytes"):
+            if b[metric] > 0 and r[metric] > b[metric] * (1 + tolerance):
+                regressions.append("%s: %s %.6g -> %.6g (+%.1f%%)" % (key, metric, b[metric], r[metric],
+                                                                      100.0 * (r[metric] / b[metric] - 1)))
+    return regressions
+
+
+# Scenarios that should run in constant memory. --update keeps the
+# old metadata in memory, so it isn't one of them.
+FLAT_RSS_SCENARIOS = ("createmd", "createmd-perfile")
+
+
+def check_flat_rss(results, sizes, growth):
+    failures = []
+    smallest, largest = min(sizes), max(sizes)
+    if smallest == largest:
+        return failures
+    for scenario in FLAT_RSS_SCENARIOS:
+        small = results.get("%s@%d" % (scenario, smallest))
+        large = results.get("%s@%d" % (scenario, largest))
+        if not small or not large:
+            continue
+        if large["max_rss_bytes"] > small["max_rss_bytes"] * (1 + growth):
+            failures.append("%s: peak RSS %.1f MiB with %d packages, %.1f MiB with %d packages" % (
+                scenario, small["max_rss_bytes"] / 1048576.0, smallest, large["max_rss_bytes"] / 1048576.0, largest))
+    return failures
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__)
+    p.add_argument("--build-dir", default="build", help="Directory containing createmd, createmd-perfile and rpm-repo-generator")
+    p.add_argument("--workdir", default="/tmp/repodata-scale-bench", help="Directory for generated repositories")
+    p.add_argument("--sizes", default="1000,10000,50000", help="Comma separated repository sizes (number of packages)")
+    p.add_argument("--churn", type=float, default=5, help="Percentage of packages changed before incremental runs")
+    p.add_argument("--seed", type=int, default=1, help="Random seed for the generator")
+    p.add_argument("--generator-args", default="", help="Extra arguments for rpm-repo-generator")
+    p.add_argument("--output", help="Write results to this file")
+    p.add_argument("--baseline", help="Baseline to compare results to")
+    p.add_argument("--save-baseline", action="store_true", help="Store the results as the new baseline")
+    p.add_argument("--tolerance", type=float, default=10, help="Allowed regression in percent")
+    p.add_argument("--max-rss-growth", type=float, default=25,
+                   help="Allowed peak RSS growth from the smallest to the largest repository, in percent")
+    args = p.parse_args()
+    args.createmd = os.path.join(args.build_dir, "createmd")
+    args.createmd_perfile = os.path.join(args.build_dir, "createmd-perfile")
+    args.generator = os.path.join(args.build_dir, "rpm-repo-generator")
+
+    results = {}
+    sizes = [int(s) for s in args.sizes.split(",")]
+    for count in sizes:
+        for scenario, r in benchmark(args, count).items():
+            key = "%s@%d" % (scenario, count)
+            results[key] = r
+            print("%-45s %9.2f s %8.1f MiB RSS %9.1f MiB read %9.1f MiB written" % (
+                key, r["seconds"], r["max_rss_bytes"] / 1048576.0,
+                r["read_bytes"] / 1048576.0, r["write_bytes"] / 1048576.0), file=sys.stderr)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    failed = False
+    not_flat = check_flat_rss(results, sizes, args.max_rss_growth / 100.0)
+    if not_flat:
+        print("Memory use depends on repository size:\n  " + "\n  ".join(not_flat), file=sys.stderr)
+        failed = True
+
+    if args.baseline and args.save_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    elif args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.tolerance / 100.0)
+        if regressions:
+            print("Regressions:\n  " + "\n  ".join(regressions), file=sys.stderr)
+            failed = True
+
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
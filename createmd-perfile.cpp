@@ -2,29 +2,85 @@
 // (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
 #include "Rpm.h"
 #include "Sha256.h"
+#include "PackageAnalyzer.h"
+#include "RepoLock.h"
+#include "BulkReader.h"
 #include "Compression.h"
 #include "Archive.h"
-#include <QGuiApplication>
+#include "Manifest.h"
+#include "FragmentStore.h"
+#include "FragmentDictionary.h"
+#include "Concatenator.h"
+#include "Stats.h"
+#include "Fd.h"
+#include <QCoreApplication>
 #include <QCommandLineParser>
 #include <QFile>
 #include <QDir>
 #include <QDomDocument>
+#include <QSet>
 #include <QTextStream>
 #include <iostream>
+#include <atomic>
+#include <optional>
+#include <list>
+#include <memory>
 
 extern "C" {
 #include <time.h>
+#include <unistd.h>
 #include <archive_entry.h>
 }
 
 static bool verbose;
+static bool precompress;
+// Number of packages to read ahead
+static int prefetchWindow;
+// Number of packages to analyze in parallel
+static int jobs;
+
+// File name extensions of unpacked fragments, in the
+// order of FragmentStore::Type
+static constexpr char const *fragmentExtensions[] = {
+	".primary.xml",
+	".filelists.xml",
+	".other.xml",
+	".appstream.xml",
+	".appstream-icons",
+	".primary.xml.xz",
+	".filelists.xml.xz",
+	".other.xml.xz",
+	".appstream.xml.gz"
+};
 
 /**
- * Extract metadata from a package
+ * Turn the metadata of a package into fragments
+ * @param p Metadata of the package, moved into the fragments
+ */
+static Fragments toFragments(PackageRecord &p) {
+	Fragments f;
+	f.pkgid = p.pkgid;
+	f.primary = std::move(p.primary);
+	f.filelists = std::move(p.filelists);
+	f.other = std::move(p.other);
+	f.appstream = std::move(p.appstream);
+	f.icons = std::move(p.icons);
+
+	if(precompress) {
+		f.primaryXz = Compression::compressedData(f.primary);
+		f.filelistsXz = Compression::compressedData(f.filelists);
+		f.otherXz = Compression::compressedData(f.other);
+	}
+	return f;
+}
+
+/**
+ * Write the metadata of a package to individual files
  * @param d Directory containing the package
  * @param rpm rpm filename
+ * @param f Metadata of the package
  */
-static bool extractMetadata(QDir &d, QString const &rpm) {
+static bool writeFragments(QDir &d, QString const &rpm, Fragments const &f) {
 	QDir rd(d.absolutePath() + "/repodata/perfile");
 	if(!rd.exists()) {
 		d.mkdir("repodata", QFile::ReadOwner|QFile::WriteOwner|QFile::ExeOwner|QFile::ReadGroup|QFile::ExeGroup|QFile::ReadOther|QFile::ExeOther);
@@ -35,75 +91,48 @@ static bool extractMetadata(QDir &d, QString const &rpm) {
 		}
 	}
 
-	QFile primary(rd.filePath(rpm + ".primary.xml"));
-	if(!primary.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't write to " << rd.filePath(rpm + ".primary.xml") << std::endl;
-		return false;
-	}
-	QFile filelists(rd.filePath(rpm + ".filelists.xml"));
-	if(!filelists.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't write to " << rd.filePath(rpm + ".filelists.xml") << std::endl;
-		return false;
-	}
-	QFile other(rd.filePath(rpm + ".other.xml"));
-	if(!other.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't write to " << rd.filePath(rpm + ".other.xml") << std::endl;
-		return false;
+	struct {
+		FragmentStore::Type const type;
+		QByteArray const * const data;
+	} const xmlFragments[] = {
+		{ FragmentStore::Primary, &f.primary },
+		{ FragmentStore::Filelists, &f.filelists },
+		{ FragmentStore::Other, &f.other },
+		{ FragmentStore::PrimaryXz, &f.primaryXz },
+		{ FragmentStore::FilelistsXz, &f.filelistsXz },
+		{ FragmentStore::OtherXz, &f.otherXz },
+		{ FragmentStore::AppstreamGz, &f.appstreamGz }
+	};
+	for(auto const &x : xmlFragments) {
+		char const * const ext = fragmentExtensions[x.type];
+		if(x.data->isEmpty()) {
+			// Don't leave an outdated compressed copy behind
+			if(x.type != FragmentStore::Primary && x.type != FragmentStore::Filelists && x.type != FragmentStore::Other)
+				QFile::remove(rd.filePath(rpm + ext));
+			continue;
+		}
+		QFile out(rd.filePath(rpm + ext));
+		if(!out.open(QFile::WriteOnly|QFile::Truncate)) {
+			std::cerr << "Can't write to " << rd.filePath(rpm + ext) << std::endl;
+			return false;
+		}
+		out.write(*x.data);
+		out.close();
 	}
 
-	Rpm r(d.filePath(rpm));
-
-	QTextStream primaryTs(&primary);
-	primaryTs << "<package type=\"rpm\">" << Qt::endl
-		<< "	<name>" << r.name() << "</name>" << Qt::endl
-		<< "	<arch>" << r.arch() << "</arch>" << Qt::endl
-		<< "	<version epoch=\"" << r.epoch() << "\" ver=\"" << r.version() << "\" rel=\"" << r.release() << "\"/>" << Qt::endl
-		<< "	<checksum type=\"sha256\" pkgid=\"YES\">" << r.sha256() << "</checksum>" << Qt::endl
-		<< "	<summary>" << r.summary().xmlEncode() << "</summary>" << Qt::endl
-		<< "	<description>" << r.description().xmlEncode() << "</description>" << Qt::endl
-		<< "	<packager>" << r.packager().xmlEncode() << "</packager>" << Qt::endl
-		<< "	<url>" << r.url().xmlEncode() << "</url>" << Qt::endl
-		<< "	<time file=\"" << r.time() << "\" build=\"" << r.buildTime() << "\"/>" << Qt::endl
-		<< "	<size package=\"" << r.size() << "\" installed=\"" << r.installedSize() << "\" archive=\"" << r.archiveSize() << "\"/>" << Qt::endl
-		<< "	<location href=\"" << rpm << "\"/>" << Qt::endl
-		<< "	<format>" << Qt::endl
-		<< "		<rpm:license>" << r.license().xmlEncode() << "</rpm:license>" << Qt::endl
-		<< "		<rpm:vendor>" << r.vendor().xmlEncode() << "</rpm:vendor>" << Qt::endl
-		<< "		<rpm:group>" << r.group().xmlEncode() << "</rpm:group>" << Qt::endl
-		<< "		<rpm:buildhost>" << r.buildHost() << "</rpm:buildhost>" << Qt::endl
-		<< "		<rpm:sourcerpm>" << r.sourceRpm() << "</rpm:sourcerpm>" << Qt::endl
-		<< "		<rpm:header-range start=\"" << r.headersStart() << "\" end=\"" << r.headersEnd() << "\"/>" << Qt::endl
-		<< r.dependenciesMd()
-		<< r.fileListMd(true)
-		<< "	</format>" << Qt::endl
-		<< "</package>" << Qt::endl;
-
-	QTextStream filelistsTs(&filelists);
-	filelistsTs << "<package pkgid=\"" << r.sha256() << "\" name=\"" << r.name() << "\" arch=\"" << r.arch() << "\">" << Qt::endl
-		<< "	<version " << r.repoMdVersion() << "/>" << Qt::endl
-		<< r.fileListMd()
-		<< "</package>" << Qt::endl;
-
-	QTextStream otherTs(&other);
-	otherTs << "<package pkgid=\"" << r.sha256() << "\" name=\"" << r.name() << "\" arch=\"" << r.arch() << "\">" << Qt::endl
-		<< "	<version " << r.repoMdVersion() << "/>" << Qt::endl
-		<< "</package>" << Qt::endl;
-
-	QHash<String,QByteArray> icons;
-	String appstreamMd = r.appstreamMd(&icons);
-	if(!appstreamMd.isEmpty()) {
+	if(!f.appstream.isEmpty()) {
 		QFile appstream(rd.filePath(rpm + ".appstream.xml"));
 		if(!appstream.open(QFile::WriteOnly|QFile::Truncate)) {
 			std::cerr << "Can't write to " << rd.filePath(rpm + ".appstream.xml") << std::endl;
 			return false;
 		}
-		appstream.write(appstreamMd);
+		appstream.write(f.appstream);
 		appstream.close();
 
 		QDir appstreamIcons(rd.filePath(rpm + ".appstream-icons"));
 		if(appstreamIcons.exists())
 			appstreamIcons.removeRecursively();
-		for(auto icon=icons.cbegin(), iend=icons.cend(); icon != iend; ++icon) {
+		for(auto icon=f.icons.cbegin(), iend=f.icons.cend(); icon != iend; ++icon) {
 			FileName fn=rpm + ".appstream-icons/" + icon.key();
 			rd.mkpath(fn.dirname());
 			QFile iconFile(rd.filePath(fn));
@@ -114,10 +143,6 @@ static bool extractMetadata(QDir &d, QString const &rpm) {
 			iconFile.write(icon.value());
 		}
 	}
-
-	primary.close();
-	filelists.close();
-	other.close();
 	return true;
 }
 
@@ -133,19 +158,64 @@ static bool createMetadata(String const &path) {
 		return false;
 	}
 	for(QString const &rpm : rpms) {
-		extractMetadata(d, rpm);
+		PackageRecord p = PackageRecord::fromRpm(d, rpm);
+		writeFragments(d, rpm, toFragments(p));
 	}
 
 	return true;
 }
 
-static bool cleanup(QDir &d) {
-	QStringList const rpms = d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable);
+static void removeFragments(QDir const &rd, QString const &rpm) {
+	for(int t=0; t<FragmentStore::TypeCount; t++) {
+		if(t != FragmentStore::Icons)
+			QFile::remove(rd.filePath(rpm + fragmentExtensions[t]));
+	}
+	QDir icons(rd.filePath(rpm + ".appstream-icons"));
+	if(icons.exists())
+		icons.removeRecursively();
+}
+
+/**
+ * Remove metadata for packages that no longer exist
+ * @param d Directory containing the packages
+ * @param rpms Packages currently in \p d
+ * @param manifest Manifest of packages with metadata
+ * @param store Fragment store holding the metadata, or \c nullptr if
+ *        the metadata is kept in individual files
+ */
+static bool cleanup(QDir &d, QHash<QString,PackageStat> const &rpms, Manifest &manifest, FragmentStore *store) {
 	QDir rd(d.absolutePath() + "/repodata/perfile");
+	for(auto it=manifest.begin(); it != manifest.end(); ) {
+		if(rpms.contains(it.key())) {
+			++it;
+			continue;
+		}
+		if(verbose)
+			std::cerr << "Stale metadata for: " << qPrintable(it.key()) << std::endl;
+		if(store)
+			store->remove(it.key());
+		else
+			removeFragments(rd, it.key());
+		it = manifest.erase(it);
+	}
+	if(store) {
+		// The store may know about packages the manifest doesn't
+		// if we got interrupted between saving the two
+		for(QString const &p : store->packages()) {
+			if(!rpms.contains(p))
+				store->remove(p);
+		}
+		return true;
+	}
+	if(manifest.exists())
+		return true;
+
+	// No manifest yet (metadata created by an older version, or
+	// interrupted run) -- we have to look at the directory contents
 	QStringList const mdFiles = rd.entryList();
 	for(QString const &file : mdFiles) {
 		if(!file.contains(".rpm.")) {
-			if(file != "." && file != "..")
+			if(file != "." && file != ".." && !file.endsWith(".pack"))
 				std::cerr << "Non-metadata file in metadata directory: " << qPrintable(file) << std::endl;
 			continue;
 		}
@@ -164,37 +234,51 @@ static bool cleanup(QDir &d) {
 	return true;
 }
 
-static QStringList newFiles(QDir &d) {
-	QStringList ret;
-	QStringList const rpms = d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable);
+/**
+ * Populate a new manifest from metadata generated by a version that
+ * didn't write a manifest yet.
+ *
+ * Packages are considered unchanged if their metadata is newer
+ * than the package. This is the only time we have to stat
+ * the metadata files.
+ */
+static void importLegacyMetadata(QDir &d, QHash<QString,PackageStat> const &rpms, Manifest &manifest) {
 	QDir rd(d.absolutePath() + "/repodata/perfile");
-	QStringList const mdFiles = rd.entryList();
-	for(QString const &rpm : rpms) {
-		if(!mdFiles.contains(rpm + ".primary.xml")) {
-			if(verbose)
-				std::cerr << "New file: " << qPrintable(rpm) << std::endl;
-			ret << rpm;
-		}
+	if(!rd.exists())
+		return;
+	for(auto it=rpms.cbegin(), end=rpms.cend(); it != end; ++it) {
+		struct stat s;
+		if(stat(QFile::encodeName(rd.filePath(it.key() + ".primary.xml")), &s))
+			continue;
+		if(s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec < it->mtimeNs)
+			continue;
+		manifest.insert(it.key(), ManifestEntry(*it, String()));
 	}
-	return ret;
 }
 
-static QStringList modifiedFiles(QDir &d) {
+/**
+ * Find packages that are new or have been modified since the
+ * metadata was generated
+ * @param rpms Packages currently in the directory
+ * @param manifest Manifest of packages with metadata
+ * @param store Fragment store holding the metadata, if any
+ * @return Sorted list of packages that need to be (re-)analyzed
+ */
+static QStringList changedFiles(QHash<QString,PackageStat> const &rpms, Manifest const &manifest, FragmentStore const *store) {
 	QStringList ret;
-	QFileInfoList const rpms = d.entryInfoList(QStringList() << "*.rpm", QDir::Files|QDir::Readable);
-	for(QFileInfo const &rpm : rpms) {
-		QString md=d.absolutePath() + "/repodata/perfile/" + rpm.fileName() + ".primary.xml";
-		QFileInfo mdInfo(md);
-		if(!mdInfo.exists()) {
-			std::cerr << "No metadata found for " << qPrintable(rpm.fileName()) << std::endl;
-			continue;
-		}
-		if(mdInfo.lastModified() < rpm.lastModified()) {
+	for(auto it=rpms.cbegin(), end=rpms.cend(); it != end; ++it) {
+		auto const m = manifest.constFind(it.key());
+		if(m == manifest.cend() || (store && !store->contains(it.key()))) {
 			if(verbose)
-				std::cerr << "Modified file: " << qPrintable(rpm.fileName()) << std::endl;
-			ret << rpm.fileName();
+				std::cerr << "New file: " << qPrintable(it.key()) << std::endl;
+			ret << it.key();
+		} else if(static_cast<PackageStat const &>(*m) != *it) {
+			if(verbose)
+				std::cerr << "Modified file: " << qPrintable(it.key()) << std::endl;
+			ret << it.key();
 		}
 	}
+	ret.sort();
 	return ret;
 }
 
@@ -225,30 +309,35 @@ static QStringList recursiveEntryList(QDir const &d, QString const &prefix=QStri
  * and creates the corresponding repomd.xml file.
  *
  * @param d directory containing the metadata
+ * @param precompressed \c true if mergeMetadata() has already
+ *        created the compressed primary, filelists and other files
  * @return \c true on success
  */
 // TODO add some error checking
-static bool finalizeMetadata(QDir const &d) {
+static bool finalizeMetadata(QDir const &d, bool precompressed=false) {
+	Stats::Scope stats(Stats::Finalize);
 	QStringList oldMetadata = d.entryList(QStringList() << "*.?z", QDir::Files);
 
-	Compression::CompressFile(d.absoluteFilePath("primary.xml"));
-	Compression::CompressFile(d.absoluteFilePath("filelists.xml"));
-	Compression::CompressFile(d.absoluteFilePath("other.xml"));
+	if(!precompressed) {
+		Compression::CompressFile(d.absoluteFilePath("primary.xml"));
+		Compression::CompressFile(d.absoluteFilePath("filelists.xml"));
+		Compression::CompressFile(d.absoluteFilePath("other.xml"));
+	}
 	Compression::CompressFile(d.absoluteFilePath("appstream.xml"), Compression::Format::GZip);
 	Compression::CompressFile(d.absoluteFilePath("appstream-icons.tar"), Compression::Format::GZip);
 
-	QHash<String,String> checksum{
-		{"primary", Sha256::checksum(d.absoluteFilePath("primary.xml"))},
-		{"filelists", Sha256::checksum(d.absoluteFilePath("filelists.xml"))},
-		{"other", Sha256::checksum(d.absoluteFilePath("other.xml"))},
-		{"appstream", Sha256::checksum(d.absoluteFilePath("appstream.xml"))},
-		{"appstream-icons", Sha256::checksum(d.absoluteFilePath("appstream-icons.tar"))},
-		{"primaryXZ", Sha256::checksum(d.absoluteFilePath("primary.xml.xz"))},
-		{"filelistsXZ", Sha256::checksum(d.absoluteFilePath("filelists.xml.xz"))},
-		{"otherXZ", Sha256::checksum(d.absoluteFilePath("other.xml.xz"))},
-		{"appstreamGZ", Sha256::checksum(d.absoluteFilePath("appstream.xml.gz"))},
-		{"appstream-iconsGZ", Sha256::checksum(d.absoluteFilePath("appstream-icons.tar.gz"))}
-	};
+	QHash<String,String> const checksum = Sha256::checksums(QHash<String,String>{
+		{"primary", d.absoluteFilePath("primary.xml")},
+		{"filelists", d.absoluteFilePath("filelists.xml")},
+		{"other", d.absoluteFilePath("other.xml")},
+		{"appstream", d.absoluteFilePath("appstream.xml")},
+		{"appstream-icons", d.absoluteFilePath("appstream-icons.tar")},
+		{"primaryXZ", d.absoluteFilePath("primary.xml.xz")},
+		{"filelistsXZ", d.absoluteFilePath("filelists.xml.xz")},
+		{"otherXZ", d.absoluteFilePath("other.xml.xz")},
+		{"appstreamGZ", d.absoluteFilePath("appstream.xml.gz")},
+		{"appstream-iconsGZ", d.absoluteFilePath("appstream-icons.tar.gz")}
+	});
 
 	std::cerr << "mv " << qPrintable(d.absoluteFilePath("primary.xml.xz")) << " " << qPrintable(d.absoluteFilePath(checksum["primaryXZ"] + "-primary.xml.xz")) << std::endl;
 
@@ -258,6 +347,10 @@ static bool finalizeMetadata(QDir const &d) {
 	QFile::rename(d.absoluteFilePath("appstream.xml.gz"), d.absoluteFilePath(checksum["appstreamGZ"] + "-appstream.xml.gz"));
 	QFile::rename(d.absoluteFilePath("appstream-icons.tar.gz"), d.absoluteFilePath(checksum["appstream-iconsGZ"] + "-appstream-icons.tar.gz"));
 
+	QStringList current;
+	for(String const &file : QList<String>{"primaryXZ", "filelistsXZ", "otherXZ", "appstreamGZ", "appstream-iconsGZ"})
+		current << checksum[file];
+
 	QFile repomd(d.absoluteFilePath("repomd.xml"));
 	repomd.open(QFile::WriteOnly|QFile::Truncate);
 	QTextStream repomdTs(&repomd);
@@ -286,13 +379,63 @@ static bool finalizeMetadata(QDir const &d) {
 	repomd.close();
 
 	for(QString const &file : oldMetadata) {
+		// Unchanged metadata has the same checksum (and therefore
+		// file name) as before -- don't remove it
+		if(current.contains(file.section('-', 0, 0)))
+			continue;
 		QFile::remove(d.absoluteFilePath(file));
 	}
 
 	return true;
 }
 
-static bool mergeMetadata(QDir &d, String const &origin="openmandriva") {
+/**
+ * Concatenate the metadata fragments of one type
+ * @param pfd File descriptor of the per-file metadata directory
+ * @param store Fragment store holding the metadata, or \c nullptr if
+ *        the metadata is kept in individual files in \p pfd
+ * @param rpms Packages to be included, in the order they should be written
+ * @param type Fragment type
+ * @param target Output file
+ * @param header Data written before the fragments
+ * @param footer Data written after the fragments
+ * @return Indexes (in \p rpms) of the packages that had a fragment, or
+ *         an empty optional on failure
+ */
+static std::optional<QList<qsizetype>> mergeFragments(int pfd, FragmentStore const *store, QStringList const &rpms, FragmentStore::Type type, QString const &target, QByteArray const &header, QByteArray const &footer) {
+	Concatenator out(QFile::encodeName(target));
+	if(!out.isOpen())
+		return std::nullopt;
+	out.write(header);
+	QList<qsizetype> found;
+	if(store)
+		found = store->appendAll(out, rpms, type);
+	else {
+		QList<QByteArray> fragments;
+		fragments.reserve(rpms.count());
+		for(QString const &rpm : rpms)
+			fragments.append(QFile::encodeName(rpm) + fragmentExtensions[type]);
+		found = out.appendFiles(pfd, fragments);
+	}
+	out.write(footer);
+	if(!out.close()) {
+		std::cerr << "Error writing " << qPrintable(target) << std::endl;
+		return std::nullopt;
+	}
+	return found;
+}
+
+/**
+ * Merge per-file metadata into repository metadata
+ * @param d Directory containing the packages
+ * @param rpms Packages that have per-file metadata, sorted by name
+ * @param store Fragment store holding the metadata, or \c nullptr if
+ *        the metadata is kept in individual files
+ * @param origin Origin identifier for appstream metadata
+ * @param unreadable Receives the packages whose metadata couldn't be
+ *        read -- if there are any, the merge fails
+ */
+static bool mergeMetadata(QDir &d, QStringList const &rpms, FragmentStore const *store, String const &origin, QStringList *unreadable) {
 	QDir rd(d.absolutePath() + "/repodata");
 	QDir pf(d.absolutePath() + "/repodata/perfile");
 	if(!pf.exists()) {
@@ -304,106 +447,113 @@ static bool mergeMetadata(QDir &d, String const &origin="openmandriva") {
 		d.mkdir("repodata/perfile", QFile::ReadOwner|QFile::WriteOwner|QFile::ExeOwner|QFile::ReadGroup|QFile::ExeGroup|QFile::ReadOther|QFile::ExeOther);
 	}
 
-	QFile primary(rd.absoluteFilePath("primary.xml"));
-	if(!primary.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't open " << qPrintable(primary.fileName()) << std::endl;
+	Fd pfd(open(QFile::encodeName(pf.absolutePath()), O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+	if(pfd < 0) {
+		std::cerr << "Can't open " << qPrintable(pf.absolutePath()) << std::endl;
 		return false;
-	} else {
-		QStringList const primaryFiles = pf.entryList(QStringList() << "*.primary.xml", QDir::Files|QDir::Readable, QDir::Name);
-
-		primary.write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-				"<metadata xmlns=\"http://linux.duke.edu/metadata/common\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"");
-		primary.write(QString::number(primaryFiles.count()).toLocal8Bit() );
-		primary.write("\">\n");
-		for(QString const &p : primaryFiles) {
-			QFile f(pf.absoluteFilePath(p));
-			if(!f.open(QFile::ReadOnly)) {
-				std::cerr << "Can't open " << qPrintable(p) << std::endl;
-				continue;
-			}
-			primary.write(f.readAll());
-			f.close();
-		}
-		primary.write("</metadata>");
-		primary.close();
 	}
 
-	QFile filelists(rd.absoluteFilePath("filelists.xml"));
-	if(!filelists.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't open " << qPrintable(filelists.fileName()) << std::endl;
-		return false;
-	} else {
-		QStringList const filelistsFiles = pf.entryList(QStringList() << "*.filelists.xml", QDir::Files|QDir::Readable, QDir::Name);
-
-		filelists.write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-				"<filelists xmlns=\"http://linux.duke.edu/metadata/filelists\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"");
-		filelists.write(QString::number(filelistsFiles.count()).toLocal8Bit() );
-		filelists.write("\">\n");
-		for(QString const &p : filelistsFiles) {
-			QFile f(pf.absoluteFilePath(p));
-			if(!f.open(QFile::ReadOnly)) {
-				std::cerr << "Can't open " << qPrintable(p) << std::endl;
-				continue;
-			}
-			filelists.write(f.readAll());
-			f.close();
-		}
-		filelists.write("</filelists>");
-		filelists.close();
+	// The package count is written before any fragment, so it has
+	// to be determined up front: packages without metadata are left
+	// out, and if one of the others can't be copied, the merge fails
+	QStringList included;
+	for(QString const &rpm : rpms) {
+		if(store ? store->contains(rpm, FragmentStore::Primary) : !faccessat(pfd, QFile::encodeName(rpm + fragmentExtensions[FragmentStore::Primary]).constData(), F_OK, 0))
+			included.append(rpm);
 	}
+	QByteArray const count = QByteArray::number(included.count());
+	struct {
+		FragmentStore::Type const type;
+		FragmentStore::Type const compressedType;
+		Compression::Format const format;
+		char const * const target;
+		QByteArray const header;
+		QByteArray const footer;
+	} const outputs[] = {
+		{ FragmentStore::Primary, FragmentStore::PrimaryXz, Compression::Format::Xz, "primary.xml",
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<metadata xmlns=\"http://linux.duke.edu/metadata/common\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"" + count + "\">\n",
+			"</metadata>" },
+		{ FragmentStore::Filelists, FragmentStore::FilelistsXz, Compression::Format::Xz, "filelists.xml",
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<filelists xmlns=\"http://linux.duke.edu/metadata/filelists\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"" + count + "\">\n",
+			"</filelists>" },
+		{ FragmentStore::Other, FragmentStore::OtherXz, Compression::Format::Xz, "other.xml",
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<otherdata xmlns=\"http://linux.duke.edu/metadata/other\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"" + count + "\">\n",
+			"</otherdata>" },
+		{ FragmentStore::Appstream, FragmentStore::AppstreamGz, Compression::Format::GZip, "appstream.xml",
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<components origin=\"" + origin + "\" version=\"0.14\">\n",
+			"</components>" }
+	};
 
-	QFile other(rd.absoluteFilePath("other.xml"));
-	if(!other.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't open " << qPrintable(other.fileName()) << std::endl;
-		return false;
-	} else {
-		QStringList const otherFiles = pf.entryList(QStringList() << "*.other.xml", QDir::Files|QDir::Readable, QDir::Name);
-
-		other.write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-				"<otherdata xmlns=\"http://linux.duke.edu/metadata/other\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"");
-		other.write(QString::number(otherFiles.count()).toLocal8Bit() );
-		other.write("\">\n");
-		for(QString const &p : otherFiles) {
-			QFile f(pf.absoluteFilePath(p));
-			if(!f.open(QFile::ReadOnly)) {
-				std::cerr << "Can't open " << qPrintable(p) << std::endl;
-				continue;
-			}
-			other.write(f.readAll());
-			f.close();
+	// Every package counted has to be in primary, filelists and other
+	QSet<qsizetype> missing;
+	auto const checkComplete = [&](FragmentStore::Type type, QList<qsizetype> const &found) {
+		if(type == FragmentStore::Appstream || type == FragmentStore::AppstreamGz || found.count() == included.count())
+			return;
+		QSet<qsizetype> const copied(found.cbegin(), found.cend());
+		for(qsizetype i=0; i<included.count(); i++) {
+			if(!copied.contains(i))
+				missing.insert(i);
 		}
-		other.write("</otherdata>");
-		other.close();
-	}
+	};
 
-	QFile appstream(rd.absoluteFilePath("appstream.xml"));
-	if(!appstream.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't open " << qPrintable(appstream.fileName()) << std::endl;
-		return false;
-	} else {
-		QStringList const appstreamFiles = pf.entryList(QStringList() << "*.appstream.xml", QDir::Files|QDir::Readable, QDir::Name);
-
-		appstream.write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-				"<components origin=\"");
-		appstream.write(origin);
-		appstream.write("\" version=\"0.14\">\n");
-		for(QString const &p : appstreamFiles) {
-			QFile f(pf.absoluteFilePath(p));
-			if(!f.open(QFile::ReadOnly)) {
-				std::cerr << "Can't open " << qPrintable(p) << std::endl;
-				continue;
-			}
-			appstream.write(f.readAll());
-			f.close();
+	std::optional<QList<qsizetype>> withAppstream;
+	for(auto const &o : outputs) {
+		std::optional<QList<qsizetype>> const found = mergeFragments(pfd, store, included, o.type, rd.absoluteFilePath(o.target), o.header, o.footer);
+		if(!found)
+			return false;
+		checkComplete(o.type, *found);
+		if(o.type == FragmentStore::Appstream)
+			withAppstream = found;
+		// appstream.xml is small, and GIO based readers stop after the
+		// first member of a multi-member gzip file -- so it is
+		// compressed normally by finalizeMetadata()
+		if(!precompress || o.format != Compression::Format::Xz)
+			continue;
+		// Every fragment is a complete xz stream, and so are the header
+		// and footer -- so the concatenation is a valid xz file without
+		// recompressing anything. libsolv (dnf, zypper) reads only the
+		// first stream of an xz file though, so the streams are then
+		// joined into a single one.
+		QString const target = rd.absoluteFilePath(o.target) + ".xz";
+		QString const streams = target + ".streams";
+		QByteArray const header = Compression::compressedData(o.header, o.format);
+		QByteArray const footer = Compression::compressedData(o.footer, o.format);
+		if(header.isEmpty() || footer.isEmpty())
+			return false;
+		std::optional<QList<qsizetype>> const foundCompressed = mergeFragments(pfd, store, included, o.compressedType, streams, header, footer);
+		if(!foundCompressed)
+			return false;
+		checkComplete(o.compressedType, *foundCompressed);
+		bool const joined = Compression::joinXzStreams(streams, target);
+		QFile::remove(streams);
+		if(!joined) {
+			std::cerr << "Can't join xz streams into " << qPrintable(target) << std::endl;
+			return false;
 		}
-		appstream.write("</components>");
-		appstream.close();
+	}
+	if(!missing.isEmpty()) {
+		for(qsizetype i : missing)
+			unreadable->append(included.at(i));
+		std::cerr << "Metadata of " << missing.count() << " packages in " << qPrintable(d.absolutePath()) << " couldn't be read" << std::endl;
+		return false;
 	}
 
-	QStringList const appstreamIcons = pf.entryList(QStringList() << "*.appstream-icons", QDir::Dirs|QDir::Readable, QDir::Name);
+	// Only packages with appstream metadata can have icons
 	Archive icons(rd.absoluteFilePath("appstream-icons.tar"));
-	for(QString const &iconDir : appstreamIcons) {
-		QDir d(pf.absoluteFilePath(iconDir));
+	for(qsizetype i : *withAppstream) {
+		if(store) {
+			QHash<String,QByteArray> const packageIcons = store->icons(included.at(i));
+			for(auto icon=packageIcons.cbegin(), iend=packageIcons.cend(); icon != iend; ++icon)
+				icons.addFile(icon.key(), icon.value());
+			continue;
+		}
+		QDir d(pf.absoluteFilePath(included.at(i) + ".appstream-icons"));
+		if(!d.exists())
+			continue;
 		QStringList iconFiles = recursiveEntryList(d);
 		for(QString const &file : iconFiles) {
 			QFile f(d.absoluteFilePath(file));
@@ -419,46 +569,183 @@ static bool mergeMetadata(QDir &d, String const &origin="openmandriva") {
 }
 
 int main(int argc, char **argv) {
+	// QtGui is initialized on demand (see Gui)
 	setenv("QT_QPA_PLATFORM", "offscreen", 1);
-	QGuiApplication app(argc, argv);
-	QGuiApplication::setApplicationName("createmd-perfile");
-	QGuiApplication::setApplicationVersion("0.0.1");
+	Rpm::setMinimalConfig();
+	QCoreApplication::setApplicationName("createmd-perfile");
+	QCoreApplication::setApplicationVersion("0.0.1");
+	QStringList args;
+	for(int i=0; i<argc; i++)
+		args.append(QString::fromLocal8Bit(argv[i]));
 
 	QCommandLineParser cp;
 	cp.setApplicationDescription("RPM repository metadata creator");
 	cp.addOptions({
-		{{"c", "cleanup"}, QGuiApplication::translate("main", "Clean up [remove stale metadata files] only")},
-		{{"o", "origin"}, QGuiApplication::translate("main", "Origin identifier to be used (only while generating from scratch)"), "origin"},
-		{{"V", "verbose"}, QGuiApplication::translate("main", "Verbose debugging output")},
+		{{"c", "cleanup"}, QCoreApplication::translate("main", "Clean up [remove stale metadata files] only")},
+		{{"o", "origin"}, QCoreApplication::translate("main", "Origin identifier to be used (only while generating from scratch)"), "origin"},
+		{{"F", "frames"}, QCoreApplication::translate("main", "Keep compressed copies of per-file metadata, so compressed metadata can be assembled without recompressing it (the xz streams are joined into one, so any xz decoder can read the result; appstream.xml.gz is compressed normally)")},
+		{{"p", "packed"}, QCoreApplication::translate("main", "Keep per-file metadata in a few packed files instead of several files per package")},
+		{{"z", "dictionary"}, QCoreApplication::translate("main", "Compress packed per-file metadata with a zstd dictionary trained on the repository (implies --packed)")},
+		{{"V", "verbose"}, QCoreApplication::translate("main", "Verbose debugging output")},
+		{"stats", QCoreApplication::translate("main", "Report where time was spent (supported formats: json)"), "format"},
+		{"stats-file", QCoreApplication::translate("main", "Write the --stats report to a file instead of stdout"), "file"},
+		{"trace", QCoreApplication::translate("main", "Write a trace of all packages and processing stages in Chrome trace event format (for Perfetto, chrome://tracing)"), "file"},
+		{"progress", QCoreApplication::translate("main", "Periodically report progress")},
+		{"metrics", QCoreApplication::translate("main", "Periodically write metrics to a file in Prometheus text format (for node-exporter's textfile collector)"), "file"},
+		{"checksum-xattrs", QCoreApplication::translate("main", "Cache package checksums in extended attributes (user.repodata.sha256) of the packages")},
+		{"prefetch", QCoreApplication::translate("main", "Number of packages to read ahead of the one being processed (0 to disable)"), "count", "4"},
+		{"io-mode", QCoreApplication::translate("main", "How to read packages: cached (leave them in the page cache), dropbehind (remove them from the page cache after reading) or direct (bypass the page cache)"), "mode", "dropbehind"},
+		{"io-limit", QCoreApplication::translate("main", "Limit the bandwidth used for reading packages, in bytes per second (K, M and G suffixes are supported)"), "rate"},
+		{"memory-limit", QCoreApplication::translate("main", "Limit the memory used by package metadata waiting to be written, spilling the rest to a temporary file in the repository (K, M and G suffixes are supported)"), "bytes"},
+		{{"j", "jobs"}, QCoreApplication::translate("main", "Number of packages to analyze in parallel, shared by all repositories (default: number of CPUs)"), "count"},
 	});
 	cp.addHelpOption();
 	cp.addVersionOption();
-	cp.addPositionalArgument("path", QGuiApplication::translate("main", "Directory containing the RPM files"), "[path...]");
-	cp.process(app);
+	cp.addPositionalArgument("path", QCoreApplication::translate("main", "Directory containing the RPM files"), "[path...]");
+	cp.process(args);
 
 	if(cp.positionalArguments().isEmpty()) {
 		std::cerr << "Usage: " << argv[0] << "/path/to/rpm/files" << std::endl;
 		return 1;
 	}
 
+	if(cp.isSet("stats")) {
+		if(cp.value("stats") != "json") {
+			std::cerr << "Unsupported stats format " << qPrintable(cp.value("stats")) << std::endl;
+			return 1;
+		}
+		Stats::enable();
+		if(!Stats::isEnabled())
+			std::cerr << "Built without stats support, ignoring --stats" << std::endl;
+	}
+	if(cp.isSet("trace") && !Stats::enableTrace(cp.value("trace")))
+		std::cerr << "Can't write trace to " << qPrintable(cp.value("trace")) << ", ignoring" << std::endl;
+	if(cp.isSet("progress"))
+		Stats::enableProgress();
+	if(cp.isSet("metrics"))
+		Stats::enableMetrics(cp.value("metrics"));
+	if(cp.isSet("checksum-xattrs"))
+		Sha256::setXattrCache(true);
+	prefetchWindow = cp.value("prefetch").toInt();
+	jobs = cp.isSet("jobs") ? cp.value("jobs").toInt() : PackageAnalyzer::defaultJobs();
+	if(!BulkReader::setMode(cp.value("io-mode"))) {
+		std::cerr << "Unsupported I/O mode " << qPrintable(cp.value("io-mode")) << std::endl;
+		return 1;
+	}
+	if(cp.isSet("io-limit") && !BulkReader::setRateLimit(cp.value("io-limit"))) {
+		std::cerr << "Invalid I/O limit " << qPrintable(cp.value("io-limit")) << std::endl;
+		return 1;
+	}
+	if(cp.isSet("memory-limit") && !PackageAnalyzer::setMemoryLimit(cp.value("memory-limit"))) {
+		std::cerr << "Invalid memory limit " << qPrintable(cp.value("memory-limit")) << std::endl;
+		return 1;
+	}
+
 	bool const cleanupOnly = cp.isSet("c");
+	bool const dictionary = cp.isSet("z");
+	bool const packed = cp.isSet("p") || dictionary;
+	if(dictionary && !FragmentDictionary::isAvailable())
+		std::cerr << "Built without zstd support, not compressing per-file metadata" << std::endl;
+	precompress = cp.isSet("F");
 	verbose = cp.isSet("V");
 	String origin = cp.value("o");
 	if(!origin)
 		origin = "openmandriva";
 
-	for(QString const &path : cp.positionalArguments()) {
+	// All repositories share one pool of workers, and packages
+	// hardlinked into several of them are analyzed only once
+	struct Repository {
+		Repository(QDir const &dir, QString const &manifestFile):d(dir),manifest(manifestFile) {}
+		QDir d;
+		Manifest manifest;
+		std::unique_ptr<FragmentStore> store;
+		QHash<QString,PackageStat> rpms;
+		QStringList changed;
+	};
+	std::list<Repository> repositories;
+	// Set by the finishers, which run on worker threads
+	std::atomic<bool> failed = false;
+	PackageAnalyzer analyzer(jobs, prefetchWindow);
+	// Overlapping runs on a repository are serialized, and
+	// coalesced if more than one is waiting
+	std::list<RepoLock> locks;
+	QStringList const paths = RepoLock::lock(cp.positionalArguments(), locks);
+	for(QString const &path : paths) {
 		QDir d(path);
-		cleanup(d);
-		if(cleanupOnly)
+		QString const perfile = d.absolutePath() + "/repodata/perfile";
+		// Separate manifests, so switching between packed and unpacked
+		// mode (or turning compressed copies on and off) doesn't make
+		// us trust outdated fragments
+		Repository &r = repositories.emplace_back(d, perfile + "/.manifest" + (packed ? "-packed" : "") + (precompress ? "-frames" : ""));
+		if(packed) {
+			r.store = std::make_unique<FragmentStore>(perfile);
+			if(!r.store->isOpen()) {
+				std::cerr << "Can't open fragment store in " << qPrintable(perfile) << ", ignoring" << std::endl;
+				repositories.pop_back();
+				continue;
+			}
+			r.store->setDictionaryCompression(dictionary && FragmentDictionary::isAvailable());
+		}
+		{
+			Stats::Scope stats(Stats::Scan);
+			r.rpms = Manifest::scanPackages(d.absolutePath());
+		}
+		if(!r.manifest.exists() && !r.store)
+			importLegacyMetadata(r.d, r.rpms, r.manifest);
+		cleanup(r.d, r.rpms, r.manifest, r.store.get());
+		if(cleanupOnly) {
+			if(r.store)
+				r.store->save();
+			r.manifest.save();
 			continue;
-		QStringList files = newFiles(d);
-		for(QString const &f : files)
-			extractMetadata(d, f);
-		files = modifiedFiles(d);
-		for(QString const &f : files)
-			extractMetadata(d, f);
-		mergeMetadata(d, origin);
-		finalizeMetadata(d.absoluteFilePath("repodata"));
+		}
+		r.changed = changedFiles(r.rpms, r.manifest, r.store.get());
+		Stats::addPackagesTotal(r.changed.count());
+		Stats::count(Stats::CacheHits, r.rpms.count() - r.changed.count());
+		Stats::count(Stats::CacheMisses, r.changed.count());
+		analyzer.addRepository(r.d, r.changed, [&r](qsizetype index, PackageRecord &record) {
+			QString const &f = r.changed.at(index);
+			Fragments const fragments = toFragments(record);
+			Stats::Scope write(Stats::WriteXml);
+			if(r.store ? r.store->add(f, fragments) : writeFragments(r.d, f, fragments))
+				r.manifest.insert(f, ManifestEntry(r.rpms.value(f), fragments.pkgid));
+		}, [&r, &origin, &failed]() {
+			// The store has to be durable before the manifest
+			// claims its contents are current
+			if(r.store && !r.store->save()) {
+				failed = true;
+				return;
+			}
+			r.manifest.save();
+			QStringList packages = r.manifest.keys();
+			packages.sort();
+			QStringList unreadable;
+			bool merged;
+			{
+				Stats::Scope stats(Stats::WriteXml);
+				merged = mergeMetadata(r.d, packages, r.store.get(), origin, &unreadable);
+			}
+			if(!merged) {
+				// Forget about packages whose metadata is broken,
+				// so the next run analyzes them again
+				for(QString const &p : unreadable) {
+					std::cerr << "Metadata of " << qPrintable(p) << " is unreadable, it will be regenerated on the next run" << std::endl;
+					r.manifest.remove(p);
+					if(r.store)
+						r.store->remove(p);
+				}
+				if(!unreadable.isEmpty() && (!r.store || r.store->save()))
+					r.manifest.save();
+				failed = true;
+				return;
+			}
+			finalizeMetadata(r.d.absoluteFilePath("repodata"), precompress);
+		});
 	}
+	analyzer.run();
+
+	Stats::finish();
+	if(cp.isSet("stats") && Stats::isEnabled() && !Stats::writeJson("createmd-perfile", cp.value("stats-file")))
+		std::cerr << "Can't write stats report" << std::endl;
+	return failed ? 1 : 0;
 }
@@ -2,87 +2,41 @@
 // (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
 #include "Rpm.h"
 #include "Sha256.h"
+#include "Prefetcher.h"
+#include "BulkReader.h"
 #include "Compression.h"
 #include "Archive.h"
+#include "Stats.h"
+#include "MetadataWriter.h"
+#include "Daemon.h"
+#include "PackageAnalyzer.h"
+#include "RecordFile.h"
+#include "RepoLock.h"
 #include <QGuiApplication>
 #include <QCommandLineParser>
 #include <QFile>
 #include <QFileInfo>
 #include <QDir>
 #include <QDomDocument>
+#include <QRegularExpression>
+#include <QSet>
 #include <QTextStream>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <vector>
 
 extern "C" {
 #include <time.h>
 #include <archive_entry.h>
 }
 
-/**
- * Finalize the metadata
- *
- * This compresses the metadata files, renames them to
- * their final names (checksum included in filename),
- * and creates the corresponding repomd.xml file.
- *
- * @param d directory containing the metadata
- * @return \c true on success
- */
-// TODO add some error checking
-static bool finalizeMetadata(QDir const &d) {
-	Compression::CompressFile(d.filePath("primary.xml"));
-	Compression::CompressFile(d.filePath("filelists.xml"));
-	Compression::CompressFile(d.filePath("other.xml"));
-	Compression::CompressFile(d.filePath("appstream.xml"), Compression::Format::GZip);
-	Compression::CompressFile(d.filePath("appstream-icons.tar"), Compression::Format::GZip);
-
-	QHash<String,String> checksum{
-		{"primary", Sha256::checksum(d.filePath("primary.xml"))},
-		{"filelists", Sha256::checksum(d.filePath("filelists.xml"))},
-		{"other", Sha256::checksum(d.filePath("other.xml"))},
-		{"appstream", Sha256::checksum(d.filePath("appstream.xml"))},
-		{"appstream-icons", Sha256::checksum(d.filePath("appstream-icons.tar"))},
-		{"primaryXZ", Sha256::checksum(d.filePath("primary.xml.xz"))},
-		{"filelistsXZ", Sha256::checksum(d.filePath("filelists.xml.xz"))},
-		{"otherXZ", Sha256::checksum(d.filePath("other.xml.xz"))},
-		{"appstreamGZ", Sha256::checksum(d.filePath("appstream.xml.gz"))},
-		{"appstream-iconsGZ", Sha256::checksum(d.filePath("appstream-icons.tar.gz"))}
-	};
-
-	QFile::rename(d.filePath("primary.xml.xz"), d.filePath(checksum["primaryXZ"] + "-primary.xml.xz"));
-	QFile::rename(d.filePath("filelists.xml.xz"), d.filePath(checksum["filelistsXZ"] + "-filelists.xml.xz"));
-	QFile::rename(d.filePath("other.xml.xz"), d.filePath(checksum["otherXZ"] + "-other.xml.xz"));
-	QFile::rename(d.filePath("appstream.xml.gz"), d.filePath(checksum["appstreamGZ"] + "-appstream.xml.gz"));
-	QFile::rename(d.filePath("appstream-icons.tar.gz"), d.filePath(checksum["appstream-iconsGZ"] + "-appstream-icons.tar.gz"));
-
-	QFile repomd(d.filePath("repomd.xml"));
-	repomd.open(QFile::WriteOnly|QFile::Truncate);
-	QTextStream repomdTs(&repomd);
-	time_t timestamp = time(0);
-	repomdTs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << Qt::endl
-		<< "<repomd xmlns=\"http://linux.duke.edu/metadata/repo\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\">" << Qt::endl
-		<< "	<revision>" << timestamp << "</revision>" << Qt::endl;
-	for(String const &file : QList<String>{"primary", "filelists", "other", "appstream", "appstream-icons"}) {
-		String compressedFile = (file.startsWith("appstream")) ? file + "GZ" : file + "XZ";
-		String compressExtension = (file.startsWith("appstream")) ? ".gz" : ".xz";
-		String extension = (file == "appstream-icons") ? ".tar" : ".xml";
-		struct stat s, uncompressed;
-		stat(d.filePath(checksum[compressedFile] + "-" + file + extension + compressExtension).toUtf8(), &s);
-		stat(d.filePath(file + ".xml").toUtf8(), &uncompressed);
-		repomdTs << "	<data type=\"" << file << "\">" << Qt::endl
-			<< "		<checksum type=\"sha256\">" << checksum[compressedFile] << "</checksum>" << Qt::endl
-			<< "		<open-checksum type=\"sha256\">" << checksum[file] << "</open-checksum>" << Qt::endl
-			<< "		<location href=\"repodata/" << checksum[compressedFile] << "-" << file << extension + compressExtension + "\"/>" << Qt::endl
-			<< "		<timestamp>" << s.st_mtime << "</timestamp>" << Qt::endl
-			<< "		<size>" << s.st_size << "</size>" << Qt::endl
-			<< "		<open-size>" << uncompressed.st_size << "</open-size>" << Qt::endl
-			<< "	</data>" << Qt::endl;
-		QFile::remove(d.filePath(file + extension));
-	}
-	repomdTs << "</repomd>" << Qt::endl;
-	repomd.close();
-	return true;
-}
+// Number of packages to read ahead
+static int prefetchWindow;
+// Number of packages to analyze in parallel
+static int jobs;
 
 static bool removeMd(QDomElement &dom, QString const &tag, QString const &attribute, QString const &match) {
 	QDomNodeList n = dom.elementsByTagName(tag);
@@ -181,7 +135,11 @@ static bool updateMetadata(String const &path) {
 		timestamp = oldRepomdFile.fileTime(QFileDevice::FileModificationTime).toSecsSinceEpoch();
 	}
 
-	QFileInfoList rpms = d.entryInfoList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Time);
+	QFileInfoList rpms;
+	{
+		Stats::Scope stats(Stats::Scan);
+		rpms = d.entryInfoList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Time);
+	}
 	QDomElement metadata = oldMetadata["primary"].documentElement();
 	if(metadata.tagName() != "metadata") {
 		std::cerr << "Prior primary.xml seems invalid, ignoring " << path << std::endl;
@@ -223,8 +181,10 @@ static bool updateMetadata(String const &path) {
 		int st = stat(pkgPath, &s);
 
 		// Everything as expected...
-		if(st == 0 && (oldTs == s.st_mtime))
+		if(st == 0 && (oldTs == s.st_mtime)) {
+			Stats::count(Stats::CacheHits);
 			continue;
+		}
 
 		// The package has been removed or changed...
 		String oldChecksum;
@@ -239,12 +199,13 @@ static bool updateMetadata(String const &path) {
 
 		String checksum;
 		if(st == 0)
-			checksum = Sha256::checksum(pkgPath);
+			checksum = Sha256::cachedChecksum(pkgPath);
 
 		if(checksum == oldChecksum) {
 			// File is still the same, just update the metadata
 			t.setAttribute("file", QString::number(s.st_mtime));
 			packagesWithChangedTimestamp.append(pkgFile);
+			Stats::count(Stats::CacheHits);
 			continue;
 		}
 
@@ -259,8 +220,23 @@ static bool updateMetadata(String const &path) {
 		countChange--;
 	}
 
-	QHash<String,QByteArray> iconsToAdd;
+	// The metadata is written to a temporary directory first, new
+	// icons go straight to the icon archive in there as they come
+	// in rather than being collected in memory
+	QString const tempName = MetadataWriter::tempName();
+	d.mkdir(tempName, QFile::ReadOwner|QFile::WriteOwner|QFile::ExeOwner|QFile::ReadGroup|QFile::ExeGroup|QFile::ReadOther|QFile::ExeOther);
+	QDir rd(path + "/" + tempName);
+	if(!rd.exists()) {
+		std::cerr << "Can't create/use repodata directory in " << qPrintable(path) << ", ignoring" << std::endl;
+		return false;
+	}
+	std::unique_ptr<Archive> icons;
+	// Archive paths and filenames of the icons added
+	QSet<QString> addedIcons;
+	QSet<QString> addedIconNames;
 
+	QFileInfoList newPackages;
+	QStringList newPackagePaths;
 	for(QFileInfo const &f : rpms) {
 		if(f.lastModified().toSecsSinceEpoch() < timestamp) {
 			// older than previous metadata, we're done
@@ -270,8 +246,18 @@ static bool updateMetadata(String const &path) {
 		// No need to analyze the file if we already know only the timestamp changed
 		if(packagesWithChangedTimestamp.contains(f.fileName()))
 			continue;
+		newPackages.append(f);
+		newPackagePaths.append(f.filePath());
+	}
+	Stats::addPackagesTotal(newPackages.count());
 
+	Prefetcher prefetcher(newPackagePaths, prefetchWindow);
+	for(qsizetype i=0; i<newPackages.count(); i++) {
+		QFileInfo const &f = newPackages.at(i);
+		Stats::Package stats(f.fileName().toUtf8());
+		Stats::count(Stats::CacheMisses);
 		Rpm r(f.filePath());
+		r.setSha256(prefetcher.checksum(i));
 		String checksum = r.sha256();
 		
 		// Add to primary.xml
@@ -450,8 +436,8 @@ static bool updateMetadata(String const &path) {
 
 		// Add to appstream.xml
 		QDomDocument &appstream = oldMetadata["appstream"];
-		QHash<String,QByteArray> icons;
-		String md = r.appstreamMd(&icons);
+		QHash<String,QByteArray> packageIcons;
+		String md = r.appstreamMd(&packageIcons);
 		// Not every package has something appstream cares about
 		if(md) {
 			QDomDocument newAppstream;
@@ -462,8 +448,18 @@ static bool updateMetadata(String const &path) {
 			QDomNode imp = appstream.importNode(newAppstream.documentElement(), true);
 			components.appendChild(imp);
 
-			for(auto it=icons.begin(), ite=icons.end(); it != ite; ++it)
-				iconsToAdd.insert(it.key(), it.value());
+			for(auto it=packageIcons.cbegin(), ite=packageIcons.cend(); it != ite; ++it) {
+				// If several packages have the same icon, the
+				// first one wins
+				QString const name = it.key();
+				if(addedIcons.contains(name))
+					continue;
+				if(!icons)
+					icons = std::make_unique<Archive>(rd.filePath("appstream-icons.tar"));
+				icons->addFile(it.key(), it.value());
+				addedIcons.insert(name);
+				addedIconNames.insert(QFileInfo(name).fileName());
+			}
 		}
 
 		countChange++;
@@ -474,27 +470,22 @@ static bool updateMetadata(String const &path) {
 	filelists.setAttribute("packages", filelists.attribute("packages").toULongLong()+countChange);
 	otherdata.setAttribute("packages", otherdata.attribute("packages").toULongLong()+countChange);
 
-	String tempName = ".repodata.temp." + String::number(getpid());
-	d.mkdir(tempName, QFile::ReadOwner|QFile::WriteOwner|QFile::ExeOwner|QFile::ReadGroup|QFile::ExeGroup|QFile::ReadOther|QFile::ExeOther);
-	QDir rd(path + "/" + tempName);
-	if(!rd.exists()) {
-		std::cerr << "Can't create/use repodata directory in " << qPrintable(path) << ", ignoring" << std::endl;
-		return false;
-	}
-
 	for(QString const &x : QStringList{"primary", "filelists", "other", "appstream"}) {
+		Stats::Scope stats(Stats::WriteXml);
 		QFile xmlFile(rd.filePath(x + ".xml"));
 		if(!xmlFile.open(QFile::WriteOnly|QFile::Truncate)) {
 			std::cerr << "Can't write to " << qPrintable(xmlFile.fileName()) << std::endl;
 			return false;
 		}
-		xmlFile.write(oldMetadata[x].toByteArray());
+		QByteArray const xml = oldMetadata[x].toByteArray();
+		xmlFile.write(xml);
 		xmlFile.close();
+		stats.addBytes(0, xml.size());
 	}
 
 	// Update appstream-icons.tar if necessary
-	if(iconsToRemove.isEmpty() && iconsToAdd.isEmpty()) {
-		// Until finalizeMetadata() gets smarter, we have to uncompress
+	if(iconsToRemove.isEmpty() && !icons) {
+		// Until MetadataWriter::finalize() gets smarter, we have to uncompress
 		// it anyway so we get uncompressed checksum, size etc.
 		// Ideally at some point we'll just QFile::copy the original
 		// file.
@@ -503,16 +494,16 @@ static bool updateMetadata(String const &path) {
 			iconCache.write(Compression::uncompressedFile(oldIconsFile));
 		iconCache.close();
 	} else {
-		QStringList ignore = iconsToRemove;
-		for(String const &i : iconsToAdd.keys())
-			ignore.append(i);
+		QSet<QString> const ignore(iconsToRemove.cbegin(), iconsToRemove.cend());
+		if(!icons)
+			icons = std::make_unique<Archive>(rd.filePath("appstream-icons.tar"));
 
-		Archive out(rd.filePath("appstream-icons.tar"));
 		archive *in = archive_read_new();
 		archive_read_support_format_all(in);
 		archive_read_support_filter_all(in);
 		if(archive_read_open_filename(in, oldIconsFile.toUtf8(), 16384) != ARCHIVE_OK) {
 			std::cerr << "Can't open icon cache for " << path << std::endl;
+			archive_read_free(in);
 			return false;
 		}
 		archive_entry *e;
@@ -539,196 +530,429 @@ static bool updateMetadata(String const &path) {
 					normalized = sizeDir + QLatin1Char('/') + base;
 			}
 			const QString baseName = QFileInfo(normalized).fileName();
-			// iconsToRemove from XML is often the bare filename; iconsToAdd keys are "NxN/file.png"
-			if (ignore.contains(fn) || ignore.contains(normalized) || ignore.contains(baseName)
+			// iconsToRemove from XML is often the bare filename; added icons are "NxN/file.png"
+			if (ignore.contains(normalized) || ignore.contains(baseName)
 			    || ignore.contains(QString::fromUtf8(fn))) {
 				archive_read_data_skip(in);
 				continue;
 			}
 			// Skip if we're replacing this archive path with a new blob
-			bool replaced = false;
-			for (String const &k : iconsToAdd.keys()) {
-				if (QString(k) == normalized || QFileInfo(QString(k)).fileName() == baseName) {
-					replaced = true;
-					break;
-				}
-			}
-			if (replaced) {
+			if (addedIcons.contains(normalized) || addedIconNames.contains(baseName)) {
 				archive_read_data_skip(in);
 				continue;
 			}
-			size_t size = archive_entry_size(e);
-			char buf[size];
-			int r = archive_read_data(in, &buf, size);
-			Q_UNUSED(r)
-			out.addFile(String(normalized.toUtf8()), QByteArray(buf, size));
+			QByteArray data(archive_entry_size(e), Qt::Uninitialized);
+			if (archive_read_data(in, data.data(), data.size()) != data.size())
+				continue;
+			icons->addFile(String(normalized.toUtf8()), data);
 		}
-
-		for(QHash<String,QByteArray>::ConstIterator it=iconsToAdd.begin(); it!=iconsToAdd.end(); ++it)
-			out.addFile(it.key(), it.value());
+		archive_read_free(in);
 	}
+	icons.reset();
 
-	if(!finalizeMetadata(rd)) {
+	if(!MetadataWriter::finalize(rd)) {
 		std::cerr << "Error while finalizing metadata" << std::endl;
 		return false;
 	}
 
-	QDir realRepodata(path + "/repodata");
-	realRepodata.removeRecursively();
-	d.rename(tempName, "repodata");
+	return MetadataWriter::publish(d, tempName);
+}
 
-	return true;
+/**
+ * Generate metadata for any number of repositories. All of them
+ * share a pool of workers, and packages hardlinked into several of
+ * them are analyzed only once.
+ * @return \c true if all repositories were handled successfully
+ */
+static bool createMetadata(QStringList const &paths, String const &origin="openmandriva") {
+	// Completed records go to a journal, so an interrupted
+	// run can be resumed where it left off
+	struct Repository {
+		Repository(QDir const &dir, QStringList const &packages, String const &origin):d(dir),rpms(packages),writer(dir.absolutePath(), origin, packages.count()),journal(dir.filePath(".repodata.journal")) {}
+		/**
+		 * Write the records taken from the journal that
+		 * come before package \p end
+		 */
+		void resume(qsizetype end) {
+			for(; next < end; next++) {
+				PackageRecord r;
+				// If the journal turns out to be damaged,
+				// the package has to be analyzed after all
+				if(!journal.read(rpms.at(next), r))
+					r = PackageRecord::fromRpm(d, rpms.at(next));
+				writer.add(r);
+			}
+		}
+		QDir d;
+		QStringList rpms;
+		MetadataWriter writer;
+		RecordJournal journal;
+		// Packages that need to be analyzed (indexes in rpms)
+		QList<qsizetype> analyze;
+		qsizetype next = 0;
+	};
+	PackageAnalyzer analyzer(jobs, prefetchWindow);
+	std::list<Repository> repositories;
+	std::atomic<bool> ok = true;
+	for(QString const &path : paths) {
+		QDir d(path);
+		if(!d.exists()) {
+			std::cerr << qPrintable(path) << " not found, ignoring" << std::endl;
+			ok = false;
+			continue;
+		}
+		QStringList rpms;
+		{
+			Stats::Scope stats(Stats::Scan);
+			rpms = d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Name);
+		}
+		if(rpms.isEmpty()) {
+			// Not an error: upload hooks run on empty (or
+			// staging) repositories as well
+			std::cerr << "No rpms found in " << qPrintable(path) << ", ignoring" << std::endl;
+			continue;
+		}
+		Repository &r = repositories.emplace_back(d, rpms, origin);
+		if(!r.writer.isOpen()) {
+			std::cerr << "Couldn't generate metadata for " << qPrintable(path) << ", ignoring" << std::endl;
+			ok = false;
+			continue;
+		}
+		QStringList analyze;
+		for(qsizetype i=0; i<rpms.count(); i++) {
+			if(!r.journal.isCurrent(rpms.at(i), d.filePath(rpms.at(i)))) {
+				r.analyze.append(i);
+				analyze.append(rpms.at(i));
+			}
+		}
+		if(analyze.count() < rpms.count())
+			std::cerr << "Resuming interrupted run in " << qPrintable(path) << ", " << rpms.count() - analyze.count() << " packages done already" << std::endl;
+		Stats::addPackagesTotal(analyze.count());
+		Stats::count(Stats::CacheHits, rpms.count() - analyze.count());
+		Stats::count(Stats::CacheMisses, analyze.count());
+		analyzer.addRepository(d, analyze, [&r](qsizetype index, PackageRecord &record) {
+			qsizetype const position = r.analyze.at(index);
+			r.resume(position);
+			r.journal.add(r.rpms.at(position), record);
+			r.writer.add(record);
+			r.next++;
+		}, [&r, &ok, path]() {
+			r.resume(r.rpms.count());
+			if(!r.writer.finish()) {
+				std::cerr << "Couldn't generate metadata for " << qPrintable(path) << ", ignoring" << std::endl;
+				ok = false;
+				return;
+			}
+			r.journal.remove();
+		});
+	}
+	analyzer.run();
+	return ok;
 }
 
-static bool createMetadata(String const &path, String const &origin="openmandriva") {
-	QDir d(path);
-	if(!d.exists()) {
-		std::cerr << path << " not found, ignoring" << std::endl;
-		return false;
+/**
+ * Shard a package belongs to. Depends on nothing but the filename,
+ * so every machine comes to the same result, and hardlinks of a
+ * package in several repositories end up in the same shard.
+ */
+static quint32 shardOf(QString const &rpm, quint32 shards) {
+	// FNV-1a -- qHash() is seeded per process
+	quint64 h = 0xcbf29ce484222325ULL;
+	for(char const c : rpm.toUtf8()) {
+		h ^= static_cast<unsigned char>(c);
+		h *= 0x100000001b3ULL;
 	}
-	QStringList rpms = d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Name);
-	if(rpms.isEmpty()) {
-		std::cerr << "No rpms found in " << qPrintable(path) << ", ignoring" << std::endl;
-		return false;
+	return h % shards;
+}
+
+static QString shardFile(QDir const &d, quint32 shard, quint32 shards) {
+	return d.filePath(".repodata.shard." + QString::number(shard + 1) + "-of-" + QString::number(shards));
+}
+
+/**
+ * Analyze one shard of the packages of any number of repositories,
+ * writing the records to a shard file in each repository
+ * @param shard Shard to generate (0 based)
+ * @param shards Number of shards
+ * @return \c true if all repositories were handled successfully
+ */
+static bool createShard(QStringList const &paths, quint32 shard, quint32 shards) {
+	PackageAnalyzer analyzer(jobs, prefetchWindow);
+	std::list<RecordWriter> writers;
+	std::atomic<bool> ok = true;
+	for(QString const &path : paths) {
+		QDir d(path);
+		if(!d.exists()) {
+			std::cerr << qPrintable(path) << " not found, ignoring" << std::endl;
+			ok = false;
+			continue;
+		}
+		QStringList all;
+		{
+			Stats::Scope stats(Stats::Scan);
+			all = d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Name);
+		}
+		QStringList rpms;
+		for(QString const &rpm : all) {
+			if(shardOf(rpm, shards) == shard)
+				rpms.append(rpm);
+		}
+		Stats::addPackagesTotal(rpms.count());
+		Stats::count(Stats::CacheMisses, rpms.count());
+		// Every shard carries the complete package list, so the
+		// merge can tell if the shards are consistent and complete
+		RecordWriter &writer = writers.emplace_back(shardFile(d, shard, shards), all, shard, shards);
+		if(!writer.isOpen()) {
+			ok = false;
+			continue;
+		}
+		analyzer.addRepository(d, rpms, [&writer, rpms](qsizetype index, PackageRecord &r) {
+			writer.add(rpms.at(index), r);
+		}, [&writer, &ok, path]() {
+			if(!writer.commit()) {
+				std::cerr << "Couldn't write shard for " << qPrintable(path) << ", ignoring" << std::endl;
+				ok = false;
+			}
+		});
 	}
-	String tempName = ".repodata.temp." + String::number(getpid());
-	d.mkdir(tempName, QFile::ReadOwner|QFile::WriteOwner|QFile::ExeOwner|QFile::ReadGroup|QFile::ExeGroup|QFile::ReadOther|QFile::ExeOther);
-	QDir rd(path + "/" + tempName);
-	if(!rd.exists()) {
-		std::cerr << "Can't create/use repodata directory in " << qPrintable(path) << ", ignoring" << std::endl;
-		return false;
+	analyzer.run();
+	return ok;
+}
+
+/**
+ * Combine the shard files of a repository into its metadata.
+ * The result is identical to generating the metadata on a
+ * single machine (except for timestamps in repomd.xml).
+ */
+static bool mergeShards(String const &path, String const &origin) {
+	QDir d(path);
+	// Only exact names -- QSaveFile's temporaries (left behind by
+	// shards that are still being written, or that crashed) share
+	// the prefix
+	static QRegularExpression const shardName(QStringLiteral("^\\.repodata\\.shard\\.(\\d+)-of-(\\d+)$"));
+	QStringList files;
+	for(QString const &f : d.entryList(QStringList() << ".repodata.shard.*-of-*", QDir::Files|QDir::Hidden, QDir::Name)) {
+		if(shardName.match(f).hasMatch())
+			files.append(f);
 	}
-	QFile primary(rd.filePath("primary.xml"));
-	if(!primary.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't create primary.xml in " << qPrintable(rd.absolutePath()) << ", ignoring" << std::endl;
+	if(files.isEmpty()) {
+		std::cerr << "No shards found in " << path << ", ignoring" << std::endl;
 		return false;
 	}
-	QFile filelists(rd.filePath("filelists.xml"));
-	if(!filelists.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't create filelists.xml in " << qPrintable(rd.absolutePath()) << ", ignoring" << std::endl;
-		return false;
+	std::vector<std::unique_ptr<RecordReader>> readers;
+	std::vector<bool> seen;
+	for(QString const &f : files) {
+		std::unique_ptr<RecordReader> reader = std::make_unique<RecordReader>(d.filePath(f));
+		if(!reader->isOpen()) {
+			std::cerr << "Can't read shard " << qPrintable(f) << " in " << path << ", ignoring" << std::endl;
+			return false;
+		}
+		if(readers.empty())
+			seen.resize(reader->shards());
+		else if(reader->shards() != readers.front()->shards() || reader->packages() != readers.front()->packages()) {
+			std::cerr << "Shards in " << path << " weren't generated from the same set of packages, ignoring" << std::endl;
+			return false;
+		}
+		QRegularExpressionMatch const name = shardName.match(f);
+		if(reader->shard() >= seen.size() || seen[reader->shard()] || name.captured(1).toUInt() != reader->shard() + 1 || name.captured(2).toUInt() != reader->shards()) {
+			std::cerr << "Unexpected shard " << qPrintable(f) << " in " << path << ", ignoring" << std::endl;
+			return false;
+		}
+		seen[reader->shard()] = true;
+		readers.push_back(std::move(reader));
 	}
-	QFile other(rd.filePath("other.xml"));
-	if(!other.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't create other.xml in " << qPrintable(rd.absolutePath()) << ", ignoring" << std::endl;
-		return false;
+	for(size_t i=0; i<seen.size(); i++) {
+		if(!seen[i]) {
+			std::cerr << "Shard " << i + 1 << " of " << seen.size() << " is missing in " << path << ", ignoring" << std::endl;
+			return false;
+		}
 	}
-	QFile appstream(rd.filePath("appstream.xml"));
-	if(!appstream.open(QFile::WriteOnly|QFile::Truncate)) {
-		std::cerr << "Can't create appstream.xml in " << qPrintable(rd.absolutePath()) << ", ignoring" << std::endl;
+
+	// Each shard has its records in the order of the package list,
+	// so the next package is always at the head of one of them
+	QStringList const packages = readers.front()->packages();
+	struct Head {
+		QString rpm;
+		PackageRecord record;
+		bool valid;
+	};
+	std::vector<Head> heads(readers.size());
+	for(size_t i=0; i<readers.size(); i++)
+		heads[i].valid = readers[i]->next(heads[i].rpm, heads[i].record);
+
+	MetadataWriter writer(path, origin, packages.count());
+	if(!writer.isOpen())
 		return false;
+	for(QString const &rpm : packages) {
+		auto const head = std::find_if(heads.begin(), heads.end(), [&rpm](Head const &h) { return h.valid && h.rpm == rpm; });
+		if(head == heads.end()) {
+			std::cerr << "No record for " << qPrintable(rpm) << " in the shards in " << path << ", ignoring" << std::endl;
+			return false;
+		}
+		writer.add(head->record);
+		size_t const i = head - heads.begin();
+		head->valid = readers[i]->next(head->rpm, head->record);
 	}
-	appstream.write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-			"<components origin=\"" + origin + "\" version=\"0.14\">\n");
-	Archive appstreamIcons(rd.filePath("appstream-icons.tar"));
-
-	QTextStream primaryTs(&primary);
-	QTextStream filelistsTs(&filelists);
-	QTextStream otherTs(&other);
-
-	primaryTs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << Qt::endl <<
-		"<metadata xmlns=\"http://linux.duke.edu/metadata/common\" xmlns:rpm=\"http://linux.duke.edu/metadata/rpm\" packages=\"" << rpms.count() << "\">" << Qt::endl;
-
-	filelistsTs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << Qt::endl <<
-		"<filelists xmlns=\"http://linux.duke.edu/metadata/filelists\" packages=\"" << rpms.count() << "\">" << Qt::endl;
-
-	otherTs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << Qt::endl <<
-		"<otherdata xmlns=\"http://linux.duke.edu/metadata/other\" packages=\"" << rpms.count() << "\">" << Qt::endl;
-
-	for(QString const &rpm : rpms) {
-		Rpm r(d.filePath(rpm));
-		primaryTs << "<package type=\"rpm\">" << Qt::endl
-			<< "	<name>" << r.name() << "</name>" << Qt::endl
-			<< "	<arch>" << r.arch() << "</arch>" << Qt::endl
-			<< "	<version epoch=\"" << r.epoch() << "\" ver=\"" << r.version() << "\" rel=\"" << r.release() << "\"/>" << Qt::endl
-			<< "	<checksum type=\"sha256\" pkgid=\"YES\">" << r.sha256() << "</checksum>" << Qt::endl
-			<< "	<summary>" << r.summary().xmlEncode() << "</summary>" << Qt::endl
-			<< "	<description>" << r.description().xmlEncode() << "</description>" << Qt::endl
-			<< "	<packager>" << r.packager().xmlEncode() << "</packager>" << Qt::endl
-			<< "	<url>" << r.url().xmlEncode() << "</url>" << Qt::endl
-			<< "	<time file=\"" << r.time() << "\" build=\"" << r.buildTime() << "\"/>" << Qt::endl
-			<< "	<size package=\"" << r.size() << "\" installed=\"" << r.installedSize() << "\" archive=\"" << r.archiveSize() << "\"/>" << Qt::endl
-			<< "	<location href=\"" << rpm << "\"/>" << Qt::endl
-			<< "	<format>" << Qt::endl
-			<< "		<rpm:license>" << r.license().xmlEncode() << "</rpm:license>" << Qt::endl
-			<< "		<rpm:vendor>" << r.vendor().xmlEncode() << "</rpm:vendor>" << Qt::endl
-			<< "		<rpm:group>" << r.group().xmlEncode() << "</rpm:group>" << Qt::endl
-			<< "		<rpm:buildhost>" << r.buildHost() << "</rpm:buildhost>" << Qt::endl
-			<< "		<rpm:sourcerpm>" << r.sourceRpm() << "</rpm:sourcerpm>" << Qt::endl
-			<< "		<rpm:header-range start=\"" << r.headersStart() << "\" end=\"" << r.headersEnd() << "\"/>" << Qt::endl
-			<< r.dependenciesMd()
-			<< r.fileListMd(true)
-			<< "	</format>" << Qt::endl
-			<< "</package>" << Qt::endl;
-
-		filelistsTs << "<package pkgid=\"" << r.sha256() << "\" name=\"" << r.name() << "\" arch=\"" << r.arch() << "\">" << Qt::endl
-			<< "	<version " << r.repoMdVersion() << "/>" << Qt::endl
-			<< r.fileListMd()
-			<< "</package>" << Qt::endl;
-
-		otherTs << "<package pkgid=\"" << r.sha256() << "\" name=\"" << r.name() << "\" arch=\"" << r.arch() << "\">" << Qt::endl
-			<< "	<version " << r.repoMdVersion() << "/>" << Qt::endl
-			<< "</package>" << Qt::endl;
-
-		QHash<String,QByteArray> icons;
-		appstream.write(r.appstreamMd(&icons));
-		for(auto icon=icons.cbegin(), iend=icons.cend(); icon != iend; ++icon) {
-			appstreamIcons.addFile(icon.key(), icon.value());
-		}
-	}
-	primaryTs << "</metadata>" << Qt::endl;
-	filelistsTs << "</filelists>" << Qt::endl;
-	otherTs << "</otherdata>" << Qt::endl;
-	appstream.write("</components>\n");
-
-	primary.close();
-	filelists.close();
-	other.close();
-	appstream.close();
-	appstreamIcons.close();
-
-	if(!finalizeMetadata(rd)) {
-		std::cerr << "Error while finalizing metadata" << std::endl;
-		return false;
+	for(size_t i=0; i<readers.size(); i++) {
+		if(heads[i].valid || !readers[i]->atEnd()) {
+			std::cerr << "Shard " << readers[i]->shard() + 1 << " in " << path << " is corrupt or has unexpected records, ignoring" << std::endl;
+			return false;
+		}
 	}
-
-	QDir realRepodata(path + "/repodata");
-	realRepodata.removeRecursively();
-	d.rename(tempName, "repodata");
-
+	if(!writer.finish())
+		return false;
+	for(QString const &f : files)
+		d.remove(f);
 	return true;
 }
 
 int main(int argc, char **argv) {
+	// No application object: QtGui is only initialized once an
+	// icon needs converting (see Gui), which needs a platform
+	// plugin that works without a display
 	setenv("QT_QPA_PLATFORM", "offscreen", 1);
-	QGuiApplication app(argc, argv);
-	QGuiApplication::setApplicationName("createmd");
-	QGuiApplication::setApplicationVersion("0.0.1");
+	// Reading packages doesn't need the system's rpm macros
+	Rpm::setMinimalConfig();
+	QCoreApplication::setApplicationName("createmd");
+	QCoreApplication::setApplicationVersion("0.0.1");
+	QStringList args;
+	for(int i=0; i<argc; i++)
+		args.append(QString::fromLocal8Bit(argv[i]));
 
 	QCommandLineParser cp;
 	cp.setApplicationDescription("RPM repository metadata creator");
 	cp.addOptions({
-		{{"u", "update"}, QGuiApplication::translate("main", "Update metadata instead of generating it")},
-		{{"o", "origin"}, QGuiApplication::translate("main", "Origin identifier to be used (only while generating from scratch)"), "origin"},
+		{{"u", "update"}, QCoreApplication::translate("main", "Update metadata instead of generating it")},
+		{{"o", "origin"}, QCoreApplication::translate("main", "Origin identifier to be used (only while generating from scratch)"), "origin"},
+		{"stats", QCoreApplication::translate("main", "Report where time was spent (supported formats: json)"), "format"},
+		{"stats-file", QCoreApplication::translate("main", "Write the --stats report to a file instead of stdout"), "file"},
+		{"trace", QCoreApplication::translate("main", "Write a trace of all packages and processing stages in Chrome trace event format (for Perfetto, chrome://tracing)"), "file"},
+		{"progress", QCoreApplication::translate("main", "Periodically report progress")},
+		{"metrics", QCoreApplication::translate("main", "Periodically write metrics to a file in Prometheus text format (for node-exporter's textfile collector)"), "file"},
+		{"checksum-xattrs", QCoreApplication::translate("main", "Cache package checksums in extended attributes (user.repodata.sha256) of the packages")},
+		{"prefetch", QCoreApplication::translate("main", "Number of packages to read ahead of the one being processed (0 to disable)"), "count", "4"},
+		{"io-mode", QCoreApplication::translate("main", "How to read packages: cached (leave them in the page cache), dropbehind (remove them from the page cache after reading) or direct (bypass the page cache)"), "mode", "dropbehind"},
+		{"io-limit", QCoreApplication::translate("main", "Limit the bandwidth used for reading packages, in bytes per second (K, M and G suffixes are supported)"), "rate"},
+		{"memory-limit", QCoreApplication::translate("main", "Limit the memory used by package metadata waiting to be written, spilling the rest to a temporary file in the repository (K, M and G suffixes are supported)"), "bytes"},
+		{{"j", "jobs"}, QCoreApplication::translate("main", "Number of packages to analyze in parallel, shared by all repositories (default: number of CPUs)"), "count"},
+		{"daemon", QCoreApplication::translate("main", "Keep running, watch the repositories for changes and republish their metadata when they change")},
+		{"socket", QCoreApplication::translate("main", "Accept rescan/publish commands on a Unix socket (with --daemon)"), "path"},
+		{"debounce", QCoreApplication::translate("main", "Time without further changes to wait for before republishing, in milliseconds (with --daemon)"), "ms", "2000"},
+		{"shard", QCoreApplication::translate("main", "Only analyze shard i of N (1 <= i <= N) of the packages, writing the results to a shard file in the repository (combine them with --merge)"), "i/N"},
+		{"merge", QCoreApplication::translate("main", "Generate metadata from the shard files written by --shard runs")},
 	});
 	cp.addHelpOption();
 	cp.addVersionOption();
-	cp.addPositionalArgument("path", QGuiApplication::translate("main", "Directory containing the RPM files"), "[path...]");
-	cp.process(app);
+	cp.addPositionalArgument("path", QCoreApplication::translate("main", "Directory containing the RPM files"), "[path...]");
+	cp.process(args);
 
 	if(cp.positionalArguments().isEmpty()) {
 		std::cerr << "Usage: " << argv[0] << "/path/to/rpm/files" << std::endl;
 		return 1;
 	}
 
+	if(cp.isSet("stats")) {
+		if(cp.value("stats") != "json") {
+			std::cerr << "Unsupported stats format " << qPrintable(cp.value("stats")) << std::endl;
+			return 1;
+		}
+		Stats::enable();
+		if(!Stats::isEnabled())
+			std::cerr << "Built without stats support, ignoring --stats" << std::endl;
+	}
+	if(cp.isSet("trace") && !Stats::enableTrace(cp.value("trace")))
+		std::cerr << "Can't write trace to " << qPrintable(cp.value("trace")) << ", ignoring" << std::endl;
+	if(cp.isSet("progress"))
+		Stats::enableProgress();
+	if(cp.isSet("metrics"))
+		Stats::enableMetrics(cp.value("metrics"));
+	if(cp.isSet("checksum-xattrs"))
+		Sha256::setXattrCache(true);
+	prefetchWindow = cp.value("prefetch").toInt();
+	jobs = cp.isSet("jobs") ? cp.value("jobs").toInt() : PackageAnalyzer::defaultJobs();
+	if(!BulkReader::setMode(cp.value("io-mode"))) {
+		std::cerr << "Unsupported I/O mode " << qPrintable(cp.value("io-mode")) << std::endl;
+		return 1;
+	}
+	if(cp.isSet("io-limit") && !BulkReader::setRateLimit(cp.value("io-limit"))) {
+		std::cerr << "Invalid I/O limit " << qPrintable(cp.value("io-limit")) << std::endl;
+		return 1;
+	}
+	if(cp.isSet("memory-limit") && !PackageAnalyzer::setMemoryLimit(cp.value("memory-limit"))) {
+		std::cerr << "Invalid memory limit " << qPrintable(cp.value("memory-limit")) << std::endl;
+		return 1;
+	}
+
 	bool const update = cp.isSet("u");
 	String origin = cp.value("o");
 	if(!origin)
 		origin = "openmandriva";
 
-	for(QString const &path : cp.positionalArguments()) {
-		bool const ok = update ? updateMetadata(path) : createMetadata(path, origin);
+	if(int(cp.isSet("daemon")) + int(cp.isSet("shard")) + int(cp.isSet("merge")) + int(update) > 1) {
+		std::cerr << "Only one of --daemon, --shard, --merge and --update can be used at a time" << std::endl;
+		return 1;
+	}
+
+	if(cp.isSet("daemon")) {
+		// The daemon needs an event loop. It's running for a long
+		// time, so there's no point in deferring QtGui as well.
+		QGuiApplication app(argc, argv);
+		Daemon daemon(origin, jobs, prefetchWindow, std::max(cp.value("debounce").toInt(), 0));
+		bool ok = false;
+		for(QString const &path : cp.positionalArguments()) {
+			if(daemon.addRepository(path))
+				ok = true;
+		}
+		if(cp.isSet("socket") && daemon.listen(cp.value("socket")))
+			ok = true;
 		if(!ok)
-			std::cerr << "Couldn't generate metadata for " << path << ", ignoring" << std::endl;
+			return 1;
+		int const ret = app.exec();
+		Stats::finish();
+		return ret;
+	}
+
+	// Shards don't touch the published metadata, and the daemon
+	// locks repositories only while publishing
+	std::list<RepoLock> locks;
+	QStringList paths = cp.positionalArguments();
+	if(!cp.isSet("shard")) {
+		paths = RepoLock::lock(paths, locks);
+		if(paths.isEmpty())
+			return 0;
 	}
+
+	// Orchestrators distributing shards need to know if a shard
+	// or merge failed, so failures are reflected in the exit code
+	bool ok = true;
+	if(cp.isSet("merge")) {
+		for(QString const &path : paths) {
+			if(!mergeShards(path, origin)) {
+				std::cerr << "Couldn't merge metadata for " << path << std::endl;
+				ok = false;
+			}
+		}
+	} else if(cp.isSet("shard")) {
+		QStringList const s = cp.value("shard").split('/');
+		quint32 const shards = s.count() == 2 ? s.at(1).toUInt() : 0;
+		quint32 const shard = s.count() == 2 ? s.at(0).toUInt() : 0;
+		if(shard < 1 || shard > shards) {
+			std::cerr << "Invalid shard " << qPrintable(cp.value("shard")) << ", expected i/N with 1 <= i <= N" << std::endl;
+			return 1;
+		}
+		ok = createShard(cp.positionalArguments(), shard - 1, shards);
+	} else if(update) {
+		for(QString const &path : paths) {
+			if(!updateMetadata(path)) {
+				std::cerr << "Couldn't generate metadata for " << path << std::endl;
+				ok = false;
+			}
+		}
+	} else
+		ok = createMetadata(paths, origin);
+
+	Stats::finish();
+	if(cp.isSet("stats") && Stats::isEnabled() && !Stats::writeJson("createmd", cp.value("stats-file")))
+		std::cerr << "Can't write stats report" << std::endl;
+	return ok ? 0 : 1;
 }
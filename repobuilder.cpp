@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+#include "repobuilder.h"
+#include "RepoBuilder.h"
+#include <QDir>
+#include <QCoreApplication>
+#include <cstdlib>
+
+struct repobuilder {
+	RepoBuilder builder;
+	repobuilder(QString const &path, QString const &origin):builder(path, origin) {}
+};
+
+extern "C" {
+
+int repobuilder_init(void) {
+	// Converting icons doesn't need a display
+	if(!QCoreApplication::instance())
+		setenv("QT_QPA_PLATFORM", "offscreen", 0);
+	return RepoBuilder::init() ? 0 : -1;
+}
+
+repobuilder *repobuilder_new(char const *path, char const *origin) {
+	if(!path || !QDir(QString::fromUtf8(path)).exists())
+		return nullptr;
+	return new repobuilder(QString::fromUtf8(path), origin ? QString::fromUtf8(origin) : QStringLiteral("openmandriva"));
+}
+
+void repobuilder_free(repobuilder *b) {
+	delete b;
+}
+
+void repobuilder_set_jobs(repobuilder *b, int jobs) {
+	b->builder.setJobs(jobs);
+}
+
+void repobuilder_set_prefetch_window(repobuilder *b, int packages) {
+	b->builder.setPrefetchWindow(packages);
+}
+
+void repobuilder_set_progress(repobuilder *b, repobuilder_progress_fn progress, void *userdata) {
+	if(!progress) {
+		b->builder.setProgress(RepoBuilder::Progress());
+		return;
+	}
+	b->builder.setProgress([progress, userdata](qsizetype done, qsizetype total, QString const &rpm) {
+		progress(userdata, done, total, rpm.toUtf8().constData());
+	});
+}
+
+int repobuilder_add_package(repobuilder *b, char const *rpm) {
+	return b->builder.addPackage(QString::fromUtf8(rpm)) ? 0 : -1;
+}
+
+int repobuilder_update_package(repobuilder *b, char const *rpm) {
+	return b->builder.updatePackage(QString::fromUtf8(rpm)) ? 0 : -1;
+}
+
+int repobuilder_remove_package(repobuilder *b, char const *rpm) {
+	return b->builder.removePackage(QString::fromUtf8(rpm)) ? 0 : -1;
+}
+
+int repobuilder_rescan(repobuilder *b) {
+	return b->builder.rescan() ? 0 : -1;
+}
+
+long repobuilder_package_count(repobuilder *b) {
+	return b->builder.packages().count();
+}
+
+int repobuilder_is_stale(repobuilder *b) {
+	return b->builder.isStale() ? 1 : 0;
+}
+
+int repobuilder_publish(repobuilder *b, int force) {
+	return b->builder.publish(force) ? 0 : -1;
+}
+
+}
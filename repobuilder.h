@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+/* (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch> */
+#ifndef REPOBUILDER_H
+#define REPOBUILDER_H 1
+
+/*
+ * C interface to RepoBuilder, for generating repository metadata
+ * from within programs that aren't written in C++.
+ *
+ * All strings are UTF-8. Package filenames are relative to the
+ * repository directory. Functions returning int return 0 on
+ * success and -1 on failure, unless noted otherwise.
+ *
+ * Converting icons requires QtGui, which can only be set up on the
+ * main thread: unless the calling program has created a
+ * QGuiApplication, it has to call repobuilder_init() on the main
+ * thread before publishing. repobuilder_publish() fails otherwise.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct repobuilder repobuilder;
+
+/*
+ * Progress callback, called on worker threads (but never concurrently)
+ * after each package that has been analyzed
+ */
+typedef void (*repobuilder_progress_fn)(void *userdata, long done, long total, char const *rpm);
+
+/*
+ * Sets up QtGui (creating a QGuiApplication if there's no Qt application
+ * object yet). Must be called on the main thread.
+ */
+int repobuilder_init(void);
+/* Returns NULL if path doesn't exist. origin may be NULL for the default. */
+repobuilder *repobuilder_new(char const *path, char const *origin);
+void repobuilder_free(repobuilder *b);
+void repobuilder_set_jobs(repobuilder *b, int jobs);
+void repobuilder_set_prefetch_window(repobuilder *b, int packages);
+void repobuilder_set_progress(repobuilder *b, repobuilder_progress_fn progress, void *userdata);
+
+int repobuilder_add_package(repobuilder *b, char const *rpm);
+int repobuilder_update_package(repobuilder *b, char const *rpm);
+int repobuilder_remove_package(repobuilder *b, char const *rpm);
+int repobuilder_rescan(repobuilder *b);
+
+/* Number of packages in the metadata */
+long repobuilder_package_count(repobuilder *b);
+/* Returns 1 if the published metadata is out of date, 0 otherwise */
+int repobuilder_is_stale(repobuilder *b);
+/* Analyzes queued packages and publishes if anything changed (or force is set) */
+int repobuilder_publish(repobuilder *b, int force);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
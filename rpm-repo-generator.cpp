@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+//
+// Generator for synthetic RPM repositories, for benchmarking createmd
+// on production-sized repositories without having to download one.
+//
+// Packages are deterministic for a given seed and package index, so
+// repositories can be regenerated (or partially regenerated to simulate
+// churn) reproducibly.
+#include "String.h"
+#include "Compression.h"
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QBuffer>
+#include <QColor>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QImage>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include <archive.h>
+#include <archive_entry.h>
+#include <rpm/header.h>
+#include <rpm/rpmio.h>
+#include <rpm/rpmlib.h>
+#include <rpm/rpmpgp.h>
+#include <rpm/rpmds.h>
+#include <sys/stat.h>
+}
+
+namespace {
+struct Options {
+	quint32 seed = 1;
+	int filesMin = 1;
+	int filesMax = 200;
+	int requiresMin = 1;
+	int requiresMax = 30;
+	int providesMin = 1;
+	int providesMax = 10;
+	double metainfoShare = 0.05;
+	double desktopShare = 0.08;
+	double iconShare = 0.08;
+	double svgShare = 0.5;
+	Compression::Format compressor = Compression::Format::Zstd;
+	char const *compressorName = "zstd";
+};
+
+struct PackageFile {
+	String path;
+	QByteArray contents;
+	mode_t mode;
+};
+
+/**
+ * Random number in [min, max], biased towards small numbers (log-uniform)
+ * -- most packages are small, a few are huge.
+ */
+int logUniform(std::mt19937 &rng, int min, int max) {
+	if(max <= min)
+		return min;
+	std::uniform_real_distribution<double> d(std::log(min + 1.0), std::log(max + 1.0));
+	return std::clamp(static_cast<int>(std::exp(d(rng))) - 1, min, max);
+}
+
+bool chance(std::mt19937 &rng, double share) {
+	return std::uniform_real_distribution<double>(0, 1)(rng) < share;
+}
+
+String packageName(int index) {
+	return "bench-pkg-" + String::number(index).rightJustified(6, '0');
+}
+
+/**
+ * Somewhat compressible filler content
+ */
+QByteArray filler(std::mt19937 &rng, int size) {
+	static char const * const words[] = { "lorem ", "ipsum ", "dolor ", "sit ", "amet ", "consectetur ", "adipiscing ", "elit ", "sed ", "do ", "eiusmod ", "tempor\n" };
+	QByteArray ret;
+	ret.reserve(size + 16);
+	std::uniform_int_distribution<int> w(0, sizeof(words)/sizeof(*words) - 1);
+	while(ret.size() < size)
+		ret += words[w(rng)];
+	ret.truncate(size);
+	return ret;
+}
+
+QByteArray svgIcon(std::mt19937 &rng) {
+	std::uniform_int_distribution<int> c(0, 0xffffff), p(4, 60);
+	QByteArray ret = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"64\" height=\"64\" viewBox=\"0 0 64 64\">\n"
+		" <rect x=\"4\" y=\"4\" width=\"56\" height=\"56\" rx=\"8\" fill=\"#" + QByteArray::number(c(rng), 16).rightJustified(6, '0') + "\"/>\n";
+	for(int i=0; i<16; i++)
+		ret += " <path d=\"M" + QByteArray::number(p(rng)) + " " + QByteArray::number(p(rng)) +
+			" Q" + QByteArray::number(p(rng)) + " " + QByteArray::number(p(rng)) +
+			" " + QByteArray::number(p(rng)) + " " + QByteArray::number(p(rng)) +
+			"\" stroke=\"#" + QByteArray::number(c(rng), 16).rightJustified(6, '0') + "\" fill=\"none\"/>\n";
+	ret += "</svg>\n";
+	return ret;
+}
+
+QByteArray pngIcon(std::mt19937 &rng) {
+	QImage img(64, 64, QImage::Format_ARGB32);
+	img.fill(QColor::fromRgb(std::uniform_int_distribution<int>(0, 0xffffff)(rng)));
+	QBuffer buf;
+	buf.open(QIODevice::WriteOnly);
+	img.save(&buf, "PNG");
+	return buf.data();
+}
+
+QList<PackageFile> packageFiles(std::mt19937 &rng, Options const &o, String const &name) {
+	QList<PackageFile> files;
+	files.append({"/usr/bin/" + name, filler(rng, logUniform(rng, 1024, 1024*1024)), S_IFREG|0755});
+	files.append({"/etc/" + name + ".conf", filler(rng, 256), S_IFREG|0644});
+	int const count = logUniform(rng, o.filesMin, o.filesMax);
+	for(int i=0; i<count; i++)
+		files.append({"/usr/share/" + name + "/data-" + String::number(i) + ".txt", filler(rng, logUniform(rng, 16, 65536)), S_IFREG|0644});
+
+	bool const desktop = chance(rng, o.desktopShare);
+	bool const metainfo = chance(rng, o.metainfoShare);
+	bool const icon = (desktop || metainfo) && chance(rng, o.iconShare / std::max(o.desktopShare, o.metainfoShare));
+	String const id = "org.example." + name;
+	if(desktop)
+		files.append({"/usr/share/applications/" + id + ".desktop",
+			"[Desktop Entry]\nType=Application\nName=" + name + "\nComment=Benchmark application " + name + "\n"
+			"Exec=" + name + "\nIcon=" + id + "\nCategories=Utility;\n", S_IFREG|0644});
+	if(metainfo)
+		files.append({"/usr/share/metainfo/" + id + ".metainfo.xml",
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<component type=\"desktop-application\">\n"
+			"  <id>" + id + "</id>\n"
+			"  <metadata_license>CC0-1.0</metadata_license>\n"
+			"  <name>" + name + "</name>\n"
+			"  <summary>Benchmark application &amp; test data</summary>\n"
+			"  <description><p>" + filler(rng, 300) + "</p></description>\n"
+			"  <launchable type=\"desktop-id\">" + id + ".desktop</launchable>\n"
+			"</component>\n", S_IFREG|0644});
+	if(icon) {
+		if(chance(rng, o.svgShare))
+			files.append({"/usr/share/icons/hicolor/scalable/apps/" + id + ".svg", svgIcon(rng), S_IFREG|0644});
+		else
+			files.append({"/usr/share/icons/hicolor/64x64/apps/" + id + ".png", pngIcon(rng), S_IFREG|0644});
+	}
+	std::sort(files.begin(), files.end(), [](PackageFile const &a, PackageFile const &b) { return a.path < b.path; });
+	return files;
+}
+
+la_ssize_t appendToByteArray(archive *, void *client, void const *buffer, size_t length) {
+	static_cast<QByteArray*>(client)->append(static_cast<char const*>(buffer), length);
+	return length;
+}
+
+/**
+ * cpio (newc) payload, the way rpm stores it
+ */
+QByteArray payload(QList<PackageFile> const &files, Options const &o, time_t mtime) {
+	QByteArray uncompressed;
+	archive *a = archive_write_new();
+	archive_write_set_format_cpio_newc(a);
+	archive_write_set_bytes_per_block(a, 0);
+	archive_write_open(a, &uncompressed, nullptr, appendToByteArray, nullptr);
+	int inode = 1;
+	for(PackageFile const &f : files) {
+		archive_entry *e = archive_entry_new();
+		archive_entry_set_pathname(e, ("." + f.path).constData());
+		archive_entry_set_size(e, f.contents.size());
+		archive_entry_set_mode(e, f.mode);
+		archive_entry_set_mtime(e, mtime, 0);
+		archive_entry_set_ino(e, inode++);
+		archive_entry_set_nlink(e, 1);
+		archive_write_header(a, e);
+		archive_write_data(a, f.contents.constData(), f.contents.size());
+		archive_entry_free(e);
+	}
+	archive_write_close(a);
+	archive_write_free(a);
+	return Compression::compressedData(uncompressed, o.compressor);
+}
+
+void putStrings(Header h, rpmTagVal tag, QList<QByteArray> const &values) {
+	std::vector<char const*> v;
+	v.reserve(values.count());
+	for(QByteArray const &s : values)
+		v.push_back(s.constData());
+	headerPutStringArray(h, tag, v.data(), v.size());
+}
+
+template<typename T> void putNumbers(Header h, rpmTagVal tag, std::vector<T> const &values) {
+	if constexpr(sizeof(T) == 2)
+		headerPutUint16(h, tag, values.data(), values.size());
+	else
+		headerPutUint32(h, tag, values.data(), values.size());
+}
+
+struct Dependencies {
+	QList<QByteArray> names;
+	QList<QByteArray> versions;
+	std::vector<uint32_t> flags;
+	void add(QByteArray const &name, uint32_t f=0, QByteArray const &version=QByteArray()) {
+		names.append(name);
+		flags.push_back(f);
+		versions.append(version);
+	}
+	void put(Header h, rpmTagVal nameTag, rpmTagVal flagsTag, rpmTagVal versionTag) const {
+		putStrings(h, nameTag, names);
+		putNumbers(h, flagsTag, flags);
+		putStrings(h, versionTag, versions);
+	}
+};
+
+bool writeRpm(QString const &filename, String const &name, int release, QList<PackageFile> const &files, std::mt19937 &rng, Options const &o, int count) {
+	time_t const buildTime = 1700000000;
+	String const version = "1.0";
+	String const rel = String::number(release);
+
+	Header h = headerNew();
+	headerPutString(h, RPMTAG_NAME, name);
+	headerPutString(h, RPMTAG_VERSION, version);
+	headerPutString(h, RPMTAG_RELEASE, rel);
+	headerPutString(h, RPMTAG_SUMMARY, ("Synthetic benchmark package " + name).constData());
+	headerPutString(h, RPMTAG_DESCRIPTION, ("Synthetic package for benchmarking repository metadata generation.\n" + filler(rng, logUniform(rng, 40, 2000))).constData());
+	uint32_t const bt = buildTime;
+	headerPutUint32(h, RPMTAG_BUILDTIME, &bt, 1);
+	headerPutString(h, RPMTAG_BUILDHOST, "bench.example.org");
+	headerPutString(h, RPMTAG_LICENSE, "GPL-2.0-or-later");
+	headerPutString(h, RPMTAG_GROUP, "Benchmark");
+	headerPutString(h, RPMTAG_URL, ("https://example.org/" + name).constData());
+	headerPutString(h, RPMTAG_PACKAGER, "Benchmark <bench@example.org>");
+	headerPutString(h, RPMTAG_VENDOR, "Benchmark");
+	headerPutString(h, RPMTAG_OS, "linux");
+	headerPutString(h, RPMTAG_ARCH, "x86_64");
+	headerPutString(h, RPMTAG_PLATFORM, "x86_64-pc-linux-gnu");
+	headerPutString(h, RPMTAG_RPMVERSION, "4.18.0");
+	headerPutString(h, RPMTAG_ENCODING, "utf-8");
+	headerPutString(h, RPMTAG_SOURCERPM, (name + "-" + version + "-" + rel + ".src.rpm").constData());
+	headerPutString(h, RPMTAG_PAYLOADFORMAT, "cpio");
+	headerPutString(h, RPMTAG_PAYLOADCOMPRESSOR, o.compressorName);
+	headerPutString(h, RPMTAG_PAYLOADFLAGS, "3");
+
+	// File list
+	QList<QByteArray> dirNames, baseNames, digests, empty, users;
+	std::vector<uint32_t> dirIndexes, sizes, mtimes, fileFlags, verifyFlags, devices, inodes;
+	std::vector<uint16_t> modes, rdevs;
+	uint32_t totalSize = 0;
+	for(PackageFile const &f : files) {
+		qsizetype const slash = f.path.lastIndexOf('/');
+		QByteArray const dir = f.path.left(slash + 1);
+		qsizetype d = dirNames.indexOf(dir);
+		if(d < 0) {
+			d = dirNames.count();
+			dirNames.append(dir);
+		}
+		dirIndexes.push_back(d);
+		baseNames.append(f.path.mid(slash + 1));
+		digests.append(QCryptographicHash::hash(f.contents, QCryptographicHash::Sha256).toHex());
+		empty.append(QByteArray());
+		users.append("root");
+		sizes.push_back(f.contents.size());
+		mtimes.push_back(buildTime);
+		fileFlags.push_back(f.path.startsWith("/etc/") ? RPMFILE_CONFIG|RPMFILE_NOREPLACE : 0);
+		verifyFlags.push_back(0xffffffff);
+		devices.push_back(1);
+		inodes.push_back(inodes.size() + 1);
+		modes.push_back(f.mode);
+		rdevs.push_back(0);
+		totalSize += f.contents.size();
+	}
+	putStrings(h, RPMTAG_DIRNAMES, dirNames);
+	putStrings(h, RPMTAG_BASENAMES, baseNames);
+	putNumbers(h, RPMTAG_DIRINDEXES, dirIndexes);
+	putNumbers(h, RPMTAG_FILESIZES, sizes);
+	putNumbers(h, RPMTAG_FILEMODES, modes);
+	putNumbers(h, RPMTAG_FILERDEVS, rdevs);
+	putNumbers(h, RPMTAG_FILEMTIMES, mtimes);
+	putStrings(h, RPMTAG_FILEDIGESTS, digests);
+	putStrings(h, RPMTAG_FILELINKTOS, empty);
+	putNumbers(h, RPMTAG_FILEFLAGS, fileFlags);
+	putStrings(h, RPMTAG_FILEUSERNAME, users);
+	putStrings(h, RPMTAG_FILEGROUPNAME, users);
+	putNumbers(h, RPMTAG_FILEVERIFYFLAGS, verifyFlags);
+	putNumbers(h, RPMTAG_FILEDEVICES, devices);
+	putNumbers(h, RPMTAG_FILEINODES, inodes);
+	putStrings(h, RPMTAG_FILELANGS, empty);
+	uint32_t const digestAlgo = PGPHASHALGO_SHA256;
+	headerPutUint32(h, RPMTAG_FILEDIGESTALGO, &digestAlgo, 1);
+	headerPutUint32(h, RPMTAG_SIZE, &totalSize, 1);
+
+	// Dependencies
+	Dependencies provides, requires;
+	provides.add(name, RPMSENSE_EQUAL, version + "-" + rel);
+	provides.add(name + "(x86-64)", RPMSENSE_EQUAL, version + "-" + rel);
+	int const providesCount = logUniform(rng, o.providesMin, o.providesMax);
+	for(int i=0; i<providesCount; i++)
+		provides.add("bench-capability-" + name + "-" + QByteArray::number(i));
+	std::uniform_int_distribution<int> other(0, std::max(count - 1, 0));
+	requires.add("libc.so.6()(64bit)");
+	int const requiresCount = logUniform(rng, o.requiresMin, o.requiresMax);
+	for(int i=0; i<requiresCount; i++) {
+		if(chance(rng, 0.5))
+			requires.add(packageName(other(rng)), RPMSENSE_GREATER|RPMSENSE_EQUAL, "1.0");
+		else
+			requires.add("bench-capability-" + packageName(other(rng)) + "-0");
+	}
+	provides.put(h, RPMTAG_PROVIDENAME, RPMTAG_PROVIDEFLAGS, RPMTAG_PROVIDEVERSION);
+	requires.put(h, RPMTAG_REQUIRENAME, RPMTAG_REQUIREFLAGS, RPMTAG_REQUIREVERSION);
+
+	QByteArray const data = payload(files, o, buildTime);
+
+	// Signature header -- rpm refuses empty ones, so record the size
+	Header sig = headerNew();
+	uint32_t const sigSize = headerSizeof(h, HEADER_MAGIC_YES) + data.size();
+	headerPutUint32(sig, RPMSIGTAG_SIZE, &sigSize, 1);
+
+	// Lead (legacy, mostly ignored by rpm)
+	unsigned char lead[96] = { 0xed, 0xab, 0xee, 0xdb, 3, 0 };
+	lead[9] = 1; // archnum
+	QByteArray const nevr = name + "-" + version + "-" + rel;
+	memcpy(lead + 10, nevr.constData(), std::min<qsizetype>(nevr.size(), 65));
+	lead[77] = 1; // osnum
+	lead[79] = 5; // RPMSIGTYPE_HEADERSIG
+
+	bool ok = false;
+	FD_t fd = Fopen(QFile::encodeName(filename).constData(), "w.ufdio");
+	if(fd && !Ferror(fd)) {
+		static char const zeros[8] = { 0 };
+		unsigned int const pad = (8 - headerSizeof(sig, HEADER_MAGIC_YES) % 8) % 8;
+		ok = Fwrite(lead, 1, sizeof(lead), fd) == sizeof(lead) &&
+			headerWrite(fd, sig, HEADER_MAGIC_YES) == 0 &&
+			Fwrite(zeros, 1, pad, fd) == pad &&
+			headerWrite(fd, h, HEADER_MAGIC_YES) == 0 &&
+			Fwrite(data.constData(), 1, data.size(), fd) == static_cast<size_t>(data.size());
+	}
+	if(fd)
+		Fclose(fd);
+	headerFree(sig);
+	headerFree(h);
+	return ok;
+}
+
+/**
+ * Generate (or regenerate) a package
+ * @param dir Target directory
+ * @param index Package index
+ * @param release Release to generate -- older releases of the same
+ *        package are removed
+ */
+bool generate(QDir const &dir, int index, int release, Options const &o, int count) {
+	String const name = packageName(index);
+	std::mt19937 rng(o.seed * 1000003u + index);
+	QList<PackageFile> const files = packageFiles(rng, o, name);
+	for(QString const &old : dir.entryList(QStringList() << name + "-1.0-*.x86_64.rpm", QDir::Files))
+		QFile::remove(dir.filePath(old));
+	QString const filename = dir.filePath(name + "-1.0-" + QString::number(release) + ".x86_64.rpm");
+	if(!writeRpm(filename, name, release, files, rng, o, count)) {
+		std::cerr << "Can't write " << qPrintable(filename) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool parseRange(QString const &value, int &min, int &max) {
+	QStringList const r = value.split(':');
+	bool ok1, ok2 = true;
+	min = r.at(0).toInt(&ok1);
+	max = r.count() > 1 ? r.at(1).toInt(&ok2) : min;
+	return ok1 && ok2 && r.count() <= 2 && min >= 0 && max >= min;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+	setenv("QT_QPA_PLATFORM", "offscreen", 1);
+	QGuiApplication app(argc, argv);
+	QGuiApplication::setApplicationName("rpm-repo-generator");
+	QGuiApplication::setApplicationVersion("0.0.1");
+
+	QCommandLineParser cp;
+	cp.setApplicationDescription("Generator for synthetic RPM repositories");
+	cp.addOptions({
+		{{"n", "count"}, QGuiApplication::translate("main", "Number of packages"), "count", "1000"},
+		{{"s", "seed"}, QGuiApplication::translate("main", "Random seed"), "seed", "1"},
+		{{"f", "files"}, QGuiApplication::translate("main", "Range of extra files per package (log-uniform distribution)"), "min:max", "1:200"},
+		{{"r", "requires"}, QGuiApplication::translate("main", "Range of requirements per package"), "min:max", "1:30"},
+		{{"p", "provides"}, QGuiApplication::translate("main", "Range of extra provides per package"), "min:max", "1:10"},
+		{{"m", "metainfo"}, QGuiApplication::translate("main", "Share of packages with metainfo files"), "share", "0.05"},
+		{{"d", "desktop"}, QGuiApplication::translate("main", "Share of packages with desktop files"), "share", "0.08"},
+		{{"i", "icons"}, QGuiApplication::translate("main", "Share of packages with icons (only packages with desktop or metainfo files get icons)"), "share", "0.08"},
+		{{"g", "svg"}, QGuiApplication::translate("main", "Share of icons that are SVG rather than PNG"), "share", "0.5"},
+		{{"c", "compressor"}, QGuiApplication::translate("main", "Payload compressor (gzip, xz, zstd)"), "compressor", "zstd"},
+		{"churn", QGuiApplication::translate("main", "Instead of generating a repository, rebuild a share of the packages in an existing one with a new release (use a different seed for every round of churn)"), "share"},
+	});
+	cp.addHelpOption();
+	cp.addVersionOption();
+	cp.addPositionalArgument("path", QGuiApplication::translate("main", "Directory to generate the repository in"), "path");
+	cp.process(app);
+
+	if(cp.positionalArguments().count() != 1) {
+		std::cerr << "Usage: " << argv[0] << " [options] /path/to/repository" << std::endl;
+		return 1;
+	}
+
+	Options o;
+	int const count = cp.value("n").toInt();
+	o.seed = cp.value("s").toUInt();
+	if(!parseRange(cp.value("f"), o.filesMin, o.filesMax) ||
+	   !parseRange(cp.value("r"), o.requiresMin, o.requiresMax) ||
+	   !parseRange(cp.value("p"), o.providesMin, o.providesMax)) {
+		std::cerr << "Invalid range" << std::endl;
+		return 1;
+	}
+	o.metainfoShare = cp.value("m").toDouble();
+	o.desktopShare = cp.value("d").toDouble();
+	o.iconShare = cp.value("i").toDouble();
+	o.svgShare = cp.value("g").toDouble();
+	QString const compressor = cp.value("c");
+	if(compressor == "gzip")
+		o.compressor = Compression::Format::GZip;
+	else if(compressor == "xz")
+		o.compressor = Compression::Format::Xz;
+	else if(compressor != "zstd") {
+		std::cerr << "Unsupported compressor " << qPrintable(compressor) << std::endl;
+		return 1;
+	}
+	o.compressorName = compressor == "gzip" ? "gzip" : compressor == "xz" ? "xz" : "zstd";
+
+	QDir d(cp.positionalArguments().at(0));
+	if(!d.exists() && !QDir().mkpath(d.path())) {
+		std::cerr << "Can't create " << qPrintable(d.path()) << std::endl;
+		return 1;
+	}
+
+	if(cp.isSet("churn")) {
+		// Rebuild a random selection of packages with the next release
+		double const share = cp.value("churn").toDouble();
+		std::mt19937 rng(o.seed);
+		int rebuilt = 0;
+		for(int i=0; i<count; i++) {
+			if(!chance(rng, share))
+				continue;
+			QStringList const existing = d.entryList(QStringList() << packageName(i) + "-1.0-*.x86_64.rpm", QDir::Files);
+			int release = 1;
+			for(QString const &e : existing)
+				release = std::max(release, e.section('-', -1).section('.', 0, 0).toInt() + 1);
+			if(!generate(d, i, release, o, count))
+				return 1;
+			rebuilt++;
+		}
+		std::cerr << "Rebuilt " << rebuilt << " packages" << std::endl;
+		return 0;
+	}
+
+	for(int i=0; i<count; i++) {
+		if(!generate(d, i, 1, o, count))
+			return 1;
+	}
+	return 0;
+}
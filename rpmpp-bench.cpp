@@ -0,0 +1,491 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// (C) 2023 Bernhard Rosenkränzer <bero@lindev.ch>
+//
+// Microbenchmarks for the hot paths of rpmpp.
+//
+// Benchmarks not involving RPMs run on the synthetic corpus in
+// bench/corpus. RPM benchmarks run on the RPMs in the directory given
+// with --rpms (e.g. one generated by rpm-repo-generator).
+//
+// Results are written as JSON, so they can be compared across commits.
+#include "Rpm.h"
+#include "Archive.h"
+#include "Compression.h"
+#include "DesktopFile.h"
+#include "Icon.h"
+#include "Sha256.h"
+#include "Sha256Engine.h"
+#include "Stats.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRegularExpression>
+#include <QTemporaryDir>
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+}
+
+#ifndef BENCH_CORPUS
+#define BENCH_CORPUS "bench/corpus"
+#endif
+#ifndef BENCH_CREATEMD
+#define BENCH_CREATEMD "createmd"
+#endif
+
+static QRegularExpression filter;
+static double minTime = 0.5;
+static QJsonArray results;
+
+static qint64 now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<qint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static quint64 allocations() {
+#ifdef REPODATA_ALLOC_PROFILE
+	return Stats::allocations();
+#else
+	return 0;
+#endif
+}
+
+static void record(QString const &name, quint64 iterations, qint64 ns, double bytesPerOp, quint64 allocs) {
+	double const nsPerOp = static_cast<double>(ns) / iterations;
+	QJsonObject r{
+		{"name", name},
+		{"iterations", static_cast<qint64>(iterations)},
+		{"ns_per_op", nsPerOp},
+		{"bytes_per_second", bytesPerOp > 0 ? QJsonValue(bytesPerOp * 1e9 / nsPerOp) : QJsonValue()},
+#ifdef REPODATA_ALLOC_PROFILE
+		{"allocs_per_op", static_cast<double>(allocs) / iterations}
+#else
+		{"allocs_per_op", QJsonValue()}
+#endif
+	};
+	results.append(r);
+	std::cerr << qPrintable(name.leftJustified(40)) << " " << qPrintable(QString::number(nsPerOp, 'f', 0).rightJustified(12)) << " ns/op";
+	if(bytesPerOp > 0)
+		std::cerr << " " << qPrintable(QString::number(bytesPerOp * 1e3 / nsPerOp, 'f', 1).rightJustified(10)) << " MB/s";
+	std::cerr << std::endl;
+}
+
+/**
+ * Run an operation repeatedly (in growing batches) for at least
+ * minTime seconds
+ * @param name Name of the benchmark
+ * @param bytesPerOp Bytes processed by a single operation (0 if that
+ *        doesn't make sense)
+ * @param op Operation to benchmark
+ */
+template<typename Op> static void bench(QString const &name, double bytesPerOp, Op op) {
+	if(!filter.match(name).hasMatch())
+		return;
+	op(); // Warm up caches
+	quint64 iterations = 0;
+	quint64 batch = 1;
+	quint64 const allocs = allocations();
+	qint64 const start = now();
+	qint64 elapsed;
+	do {
+		for(quint64 i=0; i<batch; i++)
+			op();
+		iterations += batch;
+		if(batch < 65536)
+			batch *= 2;
+		elapsed = now() - start;
+	} while(elapsed < minTime * 1e9);
+	record(name, iterations, elapsed, bytesPerOp, allocations() - allocs);
+}
+
+/**
+ * Like bench(), but with a setup step for each operation that isn't
+ * included in the timing (for operations that cache their results)
+ */
+template<typename Setup, typename Op> static void bench(QString const &name, double bytesPerOp, Setup setup, Op op) {
+	if(!filter.match(name).hasMatch())
+		return;
+	quint64 iterations = 0;
+	quint64 allocs = 0;
+	qint64 elapsed = 0;
+	qint64 const start = now();
+	do {
+		auto state = setup();
+		quint64 const a = allocations();
+		qint64 const t = now();
+		op(state);
+		elapsed += now() - t;
+		allocs += allocations() - a;
+		iterations++;
+	} while(elapsed < minTime * 1e9 && now() - start < 10 * minTime * 1e9);
+	record(name, iterations, elapsed, bytesPerOp, allocs);
+}
+
+static QList<QByteArray> corpusFiles(QString const &dir, QStringList const &patterns, QStringList *names=nullptr) {
+	QList<QByteArray> ret;
+	QDir d(dir);
+	for(QString const &f : d.entryList(patterns, QDir::Files, QDir::Name)) {
+		QFile file(d.filePath(f));
+		if(!file.open(QFile::ReadOnly))
+			continue;
+		ret.append(file.readAll());
+		if(names)
+			names->append(f);
+	}
+	return ret;
+}
+
+static double averageSize(QList<QByteArray> const &data) {
+	double total = 0;
+	for(QByteArray const &d : data)
+		total += d.size();
+	return data.isEmpty() ? 0 : total / data.count();
+}
+
+static void benchCorpus(QString const &corpus, QString const &tempDir) {
+	QList<QByteArray> lines;
+	for(QByteArray const &text : corpusFiles(corpus + "/text", QStringList() << "*.txt"))
+		lines += text.split('\n');
+	lines.removeAll(QByteArray());
+	if(!lines.isEmpty()) {
+		qsizetype i = 0;
+		bench("String::xmlEncode", averageSize(lines), [&]() {
+			String const s(lines.at(i++ % lines.count()));
+			s.xmlEncode();
+		});
+		i = 0;
+		QByteArray out;
+		bench("String::appendXmlEncoded", averageSize(lines), [&]() {
+			String const s(lines.at(i++ % lines.count()));
+			out.truncate(0);
+			s.appendXmlEncoded(out);
+		});
+	}
+
+	QList<QByteArray> const desktopFiles = corpusFiles(corpus + "/desktop", QStringList() << "*.desktop");
+	if(!desktopFiles.isEmpty()) {
+		qsizetype i = 0;
+		bench("DesktopFile::DesktopFile", averageSize(desktopFiles), [&]() {
+			DesktopFile d(desktopFiles.at(i++ % desktopFiles.count()));
+			d.value("Name");
+		});
+	}
+
+	QStringList svgNames;
+	QList<QByteArray> const svgs = corpusFiles(corpus + "/icons", QStringList() << "*.svg" << "*.svgz", &svgNames);
+	for(qsizetype i=0; i<svgs.count(); i++) {
+		QByteArray const &svg = svgs.at(i);
+		bench("Icon::svgToPng/" + svgNames.at(i), svg.size(), [&]() {
+			Icon::svgToPng(svg, 64);
+		});
+	}
+
+	// Something resembling metadata, large enough for the
+	// compressors to get going
+	QByteArray text;
+	QList<QByteArray> const xml = corpusFiles(corpus + "/metainfo", QStringList() << "*.xml");
+	while(text.size() < 1024*1024) {
+		for(QByteArray const &x : xml)
+			text += x;
+		for(QByteArray const &l : lines)
+			text += l + '\n';
+		if(xml.isEmpty() && lines.isEmpty())
+			break;
+	}
+	if(!text.isEmpty()) {
+		String const source = QFile::encodeName(tempDir + "/metadata.xml");
+		QFile f(source);
+		if(f.open(QFile::WriteOnly|QFile::Truncate)) {
+			f.write(text);
+			f.close();
+			constexpr struct {
+				char const * const name;
+				Compression::Format const format;
+			} formats[] = {
+				{ "gzip", Compression::Format::GZip },
+				{ "bzip2", Compression::Format::Bzip2 },
+				{ "xz", Compression::Format::Xz },
+				{ "zstd", Compression::Format::Zstd },
+				{ "lz4", Compression::Format::LZ4 }
+			};
+			String const target = QFile::encodeName(tempDir + "/metadata.xml.out");
+			for(auto const &format : formats) {
+				bench(QString("Compression::CompressFile/") + format.name, text.size(), [&]() {
+					Compression::CompressFile(source, format.format, target);
+				});
+			}
+		}
+	}
+
+	if(!svgs.isEmpty()) {
+		Archive a(QFile::encodeName(tempDir + "/icons.tar"));
+		quint64 n = 0;
+		bench("Archive::addFile", averageSize(svgs), [&]() {
+			a.addFile("64x64/icon" + String::number(n) + ".svg", svgs.at(n % svgs.count()));
+			n++;
+		});
+	}
+}
+
+static void benchSha256(QString const &tempDir) {
+	QByteArray data(1024*1024, Qt::Uninitialized);
+	for(qsizetype i=0; i<data.size(); i++)
+		data[i] = static_cast<char>(i * 131 + 7);
+	unsigned char const *block = reinterpret_cast<unsigned char const*>(data.constData());
+
+	bench("QCryptographicHash/sha256", data.size(), [&]() {
+		QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+	});
+	for(Sha256Engine::Implementation const &impl : Sha256Engine::available()) {
+		uint32_t state[8][8] = {};
+		bench(QString("Sha256Engine/") + impl.name, data.size(), [&]() {
+			impl.compress(state[0], block, data.size() / 64);
+		});
+		if(impl.compressX8) {
+			unsigned char const * const blocks[8] = { block, block, block, block, block, block, block, block };
+			bench(QString("Sha256Engine/") + impl.name + "-x8", data.size() * 8, [&]() {
+				impl.compressX8(state, blocks, data.size() / 64);
+			});
+		}
+	}
+
+	// Hashing files (in the page cache) through the default implementation
+	QList<String> files;
+	for(int i=0; i<8; i++) {
+		String const name = QFile::encodeName(tempDir + "/sha256-" + QString::number(i));
+		QFile f(name);
+		if(!f.open(QFile::WriteOnly|QFile::Truncate))
+			return;
+		for(int j=0; j<4; j++)
+			f.write(data);
+		f.close();
+		files.append(name);
+	}
+	bench("Sha256::checksum", data.size() * 4, [&]() {
+		Sha256::checksum(files.at(0));
+	});
+	bench("Sha256::checksums", data.size() * 4 * files.count(), [&]() {
+		Sha256::checksums(files);
+	});
+}
+
+static void benchRpms(QString const &dir) {
+	QDir d(dir);
+	QStringList const names = d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Name);
+	if(names.isEmpty()) {
+		std::cerr << "No rpms found in " << qPrintable(dir) << ", skipping rpm benchmarks" << std::endl;
+		return;
+	}
+	std::vector<std::unique_ptr<Rpm>> rpms;
+	double fileSize = 0, headerSize = 0;
+	for(QString const &n : names) {
+		rpms.push_back(std::make_unique<Rpm>(d.filePath(n)));
+		fileSize += rpms.back()->size();
+		headerSize += rpms.back()->headersEnd();
+	}
+	fileSize /= rpms.size();
+	headerSize /= rpms.size();
+
+	size_t i = 0;
+	bench("Rpm::Rpm", headerSize, [&]() {
+		Rpm r(d.filePath(names.at(i++ % names.count())));
+	});
+
+	i = 0;
+	bench("Rpm::sha256", fileSize, [&]() {
+		return std::make_unique<Rpm>(d.filePath(names.at(i++ % names.count())));
+	}, [](std::unique_ptr<Rpm> &r) {
+		r->sha256();
+	});
+
+	i = 0;
+	bench("Rpm::dependencies", 0, [&]() {
+		Rpm const &r = *rpms[i++ % rpms.size()];
+		for(DepType t : {DepType::Provides, DepType::Requires, DepType::Conflicts, DepType::Obsoletes, DepType::Recommends, DepType::Suggests, DepType::Supplements, DepType::Enhances})
+			r.dependencies(t);
+	});
+
+	i = 0;
+	bench("Rpm::dependenciesMd", 0, [&]() {
+		rpms[i++ % rpms.size()]->dependenciesMd();
+	});
+
+	i = 0;
+	bench("Rpm::fileList", 0, [&]() {
+		rpms[i++ % rpms.size()]->fileList();
+	});
+
+	i = 0;
+	bench("Rpm::fileListMd", 0, [&]() {
+		rpms[i++ % rpms.size()]->fileListMd();
+	});
+
+	// Packages containing something appstream related, and the
+	// files extractFiles() would be asked for
+	std::vector<Rpm const *> appstreamRpms;
+	QList<QList<String>> appstreamFiles;
+	double appstreamSize = 0;
+	for(auto const &r : rpms) {
+		QList<String> files;
+		for(FileInfo const &fi : r->fileList()) {
+			if(fi.name().startsWith("/usr/share/metainfo/") || fi.name().startsWith("/usr/share/appdata/") || fi.name().startsWith("/usr/share/applications/"))
+				files.append(fi.name());
+		}
+		if(files.isEmpty())
+			continue;
+		appstreamRpms.push_back(r.get());
+		appstreamFiles.append(files);
+		appstreamSize += r->size();
+	}
+	if(appstreamRpms.empty()) {
+		std::cerr << "No rpms with appstream data found, skipping appstream benchmarks" << std::endl;
+		return;
+	}
+	appstreamSize /= appstreamRpms.size();
+
+	i = 0;
+	bench("Rpm::extractFiles", appstreamSize, [&]() {
+		size_t const n = i++ % appstreamRpms.size();
+		appstreamRpms[n]->extractFiles(appstreamFiles.at(n));
+	});
+
+	i = 0;
+	bench("Rpm::appstreamMd", appstreamSize, [&]() {
+		QHash<String,QByteArray> icons;
+		appstreamRpms[i++ % appstreamRpms.size()]->appstreamMd(&icons);
+	});
+}
+
+/**
+ * Run createmd on a repository, with its output discarded
+ * @return \c false if it couldn't be run or failed
+ */
+static bool runCreatemd(String const &createmd, String const &repo) {
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	char *args[] = { const_cast<char*>(createmd.constData()), const_cast<char*>(repo.constData()), nullptr };
+	pid_t pid;
+	int const err = posix_spawn(&pid, createmd, &actions, nullptr, args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if(err)
+		return false;
+	int status;
+	while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Cold start: running createmd on repositories that are so small
+ * that starting up and initializing make up most of the runtime
+ */
+static void benchStartup(QString const &createmd, QString const &tempDir, QString const &rpmDir) {
+	if(!filter.match("startup/createmd-empty").hasMatch() && !filter.match("startup/createmd-small").hasMatch())
+		return;
+	String const exe = QFile::encodeName(createmd);
+	String const empty = QFile::encodeName(tempDir + "/startup-empty");
+	QDir().mkpath(empty);
+	if(!runCreatemd(exe, empty)) {
+		std::cerr << "Can't run " << exe << ", skipping startup benchmarks" << std::endl;
+		return;
+	}
+	bench("startup/createmd-empty", 0, [&]() {
+		runCreatemd(exe, empty);
+	});
+
+	if(rpmDir.isEmpty())
+		return;
+	// A small staging repository, with a handful of packages
+	// linked from the rpm benchmark directory
+	QDir const d(rpmDir);
+	QDir const smallDir(tempDir + "/startup-small");
+	smallDir.mkpath(".");
+	for(QString const &n : d.entryList(QStringList() << "*.rpm", QDir::Files|QDir::Readable, QDir::Name).mid(0, 5)) {
+		if(link(QFile::encodeName(d.filePath(n)), QFile::encodeName(smallDir.filePath(n))))
+			QFile::copy(d.filePath(n), smallDir.filePath(n));
+	}
+	String const small = QFile::encodeName(smallDir.path());
+	bench("startup/createmd-small", 0, [&]() {
+		runCreatemd(exe, small);
+	});
+}
+
+int main(int argc, char **argv) {
+	// Like in the tools, the icon benchmarks initialize QtGui
+	// when they need it
+	setenv("QT_QPA_PLATFORM", "offscreen", 1);
+	// Same rpm configuration as createmd
+	Rpm::setMinimalConfig();
+	QCoreApplication::setApplicationName("rpmpp-bench");
+	QCoreApplication::setApplicationVersion("0.0.1");
+	QStringList args;
+	for(int i=0; i<argc; i++)
+		args.append(QString::fromLocal8Bit(argv[i]));
+
+	QCommandLineParser cp;
+	cp.setApplicationDescription("Microbenchmarks for rpmpp");
+	cp.addOptions({
+		{{"c", "corpus"}, QCoreApplication::translate("main", "Directory containing the benchmark corpus"), "dir", BENCH_CORPUS},
+		{{"r", "rpms"}, QCoreApplication::translate("main", "Directory containing RPMs for the RPM benchmarks (skipped if not given)"), "dir"},
+		{{"f", "filter"}, QCoreApplication::translate("main", "Only run benchmarks whose name matches a regular expression"), "regex"},
+		{{"t", "min-time"}, QCoreApplication::translate("main", "Minimum time to run each benchmark for, in seconds"), "seconds", "0.5"},
+		{{"o", "output"}, QCoreApplication::translate("main", "Write results to a file instead of stdout"), "file"},
+		{"createmd", QCoreApplication::translate("main", "createmd binary to measure startup times with"), "path", BENCH_CREATEMD},
+	});
+	cp.addHelpOption();
+	cp.addVersionOption();
+	cp.process(args);
+
+	filter.setPattern(cp.value("f"));
+	if(!filter.isValid()) {
+		std::cerr << "Invalid filter: " << qPrintable(filter.errorString()) << std::endl;
+		return 1;
+	}
+	minTime = cp.value("t").toDouble();
+	if(minTime <= 0)
+		minTime = 0.5;
+
+	QTemporaryDir tempDir;
+	if(!tempDir.isValid()) {
+		std::cerr << "Can't create temporary directory" << std::endl;
+		return 1;
+	}
+
+	benchCorpus(cp.value("c"), tempDir.path());
+	benchSha256(tempDir.path());
+	if(cp.isSet("r"))
+		benchRpms(cp.value("r"));
+	benchStartup(cp.value("createmd"), tempDir.path(), cp.value("r"));
+
+	QJsonObject report{
+		{"benchmarks", results},
+#ifdef REPODATA_ALLOC_PROFILE
+		{"allocation_counting", true}
+#else
+		{"allocation_counting", false}
+#endif
+	};
+	QFile out(cp.value("o"));
+	if(cp.isSet("o") ? !out.open(QFile::WriteOnly|QFile::Truncate) : !out.open(stdout, QFile::WriteOnly)) {
+		std::cerr << "Can't write results" << std::endl;
+		return 1;
+	}
+	out.write(QJsonDocument(report).toJson());
+	return 0;
+}